@@ -29,6 +29,16 @@ void mark(bitmask_t &mask, size_t i);
  */
 size_t get(bitmask_t &mask);
 
+/*!
+ * Get the first free register starting from a preferred index; fall back to the
+ * first free register if nothing above the preferred index is free.
+ * @param mask reference to the mask integer.
+ * @param from preferred lowest index.
+ * @param limit number of usable registers.
+ * @return free register index.
+ */
+size_t get(bitmask_t &mask, size_t from, size_t limit);
+
 /*!
  * The Graph class. Represents a group of unlimited register to be colored.
  */
@@ -55,6 +65,14 @@ public:
      * @return a pair of colored register on the left; or the register failed to be colored on the right.
      */
     std::pair <std::vector<size_t>, std::vector<size_t>> color(size_t colors);
+
+    /*!
+     * Color the graph with register preference.
+     * @param colors number of colors.
+     * @param preferred the lowest color each node should try first (empty means no preference).
+     * @return a pair of colored register on the left; or the register failed to be colored on the right.
+     */
+    std::pair <std::vector<size_t>, std::vector<size_t>> color(size_t colors, const std::vector<size_t> &preferred);
 };
 
 #endif //GRAPH_COLORING_GRAPH_H
@@ -0,0 +1,186 @@
+/**
+ * Pass manager of the Virtual MIPS IR.
+ * Runs an ordered list of function passes over a function or a whole module, keeps the cached analyses
+ * of each function up to date and records the time and instruction counts of every pass.
+ */
+#ifndef BACKEND_PASS_H
+#define BACKEND_PASS_H
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <ostream>
+#include <functional>
+#include <phmap.h>
+
+namespace vmips {
+
+    struct Function;
+    struct Module;
+
+    /*!
+     * Set of analyses, combined from the Analysis bits.
+     */
+    using AnalysisSet = unsigned;
+
+    /*!
+     * The Analysis struct. Bits of the analyses cached by a function.
+     */
+    struct Analysis {
+        enum : AnalysisSet {
+            None = 0,         /**< no analysis */
+            CFG = 1,          /**< predecessors, reverse postorder, dominators and loops (Function::cfg) */
+            Liveness = 2,     /**< lifetime of the registers in each CFGNode (CFGNode::lives) */
+            Interference = 4, /**< neighbours of the registers in the coloring graph (VirtReg::neighbors) */
+            All = 7           /**< every analysis */
+        };
+    };
+
+    /*!
+     * The FunctionPass struct. A named transformation of a function.
+     */
+    struct FunctionPass {
+        /*!
+         * Name of the pass, used for ordering and reporting.
+         */
+        std::string name;
+        /*!
+         * The transformation.
+         */
+        std::function<void(Function &)> run;
+        /*!
+         * Analyses that must be valid before the pass runs (computed on demand).
+         */
+        AnalysisSet required;
+        /*!
+         * Analyses that are still valid after the pass runs; everything else is invalidated.
+         */
+        AnalysisSet preserved;
+
+        /*!
+         * FunctionPass constructor.
+         * @param name name of the pass.
+         * @param run the transformation.
+         * @param required analyses that must be valid before the pass runs.
+         * @param preserved analyses that are still valid after the pass runs.
+         */
+        FunctionPass(std::string name, std::function<void(Function &)> run,
+                     AnalysisSet required = Analysis::None, AnalysisSet preserved = Analysis::None)
+                : name(std::move(name)), run(std::move(run)), required(required), preserved(preserved) {}
+    };
+
+    /*!
+     * The PassStatistics struct. Accumulated measurements of a pass.
+     */
+    struct PassStatistics {
+        /*!
+         * Number of functions the pass ran on.
+         */
+        size_t runs = 0;
+        /*!
+         * Total wall time.
+         */
+        std::chrono::nanoseconds time{0};
+        /*!
+         * Total number of instructions before the pass.
+         */
+        size_t instructions_before = 0;
+        /*!
+         * Total number of instructions after the pass.
+         */
+        size_t instructions_after = 0;
+    };
+
+    /*!
+     * The PassManager class. Holds an ordered pipeline of function passes.
+     */
+    class PassManager {
+        /*!
+         * The pipeline.
+         */
+        std::vector<FunctionPass> passes;
+        /*!
+         * Measurements of each pass, by name.
+         */
+        phmap::flat_hash_map<std::string, PassStatistics> statistics;
+
+        /*!
+         * Locate a pass.
+         * @param name name of the pass.
+         * @return position in the pipeline.
+         */
+        std::vector<FunctionPass>::iterator find(const std::string &name);
+
+    public:
+        /*!
+         * Append a pass to the pipeline.
+         * @param pass the pass.
+         */
+        void add(FunctionPass pass);
+
+        /*!
+         * Insert a pass before an existing one.
+         * @param name name of the existing pass.
+         * @param pass the new pass.
+         * @return whether the existing pass was found.
+         */
+        bool add_before(const std::string &name, FunctionPass pass);
+
+        /*!
+         * Insert a pass after an existing one.
+         * @param name name of the existing pass.
+         * @param pass the new pass.
+         * @return whether the existing pass was found.
+         */
+        bool add_after(const std::string &name, FunctionPass pass);
+
+        /*!
+         * Remove a pass from the pipeline.
+         * @param name name of the pass.
+         * @return whether the pass was found.
+         */
+        bool remove(const std::string &name);
+
+        /*!
+         * Get the names of the passes in pipeline order.
+         * @return pass names.
+         */
+        std::vector<std::string> names() const;
+
+        /*!
+         * Run the pipeline on a function.
+         * @param function target function.
+         */
+        void run(Function &function);
+
+        /*!
+         * Run the pipeline on every defined function of a module, callees before callers.
+         * @param module target module.
+         */
+        void run(Module &module);
+
+        /*!
+         * Get the measurements of a pass.
+         * @param name name of the pass.
+         * @return accumulated statistics (empty if the pass never ran).
+         */
+        PassStatistics statistics_of(const std::string &name) const;
+
+        /*!
+         * Print the measurements of all passes, one line per pass.
+         * @param out output stream.
+         */
+        void report(std::ostream &out) const;
+
+        /*!
+         * Build the standard code generation pipeline: optimizations, block layout, scheduling (before
+         * allocation), coloring, call overlap scanning, memory allocation, scheduling (after allocation) and
+         * delay slot filling. The optimization, layout, scheduling and delay slot passes follow the settings
+         * of each function.
+         * @return the pipeline.
+         */
+        static PassManager standard();
+    };
+}
+
+#endif //BACKEND_PASS_H
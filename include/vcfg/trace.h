@@ -0,0 +1,132 @@
+/**
+ * Compilation tracing of the Virtual MIPS IR.
+ * Scoped spans are recorded into a ring buffer owned by the current thread and can be exported
+ * in the Chrome trace event format (chrome://tracing, Perfetto).
+ * Spans are only compiled in when VMIPS_TRACING is defined to a non-zero value; otherwise
+ * VMIPS_TRACE_SCOPE expands to nothing and its arguments are never evaluated.
+ */
+#ifndef BACKEND_TRACE_H
+#define BACKEND_TRACE_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <cstdint>
+
+#ifndef VMIPS_TRACING
+#define VMIPS_TRACING 0
+#endif
+
+namespace vmips {
+
+    /*!
+     * Print a string as a JSON string literal.
+     * @param out output stream.
+     * @param s the string.
+     */
+    void json_string(std::ostream &out, const std::string &s);
+
+    namespace trace {
+
+        /*!
+         * Number of spans kept per thread; older spans are overwritten.
+         */
+        constexpr size_t RING_SIZE = 4096;
+
+        /*!
+         * The Event struct. A finished span.
+         */
+        struct Event {
+            /*!
+             * Name of the phase (a string literal).
+             */
+            const char *name;
+            /*!
+             * Additional description, such as the function name.
+             */
+            std::string detail;
+            /*!
+             * Start time in nanoseconds since the tracing epoch.
+             */
+            uint64_t begin;
+            /*!
+             * Duration in nanoseconds.
+             */
+            uint64_t duration;
+            /*!
+             * Sequential id of the recording thread.
+             */
+            size_t thread;
+        };
+
+        /*!
+         * Get the current time.
+         * @return nanoseconds since the tracing epoch.
+         */
+        uint64_t now();
+
+        /*!
+         * Record a finished span into the ring buffer of the current thread.
+         * @param name name of the phase.
+         * @param detail additional description.
+         * @param begin start time from now().
+         * @param end end time from now().
+         */
+        void record(const char *name, std::string detail, uint64_t begin, uint64_t end);
+
+        /*!
+         * Gather the spans of all threads (including finished threads), ordered by start time.
+         * @return the spans.
+         */
+        std::vector<Event> collect();
+
+        /*!
+         * Drop all recorded spans.
+         */
+        void clear();
+
+        /*!
+         * Export the recorded spans as a Chrome trace JSON document.
+         * @param out output stream.
+         */
+        void export_chrome(std::ostream &out);
+
+        /*!
+         * The Span class. Records the lifetime of its scope.
+         */
+        class Span {
+            const char *name;
+            std::string detail;
+            uint64_t begin;
+        public:
+            /*!
+             * Span constructor. Starts the span.
+             * @param name name of the phase (must outlive the trace).
+             * @param detail additional description.
+             */
+            explicit Span(const char *name, std::string detail = std::string())
+                    : name(name), detail(std::move(detail)), begin(now()) {}
+
+            Span(const Span &) = delete;
+
+            Span &operator=(const Span &) = delete;
+
+            /*!
+             * Span destructor. Records the span.
+             */
+            ~Span() {
+                record(name, std::move(detail), begin, now());
+            }
+        };
+    }
+}
+
+#define VMIPS_TRACE_CONCAT_IMPL(a, b) a##b
+#define VMIPS_TRACE_CONCAT(a, b) VMIPS_TRACE_CONCAT_IMPL(a, b)
+#if VMIPS_TRACING
+#define VMIPS_TRACE_SCOPE(...) ::vmips::trace::Span VMIPS_TRACE_CONCAT(vmips_trace_span_, __LINE__)(__VA_ARGS__)
+#else
+#define VMIPS_TRACE_SCOPE(...) do {} while (0)
+#endif
+
+#endif //BACKEND_TRACE_H
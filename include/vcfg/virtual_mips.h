@@ -10,6 +10,11 @@
 #define REG_NUM 17
 #define SAVE_START 9
 #define EXTRA_STACK 16
+#define LOOP_WEIGHT 10
+#define CALLEE_SAVE_COST 2
+#define MAX_LOOP_DEPTH 6
+#define IF_CONVERSION_COST 10
+#define MAX_UNROLL_SIZE 128
 
 #include <utility>
 #include <vector>
@@ -19,7 +24,13 @@
 #include <ostream>
 #include <algorithm>
 #include <sstream>
+#include <functional>
+#include <cstdint>
+#include <chrono>
 #include <phmap.h>
+#include <gcolor/graph.h>
+#include <vcfg/pass.h>
+#include <vcfg/trace.h>
 
 namespace vmips {
 
@@ -101,6 +112,16 @@ namespace vmips {
 
     struct CFGNode;
     struct Function;
+
+    /*!
+     * The Scheduling enum class. Where the basic block instruction scheduler runs.
+     */
+    enum class Scheduling {
+        None,             /**< no scheduling */
+        BeforeAllocation, /**< schedule virtual registers before coloring */
+        AfterAllocation   /**< schedule real registers after memory allocation */
+    };
+
     /*!
      * The MemoryLocation class. Represents a memory location on stack to be determined statically.
      */
@@ -162,6 +183,10 @@ namespace vmips {
          * Size of the total union (used for heuristic optimal merging of two unions).
          */
         size_t union_size = 1;
+        /*!
+         * Whether the register is the representative of its equivalent class (maintained by unite).
+         */
+        bool representative = true;
         /*!
          * If a temporal register life time is overlapped with a subroutine call, we need to assign
          * a stack section for it to recover it after the call.
@@ -218,7 +243,10 @@ namespace vmips {
          * @return comparison result.
          */
         bool operator==(const VirtReg &that) const {
-            return id.number == that.id.number || find_root(parent.lock()) == find_root(that.parent.lock());
+            if (id.number == that.id.number) return true;
+            // distinct representatives are never in the same class (canonical operands hit this path)
+            if (representative && that.representative) return false;
+            return find_root(parent.lock()) == find_root(that.parent.lock());
         }
     };
 
@@ -241,11 +269,119 @@ namespace vmips {
      */
     void unite(std::shared_ptr<VirtReg> x, std::shared_ptr<VirtReg> y);
 
+    /*!
+     * Check whether a value fits in a signed 16-bit immediate.
+     * @param value the value.
+     * @return check result.
+     */
+    inline bool fits_signed16(int64_t value) {
+        return value >= INT16_MIN && value <= INT16_MAX;
+    }
+
+    /*!
+     * Check whether a value fits in an unsigned 16-bit immediate.
+     * @param value the value.
+     * @return check result.
+     */
+    inline bool fits_unsigned16(int64_t value) {
+        return value >= 0 && value <= UINT16_MAX;
+    }
+
+/*!
+ * The instruction table. Each entry X(S, B, N) declares the instruction class S derived from B,
+ * printed as the MIPS instruction N, together with its Opcode tag.
+ */
+#define VMIPS_INSTRUCTIONS(X)     \
+    X(add, Ternary, "add")        \
+    X(addiu, BinaryImm, "addiu")  \
+    X(addi, BinaryImm, "addi")    \
+    X(addu, Ternary, "addu")      \
+    X(clo, Binary, "clo")         \
+    X(clz, Binary, "clz")         \
+    X(li, UnaryImm, "li")         \
+    X(lui, UnaryImm, "lui")       \
+    X(move, Binary, "move")       \
+    X(negu, Binary, "negu")       \
+    X(seb, Binary, "seb")         \
+    X(seh, Binary, "seh")         \
+    X(sub, Ternary, "sub")        \
+    X(subu, Ternary, "subu")      \
+    X(lw, Memory, "lw")           \
+    X(sw, Memory, "sw")           \
+    X(b, Unconditional, "b")      \
+    X(j, Unconditional, "j")      \
+    X(beq, CmpBranch, "beq")      \
+    X(bne, CmpBranch, "bne")      \
+    X(syscall, Instruction, "syscall") \
+    X(beqz, ZeroBranch, "beqz")   \
+    X(bnez, ZeroBranch, "bnez")   \
+    X(blez, ZeroBranch, "blez")   \
+    X(bgtz, ZeroBranch, "bgtz")   \
+    X(bltz, ZeroBranch, "bltz")   \
+    X(bgez, ZeroBranch, "bgez")   \
+    X(ble, CmpBranch, "ble")      \
+    X(bge, CmpBranch, "bge")      \
+    X(blt, CmpBranch, "blt")      \
+    X(bgt, CmpBranch, "bgt")      \
+    X(slt, Ternary, "slt")        \
+    X(mul, Ternary, "mul")        \
+    X(mflo, Unary, "mflo")        \
+    X(mfhi, Unary, "mfhi")        \
+    X(movn, Ternary, "movn")      \
+    X(movz, Ternary, "movz")      \
+    X(sllv, Ternary, "sllv")      \
+    X(srav, Ternary, "srav")      \
+    X(srlv, Ternary, "srlv")      \
+    X(sltu, Ternary, "sltu")      \
+    X(sltiu, BinaryImm, "sltiu")  \
+    X(slti, BinaryImm, "slti")    \
+    X(andi, BinaryImm, "andi")    \
+    X(xori, BinaryImm, "xori")    \
+    X(bnot, Binary, "not")        \
+    X(bor, Ternary, "or")         \
+    X(bxor, Ternary, "xor")       \
+    X(band, Ternary, "and")       \
+    X(sll, BinaryImm, "sll")      \
+    X(srl, BinaryImm, "srl")      \
+    X(sra, BinaryImm, "sra")      \
+    X(mult, HiLo, "mult")         \
+    X(multu, HiLo, "multu")       \
+    X(divu, HiLo, "divu")
+
+    /*!
+     * The Opcode enum class. Tags every concrete instruction class, so that passes can dispatch on
+     * the instruction kind without dynamic_cast.
+     */
+    enum class Opcode : uint8_t {
+#define VMIPS_OPCODE(S, B, N) S,
+        VMIPS_INSTRUCTIONS(VMIPS_OPCODE)
+#undef VMIPS_OPCODE
+        div,         /**< division (writes HI/LO) */
+        jr,          /**< jump register */
+        phi,         /**< phi node */
+        callfunc,    /**< subroutine call */
+        text,        /**< manual instruction */
+        la,          /**< load data address */
+        address,     /**< load stack offset */
+        array_load,  /**< indexed load */
+        array_store, /**< indexed store */
+        unknown      /**< not tagged */
+    };
+
     /*!
      * The Instruction class. Represents an instruction line of MIPS.
      */
     class Instruction {
     public:
+        /*!
+         * Kind of the instruction, set by the constructor of the concrete class.
+         */
+        Opcode opcode = Opcode::unknown;
+        /*!
+         * Instruction moved into the branch delay slot of this instruction (noreorder mode).
+         */
+        std::shared_ptr<Instruction> delay_slot = nullptr;
+
         /*!
          * Collect all used register that need to be colored.
          * @param collection set of register (accumulator).
@@ -280,6 +416,11 @@ namespace vmips {
          */
         virtual void replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<VirtReg> &target);
 
+        /*!
+         * Rewrite all register operands to the representatives of their equivalent classes.
+         */
+        virtual void canonicalize();
+
         /*!
          * Display the instruction (codegen).
          * @param out output stream.
@@ -291,6 +432,39 @@ namespace vmips {
          * @return the new CFGNode caused by the branch.
          */
         virtual std::shared_ptr<CFGNode> branch();
+
+        /*!
+         * Redirect a branch or jump to another CFGNode (the out edges of the node are left unchanged).
+         * @param target the new target.
+         */
+        virtual void retarget(const std::shared_ptr<CFGNode> &target);
+
+        /*!
+         * Check whether the instruction is followed by a branch delay slot.
+         * @return check result.
+         */
+        virtual bool has_delay_slot() const;
+
+        /*!
+         * Check whether the instruction never continues to the next one (jumps and returns).
+         * @return check result.
+         */
+        bool terminates();
+
+        /*!
+         * Check whether the instruction can be placed in a branch delay slot, i.e. it is assembled into
+         * exactly one machine instruction and has no side effect other than defining its register.
+         * @return check result.
+         */
+        virtual bool fits_delay_slot() const;
+
+        /*!
+         * Create a copy of the instruction that recomputes its value into another register. Only possible
+         * for values that depend on constants alone (li, lui, la, address and addi from $zero).
+         * @param target register of the copy.
+         * @return the copy; null if the value can not be recomputed.
+         */
+        virtual std::shared_ptr<Instruction> rematerialize(std::shared_ptr<VirtReg> target) const;
     };
 
     /*!
@@ -314,6 +488,8 @@ namespace vmips {
 
         void replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<VirtReg> &target) override;
 
+        void canonicalize() override;
+
         void output(std::ostream &out) const override;
     };
 
@@ -342,9 +518,11 @@ namespace vmips {
 
         void replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<VirtReg> &target) override;
 
-        void output(std::ostream &) const override;
+        void canonicalize() override;
 
+        void output(std::ostream &) const override;
 
+        bool fits_delay_slot() const override;
     };
 
     /*!
@@ -373,7 +551,13 @@ namespace vmips {
 
         void replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<VirtReg> &target) override;
 
+        void canonicalize() override;
+
         void output(std::ostream &) const override;
+
+        bool fits_delay_slot() const override;
+
+        std::shared_ptr<Instruction> rematerialize(std::shared_ptr<VirtReg> target) const override;
     };
 
     /*!
@@ -400,7 +584,24 @@ namespace vmips {
 
         void replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<VirtReg> &target) override;
 
+        void canonicalize() override;
+
         void output(std::ostream &) const override;
+
+        bool fits_delay_slot() const override;
+    };
+
+    /*!
+     * The HiLo class. Represents instructions that take two registers as operands and write their result
+     * into the HI/LO registers (read back with mfhi/mflo).
+     */
+    class HiLo : public Binary {
+    public:
+        HiLo(std::shared_ptr<VirtReg> op0, std::shared_ptr<VirtReg> op1);
+
+        std::shared_ptr<VirtReg> def() const override;
+
+        bool fits_delay_slot() const override;
     };
 
     /*!
@@ -426,6 +627,8 @@ namespace vmips {
 
         void replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<VirtReg> &target) override;
 
+        void canonicalize() override;
+
         void output(std::ostream &) const override;
 
     };
@@ -459,7 +662,13 @@ namespace vmips {
 
         void replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<VirtReg> &target) override;
 
+        void canonicalize() override;
+
         void output(std::ostream &) const override;
+
+        bool fits_delay_slot() const override;
+
+        std::shared_ptr<Instruction> rematerialize(std::shared_ptr<VirtReg> target) const override;
     };
 
     /*!
@@ -473,6 +682,11 @@ namespace vmips {
         std::vector<std::shared_ptr<VirtReg>> call_with;
         std::shared_ptr<VirtReg> ret;
         bool scanned = false;
+        /*!
+         * Tail call: the frame is torn down and the callee is entered by a jump (see
+         * Function::eliminate_tail_calls()).
+         */
+        bool tail = false;
 
         callfunc(std::shared_ptr<VirtReg> ret, Function *current, std::weak_ptr<Function> function,
                  std::vector<std::shared_ptr<VirtReg>> call_with);
@@ -488,6 +702,8 @@ namespace vmips {
 
         void replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<VirtReg> &target) override;
 
+        void canonicalize() override;
+
         void output(std::ostream &out) const override;
 
     };
@@ -499,13 +715,23 @@ namespace vmips {
     public:
         std::weak_ptr<CFGNode> block;
 
+        /*!
+         * Whether the delay slot holds a copy of the first instruction of the target, so that the jump
+         * lands right after that instruction.
+         */
+        bool skip_first = false;
+
         explicit Unconditional(std::weak_ptr<CFGNode> block);
 
         void output(std::ostream &) const override;
 
         std::shared_ptr<CFGNode> branch() override;
 
+        void retarget(const std::shared_ptr<CFGNode> &target) override;
+
         std::shared_ptr<VirtReg> def() const override;
+
+        bool has_delay_slot() const override;
     };
 
     /*!
@@ -521,7 +747,11 @@ namespace vmips {
 
         std::shared_ptr<CFGNode> branch() override;
 
+        void retarget(const std::shared_ptr<CFGNode> &target) override;
+
         std::shared_ptr<VirtReg> def() const override;
+
+        bool has_delay_slot() const override;
     };
 
     /*!
@@ -538,7 +768,13 @@ namespace vmips {
 
         std::shared_ptr<CFGNode> branch() override;
 
+        void retarget(const std::shared_ptr<CFGNode> &target) override;
+
         std::shared_ptr<VirtReg> def() const override;
+
+        bool fits_delay_slot() const override;
+
+        bool has_delay_slot() const override;
     };
 
     /*!
@@ -562,108 +798,34 @@ namespace vmips {
 
         void replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<VirtReg> &target) override;
 
+        void canonicalize() override;
+
         template<class T>
         static std::shared_ptr<Instruction>
         create(std::shared_ptr<VirtReg> target, std::shared_ptr<MemoryLocation> location);
 
         void output(std::ostream &) const override;
+
+        bool fits_delay_slot() const override;
     };
 
 /*! Macro to generate a constructor of subclass instruction. */
 #define BASE_INIT(S, B) \
 template <typename ...Args> \
-explicit S(Args&& ...args) : B(std::forward<Args>(args)...) {}
+explicit S(Args&& ...args) : B(std::forward<Args>(args)...) { opcode = Opcode::S; }
 
 /*! Macro to define a new instruction. */
-#define DECLARE(S, B) \
-/*! The S class. MIPS S instruction. Derived from B. */\
+#define DECLARE(S, B, N) \
+/*! The S class. MIPS N instruction. Derived from B. */\
 class S : public B {                            \
 public:                                         \
     BASE_INIT(S, B)                             \
-    const char * name() const {                 \
-        return #S;                              \
+    const char * name() const override {        \
+        return N;                               \
     }                                           \
 };
 
-
-    DECLARE(add, Ternary);
-
-    DECLARE(addiu, BinaryImm);
-
-    DECLARE(addi, BinaryImm);
-
-    DECLARE(addu, Ternary);
-
-    DECLARE(clo, Binary);
-
-    DECLARE(clz, Binary);
-
-    DECLARE(li, UnaryImm);
-
-    DECLARE(lui, UnaryImm);
-
-    DECLARE(move, Binary);
-
-    DECLARE(negu, Binary);
-
-    DECLARE(seb, Binary);
-
-    DECLARE(seh, Binary);
-
-    DECLARE(sub, Ternary);
-
-    DECLARE(subu, Ternary);
-
-    DECLARE(lw, Memory);
-
-    DECLARE(sw, Memory);
-
-
-    DECLARE(b, Unconditional);
-
-    DECLARE(j, Unconditional);
-
-    DECLARE(beq, CmpBranch);
-
-    DECLARE(syscall, Instruction);
-
-    DECLARE(beqz, ZeroBranch);
-
-    DECLARE(bnez, ZeroBranch);
-
-    DECLARE(blez, ZeroBranch);
-
-    DECLARE(ble, CmpBranch);
-
-    DECLARE(bge, CmpBranch);
-
-    DECLARE(slt, Ternary);
-
-    DECLARE(mul, Ternary);
-
-    DECLARE(mflo, Unary);
-
-    DECLARE(mfhi, Unary);
-
-    DECLARE(movn, Ternary);
-
-    DECLARE(movz, Ternary);
-
-    DECLARE(sllv, Ternary);
-
-    DECLARE(srav, Ternary);
-
-    DECLARE(srlv, Ternary);
-
-    DECLARE(sltu, Ternary);
-
-    DECLARE(sltiu, BinaryImm);
-
-    DECLARE(slti, BinaryImm);
-
-    DECLARE(andi, BinaryImm);
-
-    DECLARE(xori, BinaryImm);
+    VMIPS_INSTRUCTIONS(DECLARE)
 
     class div : public Binary {
     public:
@@ -671,44 +833,10 @@ public:                                         \
 
         std::shared_ptr<VirtReg> def() const override;
 
-        const char *name() const override {
-            return "div";
-        }
-    };
-
-    class bnot : public Binary {
-    public:
-        BASE_INIT(bnot, Binary);
-
-        const char *name() const override {
-            return "not";
-        }
-    };
-
-    class bor : public Ternary {
-    public:
-        BASE_INIT(bor, Ternary);
-
-        const char *name() const override {
-            return "or";
-        }
-    };
-
-    class bxor : public Ternary {
-    public:
-        BASE_INIT(bxor, Ternary);
-
-        const char *name() const override {
-            return "xor";
-        }
-    };
-
-    class band : public Ternary {
-    public:
-        BASE_INIT(band, Ternary);
+        bool fits_delay_slot() const override;
 
         const char *name() const override {
-            return "and";
+            return "div";
         }
     };
 
@@ -720,6 +848,8 @@ public:                                         \
     public:
         std::shared_ptr<VirtReg> def() const override;
 
+        bool has_delay_slot() const override;
+
         jr(std::shared_ptr<VirtReg> reg);
     };
 
@@ -728,12 +858,20 @@ public:                                         \
      */
     class text : public Instruction {
         std::string context;
+        bool jump;
     public:
-        explicit text(std::string context);
+        /*!
+         * The text class constructor.
+         * @param context the manual instruction.
+         * @param jump whether the instruction is a jump (and therefore has a delay slot).
+         */
+        explicit text(std::string context, bool jump = false);
 
         const char *name() const override;
 
         void output(std::ostream &out) const override;
+
+        bool has_delay_slot() const override;
     };
 
     /*!
@@ -747,6 +885,8 @@ public:                                         \
         const char *name() const override;
 
         void output(std::ostream &out) const override;
+
+        std::shared_ptr<Instruction> rematerialize(std::shared_ptr<VirtReg> target) const override;
     };
 
     /*!
@@ -758,12 +898,15 @@ public:                                         \
         explicit address(std::shared_ptr<VirtReg> reg, std::shared_ptr<MemoryLocation> data);
 
         void output(std::ostream &out) const override;
+
+        std::shared_ptr<Instruction> rematerialize(std::shared_ptr<VirtReg> target) const override;
     };
 
     class ArrayAccess : public Memory {
+    public:
         // def does not matter
         std::shared_ptr<VirtReg> offset;
-    public:
+
         ArrayAccess(std::shared_ptr<VirtReg> target, std::shared_ptr<VirtReg> offset,
                     std::shared_ptr<MemoryLocation> location);
 
@@ -777,6 +920,10 @@ public:                                         \
         bool used_register(const std::shared_ptr<VirtReg> &reg) const override;
 
         void replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<VirtReg> &target) override;
+
+        void canonicalize() override;
+
+        bool fits_delay_slot() const override;
     };
 
     class array_load : public ArrayAccess {
@@ -796,6 +943,77 @@ public:                                         \
         const char *name() const override;
     };
 
+    /*!
+     * The PackedInstruction struct. Fixed-size record of an instruction in the packed form of a CFGNode:
+     * the opcode, the defined register and all registers touched by the instruction, identified by the
+     * packed id of their union find representative.
+     */
+    struct PackedInstruction {
+        /*!
+         * Number of operand slots stored inline.
+         */
+        static const constexpr size_t
+                INLINE_SLOTS = 3;
+        /*!
+         * Packed id used for a missing register.
+         */
+        static const constexpr uint32_t
+                NONE = UINT32_MAX;
+        /*!
+         * Kind of the instruction.
+         */
+        Opcode opcode;
+        /*!
+         * Number of operand slots.
+         */
+        uint32_t count;
+        /*!
+         * Defined register; NONE if nothing is defined.
+         */
+        uint32_t def;
+        /*!
+         * Operand slots. If there are more than INLINE_SLOTS operands, slots[0] is the start of
+         * the operands in the overflow area of the block.
+         */
+        uint32_t slots[INLINE_SLOTS];
+    };
+
+    /*!
+     * The PackedBlock struct. Contiguous packed form of the instructions of a CFGNode.
+     */
+    struct PackedBlock {
+        /*!
+         * One record per instruction, in order.
+         */
+        std::vector<PackedInstruction> code;
+        /*!
+         * Operand slots of the records that do not fit inline (subroutine calls).
+         */
+        std::vector<uint32_t> overflow;
+        /*!
+         * Index of the last instruction using each packed register.
+         */
+        unordered_map<uint32_t, size_t> last_use;
+
+        /*!
+         * Get the first operand slot of a record.
+         * @param instr record in this block.
+         * @return pointer to the first slot.
+         */
+        const uint32_t *begin(const PackedInstruction &instr) const {
+            return instr.count > PackedInstruction::INLINE_SLOTS ? overflow.data() + instr.slots[0] : instr.slots;
+        }
+
+        /*!
+         * Get the end of the operand slots of a record.
+         * @param instr record in this block.
+         * @return pointer past the last slot.
+         */
+        const uint32_t *end(const PackedInstruction &instr) const {
+            return begin(instr) + instr.count;
+        }
+    };
+
     // upward links are broken down
     /*!
      * The CFGNode class. Control Flow Graph Node.
@@ -821,10 +1039,26 @@ public:                                         \
          * Out edges from this basic block.
          */
         std::vector<std::weak_ptr<CFGNode>> out_edges{}; // at most two
+        /*!
+         * Profiled number of traversals of each out edge (parallel to out_edges); empty without a profile.
+         */
+        std::vector<size_t> edge_counts{};
         /*!
          * Set used in the DFS walk of the graph to record lifetime information of the register.
          */
         unordered_map<std::shared_ptr<VirtReg>, size_t> lives{}; // instructions.size  means live through
+        /*!
+         * Estimated execution frequency of the node (relative to the function entry).
+         */
+        size_t frequency = 1;
+        /*!
+         * Whether a jump skips the first instruction of this node (it was copied into the delay slot).
+         */
+        bool split_first = false;
+        /*!
+         * Packed form of the instructions (valid after Function::pack until the instructions change).
+         */
+        PackedBlock packed;
         /*!
          * CFGNode constructor.
          * @param function pointer to the function that owns the node.
@@ -846,7 +1080,12 @@ public:                                         \
         void dfs_reset();
 
         /*!
-         * DFS walk to calculate the lifetime information of the coloring graph.
+         * Rebuild the packed form of the node.
+         */
+        void pack();
+
+        /*!
+         * DFS walk to calculate the lifetime information of the coloring graph. Reads the packed form.
          * @param reg register accumulator.
          */
         void setup_living(const unordered_set<std::shared_ptr<VirtReg>>
@@ -868,6 +1107,13 @@ public:                                         \
          */
         void spill(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<MemoryLocation> &location);
 
+        /*!
+         * DFS walk to replace a conflicted register by recomputing its value before each use.
+         * @param reg register to be rematerialized.
+         * @param definition the only instruction defining the register (removed).
+         */
+        void rematerialize(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<Instruction> &definition);
+
         /*!
          * Perform graph coloring algorithm to assign the registers.
          * @param sp stack frame pointer.
@@ -882,12 +1128,26 @@ public:                                         \
 
                           &liveness);
 
+        /*!
+         * DFS walk to find registers whose lifetime crosses a subroutine call.
+         * @param liveness register accumulator.
+         * @param visitor callback invoked with the node, the call and the registers living across it.
+         */
+        void scan_calls(unordered_set<std::shared_ptr<VirtReg>> &liveness,
+                        const std::function<void(CFGNode &, callfunc &,
+                                                 const std::vector<std::shared_ptr<VirtReg>> &)> &visitor);
+
         /*!
          * Display of the node (codegen).
          * @param out output stream.
          */
         void output(std::ostream &out);
 
+        /*!
+         * List schedule the straight-line segments of the node.
+         */
+        void schedule();
+
         /*!
          * Add a new instruction.
          * @tparam Instr instruction class.
@@ -912,6 +1172,12 @@ public:                                         \
             instructions.push_back(std::make_shared<phi>(std::move(x), std::move(y)));
         }
 
+        /*!
+         * Add an out edge (and invalidate the cached CFG analysis of the function).
+         * @param node target CFGNode.
+         */
+        void add_edge(const std::shared_ptr<CFGNode> &node);
+
         /*!
          * Branch to an existing CFGNode.
          * @tparam Instr instruction class.
@@ -921,7 +1187,7 @@ public:                                         \
          */
         template<typename Instr, typename ...Args>
         void branch_existing(const std::shared_ptr<CFGNode> &node, Args &&... args) {
-            out_edges.push_back(node);
+            add_edge(node);
             auto instr = std::make_shared<Instr>(node, std::forward<Args>(args)...);
             instructions.push_back(instr);
         }
@@ -939,7 +1205,7 @@ public:                                         \
             auto node = std::make_shared<CFGNode>(name);
             auto instr = std::make_shared<Instr>(node, std::forward<Args>(args)...);
             instructions.push_back(instr);
-            out_edges.push_back(node);
+            add_edge(node);
             return node;
         }
 
@@ -959,12 +1225,155 @@ public:                                         \
             auto b = std::make_shared<CFGNode>(function, target);
             auto instr = std::make_shared<Instr>(b, std::forward<Args>(args)...);
             instructions.push_back(instr);
-            out_edges.push_back(a);
-            out_edges.push_back(b);
+            add_edge(a);
+            add_edge(b);
             return {a, b};
         }
     };
 
+    /*!
+     * The CFGInfo struct. Cached structure of the control flow graph of a function. Nodes are identified
+     * by their index in Function::blocks; node 0 is the entry.
+     */
+    struct CFGInfo {
+        /*!
+         * Index used for a missing node.
+         */
+        static const constexpr size_t
+                NONE = -1;
+        /*!
+         * Whether the information matches the current CFG.
+         */
+        bool valid = false;
+        /*!
+         * Index of each CFGNode.
+         */
+        unordered_map<const CFGNode *, size_t> index;
+        /*!
+         * Successor indices of each node.
+         */
+        std::vector<std::vector<size_t>> successors;
+        /*!
+         * Predecessor indices of each node.
+         */
+        std::vector<std::vector<size_t>> predecessors;
+        /*!
+         * Nodes reachable from the entry in reverse postorder.
+         */
+        std::vector<size_t> rpo;
+        /*!
+         * Position of each node in the reverse postorder; NONE if unreachable.
+         */
+        std::vector<size_t> rpo_index;
+        /*!
+         * Immediate dominator of each node; the entry dominates itself, NONE if unreachable.
+         */
+        std::vector<size_t> idom;
+        /*!
+         * Header of the innermost natural loop containing each node; NONE outside loops.
+         */
+        std::vector<size_t> loop_header;
+        /*!
+         * Number of natural loops containing each node.
+         */
+        std::vector<size_t> loop_depth;
+
+        /*!
+         * The Loop struct. A natural loop: the nodes reaching the source of a back edge without passing its
+         * target, the header. Loops sharing the header are merged.
+         */
+        struct Loop {
+            /*!
+             * Header node index.
+             */
+            size_t header;
+            /*!
+             * Membership of each node.
+             */
+            std::vector<bool> body;
+            /*!
+             * Number of member nodes.
+             */
+            size_t size;
+        };
+
+        /*!
+         * Natural loops, innermost (smallest) first.
+         */
+        std::vector<Loop> loops;
+
+        /*!
+         * Check whether a node is reachable from the entry.
+         * @param node node index.
+         * @return check result.
+         */
+        bool reachable(size_t node) const {
+            return rpo_index[node] != NONE;
+        }
+
+        /*!
+         * Check whether a node dominates another one (every node dominates itself).
+         * @param a dominator candidate.
+         * @param b dominated candidate.
+         * @return check result.
+         */
+        bool dominates(size_t a, size_t b) const;
+    };
+
+    /*!
+     * The FunctionStatistics struct. Measurements of the code generation of a function.
+     */
+    struct FunctionStatistics {
+        /*!
+         * Number of coloring attempts (one more than the number of spills).
+         */
+        size_t coloring_rounds = 0;
+        /*!
+         * Number of spilled registers.
+         */
+        size_t spilled_registers = 0;
+        /*!
+         * Number of registers recomputed at their uses instead of being spilled.
+         */
+        size_t rematerialized_registers = 0;
+        /*!
+         * Number of instructions inserted by rematerialization.
+         */
+        size_t rematerialized_instructions = 0;
+        /*!
+         * Number of lw instructions inserted by spilling.
+         */
+        size_t spill_loads = 0;
+        /*!
+         * Number of sw instructions inserted by spilling.
+         */
+        size_t spill_stores = 0;
+        /*!
+         * Nodes of the final interference graph.
+         */
+        size_t interference_nodes = 0;
+        /*!
+         * Edges of the final interference graph.
+         */
+        size_t interference_edges = 0;
+        /*!
+         * Maximum number of registers living at the same point.
+         */
+        size_t max_pressure = 0;
+        /*!
+         * Number of temporaries saved around each subroutine call, in node order.
+         */
+        std::vector<size_t> overlap_saves;
+        /*!
+         * Final size of the stack frame.
+         */
+        size_t stack_size = 0;
+        /*!
+         * Wall time of each pass run on the function, in pipeline order.
+         */
+        std::vector<std::pair<std::string, std::chrono::nanoseconds>> phase_times;
+    };
+
     /*!
      * The Function class. Represents a function in the program.
      */
@@ -1019,6 +1428,55 @@ public:                                         \
          * Whether memory sections are assigned.
          */
         bool allocated = false;
+        /*!
+         * Whether registers living across calls should be biased toward callee saved registers.
+         */
+        bool prefer_callee_saved = true;
+        /*!
+         * Address the stack frame off $sp and use $s8 as an additional allocatable register.
+         * Must be set before any memory region is created.
+         */
+        bool omit_frame_pointer = false;
+        /*!
+         * Whether the function needs no stack frame at all (decided when memory sections are assigned).
+         */
+        bool leaf = false;
+        /*!
+         * Fill branch delay slots and emit the function under .set noreorder.
+         */
+        bool noreorder = false;
+        /*!
+         * Where the load-use aware instruction scheduler runs.
+         */
+        Scheduling scheduling = Scheduling::None;
+        /*!
+         * Reorder the CFGNodes for fall-throughs before register allocation (see layout()).
+         */
+        bool reorder_blocks = false;
+        /*!
+         * Run the machine-independent optimizations (see eliminate_tail_calls(), propagate_constants(),
+         * if_convert(), reduce_strength(), reduce_induction_variables(), hoist_invariants(), value_numbering() and
+         * eliminate_dead_code()) before the layout and the register allocation.
+         */
+        bool optimize = false;
+        /*!
+         * Number of iterations per trip through an unrolled counted loop (see unroll_loops()); 1 keeps the loops.
+         */
+        size_t unroll_factor = 1;
+        /*!
+         * Whether the frequencies and edge counts of the CFGNodes come from a profile (Module::attach_profile).
+         */
+        bool profiled = false;
+        /*!
+         * Mask of all temporary registers.
+         */
+        static const constexpr bitmask_t
+                TEMP_MASK = ((bitmask_t) 1 << SAVE_START) - 1;
+        /*!
+         * Temporary registers that may be changed by calling this function (including its own callees).
+         * Externs and functions that are not allocated yet keep the conservative ABI mask.
+         */
+        bitmask_t clobbers = TEMP_MASK;
         /*!
          * Maximum argument count of subroutine call.
          */
@@ -1047,6 +1505,26 @@ public:                                         \
          * Current codegen point.
          */
         std::shared_ptr<CFGNode> cursor;
+        /*!
+         * Cached CFG analysis, see cfg().
+         */
+        CFGInfo cfg_info;
+        /*!
+         * Register analyses (Analysis::Liveness, Analysis::Interference) that match the current instructions.
+         */
+        AnalysisSet register_analyses = Analysis::None;
+        /*!
+         * Code generation measurements.
+         */
+        FunctionStatistics statistics;
+        /*!
+         * Union find representatives indexed by packed register id.
+         */
+        std::vector<const VirtReg *> packed_regs;
+        /*!
+         * Packed register id of each union find representative.
+         */
+        unordered_map<const VirtReg *, uint32_t> packed_ids;
 
         /*!
          * Function constructor.
@@ -1090,6 +1568,81 @@ public:                                         \
          */
         std::shared_ptr<CFGNode> entry();
 
+        /*!
+         * Get the CFG analysis (predecessors, reverse postorder, dominators and loops), recomputing it if the
+         * CFG changed since the last query.
+         * @return the analysis.
+         */
+        const CFGInfo &cfg();
+
+        /*!
+         * Drop the cached CFG analysis. Called by every operation that adds nodes or edges.
+         */
+        void invalidate_cfg();
+
+        /*!
+         * Drop cached analyses.
+         * @param analyses the analyses to be dropped.
+         */
+        void invalidate(AnalysisSet analyses);
+
+        /*!
+         * Make sure the analyses are valid, recomputing them if needed. Register analyses can only be
+         * recomputed before the registers are colored.
+         * @param analyses the required analyses.
+         */
+        void ensure(AnalysisSet analyses);
+
+        /*!
+         * Unite the phi operands, canonicalize the operands and compute the liveness and the interference
+         * of all registers to be colored.
+         * @return the registers to be colored (representatives only).
+         */
+        unordered_set<std::shared_ptr<VirtReg>> analyze_registers();
+
+        /*!
+         * Count the instructions in all CFGNodes.
+         * @return instruction count.
+         */
+        size_t instruction_count() const;
+
+        /*!
+         * Find the definition of a register if its value can be recomputed at its uses.
+         * @param reg the register (canonical).
+         * @return the only defining instruction; null if there are several or it can not be rematerialized.
+         */
+        std::shared_ptr<Instruction> rematerializable(const std::shared_ptr<VirtReg> &reg) const;
+
+        /*!
+         * Compute the maximum number of registers living at the same point from the liveness analysis.
+         * @return register pressure.
+         */
+        size_t register_pressure();
+
+        /*!
+         * Dump the statistics of the function as a JSON object.
+         * @param out output stream.
+         */
+        void dump_statistics(std::ostream &out) const;
+
+        /*!
+         * Get the register used to address the stack frame.
+         * @return $sp if the frame pointer is omitted or there is no frame; otherwise $s8.
+         */
+        std::shared_ptr<VirtReg> frame_register() const;
+
+        /*!
+         * Get the number of allocatable registers.
+         * @return REG_NUM, plus $s8 if the frame pointer is omitted.
+         */
+        size_t register_count() const;
+
+        /*!
+         * Check whether the function needs the global pointer (PIC data access or subroutine calls).
+         * @return check result.
+         */
+        bool needs_gp() const;
+
         /*!
          * Add a new instruction to the cursor pointed location.
          * @tparam Instr instruction class.
@@ -1191,22 +1744,143 @@ public:                                         \
          */
         void scan_overlap();
 
+        /*!
+         * Renumber the registers by their current union find representatives and rebuild the packed
+         * form of all CFGNodes.
+         */
+        void pack();
+
+        /*!
+         * Get the packed id of the equivalent class of a register, assigning a new one if needed.
+         * @param reg the register.
+         * @return packed register id.
+         */
+        uint32_t packed_id(const std::shared_ptr<VirtReg> &reg);
+
+        /*!
+         * Estimate the execution frequency of each CFGNode. Each enclosing natural loop multiplies the weight
+         * by LOOP_WEIGHT (up to MAX_LOOP_DEPTH loops). Profiled frequencies are kept.
+         */
+        void estimate_frequency();
+
         /*!
          * Output the generated code.
          * @param out output stream.
          */
         void output(std::ostream &out) const;
 
+        /*!
+         * Output the epilogue: restore the saved registers and the stack pointer, then leave the function.
+         * @param out output stream.
+         * @param jump the leaving jump: jr $ra, or the jump into the callee of a tail call.
+         */
+        void output_epilogue(std::ostream &out, const std::string &jump) const;
+
         /*!
          * Allocate all memory locations.
          */
         void handle_alloca();
 
+        /*!
+         * Merge the lifetime of all phi operands (union find), as the register collection does.
+         */
+        void unite_phis();
+
+        /*!
+         * Rewrite the operands of all instructions to the representatives of their equivalent classes,
+         * so that later register comparisons need no union find walk.
+         */
+        void canonicalize();
+
+        /*!
+         * List schedule every straight-line segment of all CFGNodes on a dependency DAG built from
+         * register definitions/usages and memory order, separating loads from their uses.
+         */
+        void schedule();
+
+        /*!
+         * Fill branch delay slots with independent instructions from the same node, or with the first
+         * instruction of the target for unconditional jumps. Must run after memory allocation.
+         */
+        void fill_delay_slots();
+
+        /*!
+         * Sparse conditional constant propagation: fold constants into li and immediate forms, resolve constant
+         * branches and remove the nodes never executed.
+         */
+        void propagate_constants();
+
+        /*!
+         * Strength reduction of the multiplications and divisions by constants.
+         */
+        void reduce_strength();
+
+        /*!
+         * Replace the indexed accesses of single-node loops by plain lw/sw through pointers advanced with the index.
+         */
+        void reduce_induction_variables();
+
+        /*!
+         * Turn the calls whose result is returned right away into jumps: into the entry for the function itself,
+         * into the callee otherwise (see callfunc::tail).
+         */
+        void eliminate_tail_calls();
+
+        /*!
+         * If-conversion: turn small diamonds and triangles without side effects into straight-line code with
+         * movn/movz selects.
+         */
+        void if_convert();
+
+        /*!
+         * Loop-invariant code motion: move the instructions whose operands the loop does not define into a
+         * preheader, innermost loops first.
+         */
+        void hoist_invariants();
+
+        /*!
+         * Unroll the counted single-node loops by unroll_factor.
+         */
+        void unroll_loops();
+
+        /*!
+         * Dominator-based global value numbering: remove the instructions recomputing an expression of a
+         * dominating one and merge their registers.
+         */
+        void value_numbering();
+
+        /*!
+         * Remove the CFGNodes unreachable from the entry, then the instructions whose register is never used.
+         */
+        void eliminate_dead_code();
+
+        /*!
+         * Lay out the CFGNodes to maximize fall-throughs: loops ending with a jump back to their own exit
+         * test are rotated so that the test sits at the bottom, nodes are chained along the heaviest edges
+         * (Pettis-Hansen), conditional branches are inverted to fall into their hot target and jumps to
+         * the next node are removed. Edge weights come from CFGNode::edge_counts when profiled, otherwise
+         * from the loop structure. Must run before register allocation.
+         */
+        void layout();
+
         /*!
          * Jump to the epilogue and return.
          */
         void add_ret();
 
+        /*!
+         * Create the jump to the epilogue that returns from the function.
+         * @return the jump.
+         */
+        std::shared_ptr<Instruction> return_jump() const;
+
+        /*!
+         * Check whether an instruction is the jump to the epilogue.
+         * @param instr the instruction.
+         * @return check result.
+         */
+        bool is_return_jump(Instruction &instr) const;
+
         /*!
          * Add an assignment operation to a special register.
          * @param special target.
@@ -1428,6 +2102,18 @@ public:                                         \
          */
         std::vector<std::shared_ptr<Function>> externs;
         std::string name;
+        /*!
+         * Passes run by finalize.
+         */
+        PassManager pipeline = PassManager::standard();
+        /*!
+         * Count the traversals of the CFG edges at run time (instrument() is called by finalize).
+         */
+        bool instrument_edges = false;
+        /*!
+         * Counter array of the instrumented code; null if the module is not instrumented.
+         */
+        std::shared_ptr<Data> edge_counters = nullptr;
 
         /*!
          * Module constructor.
@@ -1441,6 +2127,12 @@ public:                                         \
          */
         void output(std::ostream &out) const;
 
+        /*!
+         * Dump the statistics of all defined functions as a JSON array.
+         * @param out output stream.
+         */
+        void dump_statistics(std::ostream &out) const;
+
         /*!
          * Create a new function.
          * @param fname function name.
@@ -1458,16 +2150,39 @@ public:                                         \
         std::shared_ptr<Function> create_extern(std::string fname, size_t argc);
 
         /*!
-         * Allocate memory and registers for all defined functions.
+         * Order the defined functions bottom-up over the call graph (callees before callers).
+         * @return functions in allocation order.
+         */
+        std::vector<std::shared_ptr<Function>> bottom_up_order() const;
+
+        /*!
+         * Allocate memory and registers for all defined functions by running the pipeline. Callees are
+         * allocated first, so that callers only need to save the temporary registers actually clobbered by them.
          */
         void finalize() {
-            for (auto &i : functions) {
-                i->color();
-                i->scan_overlap();
-                i->handle_alloca();
-            }
+            VMIPS_TRACE_SCOPE("finalize", name);
+            if (instrument_edges && !edge_counters) instrument();
+            pipeline.run(*this);
         }
 
+        /*!
+         * Insert edge counters into all defined functions. The counters live in a word array of the global
+         * data section (edge_counters). Only the edges off a maximum spanning tree of the estimated frequencies
+         * are counted; the other counts follow from flow conservation. Counting conditional branch edges
+         * splits them with a new CFGNode. Must run before register allocation.
+         * @return number of counters.
+         */
+        size_t instrument();
+
+        /*!
+         * Attach the counters of an instrumented run to a module built in the same way without the
+         * instrumentation: fills CFGNode::edge_counts and the CFGNode frequencies of every function that
+         * was called. Must run before finalize.
+         * @param counters values of the counter array after the run.
+         * @return whether the counters match the module.
+         */
+        bool attach_profile(const std::vector<int32_t> &counters);
+
         /*!
          * Factory function to create a new data section.
          * @tparam Type data class type.
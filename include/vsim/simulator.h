@@ -0,0 +1,304 @@
+/**
+ * MIPS32el Simulator.
+ * Executes the assembly emitted by vmips::Module::output, so that generated code can be checked and measured:
+ * 1. parse the emitted subset (directives, labels, instructions and the common pseudo instructions)
+ * 2. predecode the program into a flat array executed by a direct-threaded interpreter loop
+ * 3. emulate branch delay slots inside `.set noreorder` regions
+ * 4. provide shims for the write/exit system calls and for external functions (write, exit, malloc, free, ...)
+ * 5. count executed instructions, loads, stores, branches and estimated cycles
+ */
+#ifndef BACKEND_SIMULATOR_H
+#define BACKEND_SIMULATOR_H
+#define VSIM_TEXT_BASE 0x00400000u
+#define VSIM_DATA_BASE 0x10000000u
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <phmap.h>
+
+namespace vsim {
+
+    class Simulator;
+
+    /*!
+     * Handler of an external function. Arguments are read by Simulator::argument, the return value is put into $v0.
+     */
+    using External = std::function<int32_t(Simulator &)>;
+
+    /*!
+     * The Status enum class. Reason of the end of a simulation.
+     */
+    enum class Status {
+        Returned,  /**< the called function returned */
+        Exited,    /**< the program called exit */
+        Fault,     /**< invalid memory access, division by zero, bad jump or unsupported system call */
+        StepLimit  /**< the instruction limit was reached */
+    };
+
+    /*!
+     * The Counters struct. Dynamic measurements of the executed code.
+     */
+    struct Counters {
+        /*!
+         * Number of executed instructions, as written in the assembly (a pseudo instruction counts once).
+         */
+        uint64_t instructions = 0;
+        /*!
+         * Estimated cycles of a single issue in-order pipeline: one cycle per machine instruction, plus stalls
+         * until the operands are ready (load 2, mul 3, div 20 cycles), plus the nops inserted by the
+         * assembler in reorder mode and the extra instructions of pseudo instruction expansions.
+         */
+        uint64_t cycles = 0;
+        /*!
+         * Number of executed loads.
+         */
+        uint64_t loads = 0;
+        /*!
+         * Number of executed stores.
+         */
+        uint64_t stores = 0;
+        /*!
+         * Number of executed conditional branches.
+         */
+        uint64_t branches = 0;
+        /*!
+         * Number of taken conditional branches.
+         */
+        uint64_t taken_branches = 0;
+        /*!
+         * Number of executed subroutine calls (including external functions).
+         */
+        uint64_t calls = 0;
+        /*!
+         * Number of calls to external functions.
+         */
+        uint64_t external_calls = 0;
+        /*!
+         * Number of cycles lost waiting for operands.
+         */
+        uint64_t stalls = 0;
+    };
+
+    /*!
+     * The Simulator class. Holds a loaded program and its memory.
+     */
+    class Simulator {
+        /*!
+         * The Decoded struct. A predecoded instruction.
+         */
+        struct Decoded {
+            /*!
+             * Handler address in the interpreter loop (direct threading).
+             */
+            const void *handler;
+            /*!
+             * Operation (Op in the implementation).
+             */
+            uint8_t op;
+            /*!
+             * Destination, first and second source register.
+             */
+            uint8_t d, s, t;
+            /*!
+             * Whether a branch or jump has a delay slot (`.set noreorder`).
+             */
+            bool delay;
+            /*!
+             * Additional cycles of pseudo instruction expansion and assembler inserted nops.
+             */
+            uint8_t extra;
+            /*!
+             * Result latency in cycles.
+             */
+            uint8_t latency;
+            /*!
+             * Immediate value, memory offset or address.
+             */
+            int32_t imm;
+            /*!
+             * Target instruction index of branches and jumps.
+             */
+            uint32_t target;
+            /*!
+             * Source line.
+             */
+            uint32_t line;
+        };
+
+        std::vector<Decoded> code;
+        std::vector<uint8_t> memory;
+        std::vector<uint8_t> image;
+        phmap::flat_hash_map<std::string, uint32_t> symbols;
+        std::vector<std::pair<std::string, External>> externals;
+        int32_t regs[35] = {};
+        uint32_t data_end = VSIM_DATA_BASE;
+        uint32_t heap = VSIM_DATA_BASE;
+        uint32_t halt_index = 0;
+        bool threaded = false;
+        bool halted = false;
+        int32_t exit_status = 0;
+        std::string message;
+        std::string written;
+        Counters counter;
+
+        /*!
+         * Execute from the current program counter until the program stops.
+         * @param pc index of the first instruction.
+         * @return reason of the stop.
+         */
+        Status run(uint32_t pc);
+
+        /*!
+         * Call an external function from the interpreter loop.
+         * @param index index of the external function.
+         * @return whether the program continues.
+         */
+        bool call_external(size_t index);
+
+    public:
+        /*!
+         * Maximum number of instructions executed by a single call.
+         */
+        uint64_t step_limit = 1000000000;
+
+        /*!
+         * Simulator constructor.
+         * @param memory_size size of the data memory (data sections, heap and stack) in bytes.
+         */
+        explicit Simulator(size_t memory_size = 1u << 22);
+
+        /*!
+         * Register an external function, replacing a built-in one with the same name.
+         * The built-in functions are write, exit, malloc, calloc, free, memcpy, memmove, memset and putchar.
+         * Must be called before load.
+         * @param name symbol name.
+         * @param handler implementation.
+         */
+        void define_external(const std::string &name, External handler);
+
+        /*!
+         * Parse and link an assembly program. Previous programs are discarded.
+         * @param assembly program text.
+         * @return whether the program was loaded; otherwise error() describes the problem.
+         */
+        bool load(const std::string &assembly);
+
+        /*!
+         * Restore the data sections and the heap of the loaded program.
+         */
+        void reset();
+
+        /*!
+         * Call a function of the loaded program. Arguments are passed in $a0-$a3 and in the argument area on
+         * the stack, as done by the code generator.
+         * @param name function label.
+         * @param args integer arguments.
+         * @return reason of the stop.
+         */
+        Status call(const std::string &name, const std::vector<int32_t> &args = {});
+
+        /*!
+         * Get the return value ($v0) of the last call.
+         * @return return value.
+         */
+        int32_t result() const;
+
+        /*!
+         * Get the status passed to exit.
+         * @return exit status.
+         */
+        int32_t exit_code() const;
+
+        /*!
+         * Get the description of the last load error or fault.
+         * @return error message.
+         */
+        const std::string &error() const;
+
+        /*!
+         * Get all bytes written by the program (write system call, write and putchar).
+         * @return written bytes.
+         */
+        const std::string &output() const;
+
+        /*!
+         * Get the dynamic measurements accumulated since the last reset_counters.
+         * @return counters.
+         */
+        const Counters &counters() const;
+
+        /*!
+         * Clear the dynamic measurements.
+         */
+        void reset_counters();
+
+        /*!
+         * Get the value of a general purpose register.
+         * @param index register number.
+         * @return register value.
+         */
+        int32_t reg(size_t index) const;
+
+        /*!
+         * Get the n-th argument of the running external function.
+         * @param index argument number.
+         * @return argument value.
+         */
+        int32_t argument(size_t index);
+
+        /*!
+         * Look up the address of a label.
+         * @param name label.
+         * @return address, or 0 if the label is not defined.
+         */
+        uint32_t symbol(const std::string &name) const;
+
+        /*!
+         * Read a word from the data memory.
+         * @param address word address.
+         * @param value read value.
+         * @return whether the address is valid.
+         */
+        bool read_word(uint32_t address, int32_t &value);
+
+        /*!
+         * Write a word into the data memory.
+         * @param address word address.
+         * @param value written value.
+         * @return whether the address is valid.
+         */
+        bool write_word(uint32_t address, int32_t value);
+
+        /*!
+         * Allocate memory on the simulated heap.
+         * @param size size in bytes.
+         * @return address, or 0 if the heap is exhausted.
+         */
+        uint32_t allocate(uint32_t size);
+
+        /*!
+         * Access a range of the data memory.
+         * @param address simulated address.
+         * @param size size in bytes.
+         * @return host pointer, or nullptr if the range is invalid.
+         */
+        uint8_t *data(uint32_t address, size_t size);
+
+        /*!
+         * Append bytes to the program output.
+         * @param bytes written bytes.
+         * @param size number of bytes.
+         */
+        void write(const char *bytes, size_t size);
+
+        /*!
+         * Stop the program as if it called exit.
+         * @param status exit status.
+         */
+        void exit(int32_t status);
+    };
+}
+
+#endif //BACKEND_SIMULATOR_H
@@ -5,14 +5,29 @@
 #include <gcolor/graph.h>
 #include <strings.h>
 void mark(bitmask_t &mask, size_t i) {
-    mask |= (1 << i);
+    if (i < sizeof(bitmask_t) * 8) mask |= ((bitmask_t) 1 << i);
 }
 
 size_t get(bitmask_t &mask) {
     return ffsll(~mask) - 1;
 }
 
+size_t get(bitmask_t &mask, size_t from, size_t limit) {
+    if (from < limit) {
+        auto shifted = ~mask >> from;
+        if (shifted) {
+            auto idx = from + ffsll(shifted) - 1;
+            if (idx < limit) return idx;
+        }
+    }
+    return get(mask);
+}
+
 std::pair<std::vector<size_t>, std::vector<size_t>>  Graph::color(size_t colors) {
+    return color(colors, {});
+}
+
+std::pair<std::vector<size_t>, std::vector<size_t>>  Graph::color(size_t colors, const std::vector<size_t> &preferred) {
     std::vector<size_t> data;
     std::vector<size_t> result;
     std::vector<std::vector<size_t>> connections;
@@ -51,7 +66,7 @@ std::pair<std::vector<size_t>, std::vector<size_t>>  Graph::color(size_t colors)
         for (auto & i : connections[t]) {
             mark(mask, result[i]);
         }
-        result[t] = get(mask);
+        result[t] = preferred.empty() ? get(mask) : get(mask, preferred[t], colors);
     }
 ending:
     std::vector<size_t> info;
@@ -0,0 +1,1958 @@
+//
+// Machine-independent optimizations of the Virtual MIPS IR.
+//
+
+#include <vcfg/virtual_mips.h>
+
+using namespace vmips;
+
+/*!
+ * Unite the phi operands and canonicalize the operands, then count the definitions of each equivalent class.
+ * A class defined once holds a single value wherever it is used.
+ * @param f the function.
+ * @return number of defining instructions of each representative (special registers are not counted).
+ */
+static unordered_map<const VirtReg *, size_t> count_definitions(Function &f) {
+    f.unite_phis();
+    f.canonicalize();
+    unordered_map<const VirtReg *, size_t> counts;
+    for (auto &node : f.blocks) {
+        for (auto &i : node->instructions) {
+            auto def = i->def();
+            if (def && !def->allocated) counts[def.get()]++;
+        }
+    }
+    return counts;
+}
+
+/*!
+ * The ValueKey struct. An expression computed by an instruction.
+ */
+struct ValueKey {
+    /*!
+     * Kind of the instruction.
+     */
+    Opcode opcode;
+    /*!
+     * Operand representatives (ordered for commutative operations).
+     */
+    const VirtReg *op0, *op1;
+    /*!
+     * Immediate value or argument slot.
+     */
+    ssize_t imm;
+
+    bool operator==(const ValueKey &that) const {
+        return opcode == that.opcode && op0 == that.op0 && op1 == that.op1 && imm == that.imm;
+    }
+};
+
+/*!
+ * The ValueHash struct. Hash function of ValueKey.
+ */
+struct ValueHash {
+    size_t operator()(const ValueKey &key) const {
+        auto h = std::hash<const void *>()(key.op0);
+        h = h * 31 + std::hash<const void *>()(key.op1);
+        h = h * 31 + std::hash<ssize_t>()(key.imm);
+        return h * 31 + (size_t) key.opcode;
+    }
+};
+
+/*!
+ * Compute the expression of an instruction.
+ * @param instr the instruction.
+ * @param value resolves an operand to the register holding its value; null if the operand has no single value.
+ * @param arguments whether the argument slots hold the same value during the whole function.
+ * @param key the expression.
+ * @return whether the instruction computes a numberable expression of single-valued operands.
+ */
+static bool value_key(const Instruction &instr, const std::function<const VirtReg *(const std::shared_ptr<VirtReg> &)> &value,
+                      bool arguments, ValueKey &key) {
+    key = {instr.opcode, nullptr, nullptr, 0};
+    switch (instr.opcode) {
+        case Opcode::add:
+        case Opcode::addu:
+        case Opcode::mul:
+        case Opcode::bor:
+        case Opcode::bxor:
+        case Opcode::band:
+        case Opcode::sub:
+        case Opcode::subu:
+        case Opcode::slt:
+        case Opcode::sltu:
+        case Opcode::sllv:
+        case Opcode::srav:
+        case Opcode::srlv: {
+            auto &t = static_cast<const Ternary &>(instr);
+            key.op0 = value(t.op0);
+            key.op1 = value(t.op1);
+            if (!key.op0 || !key.op1) return false;
+            auto commutative = instr.opcode == Opcode::add || instr.opcode == Opcode::addu ||
+                               instr.opcode == Opcode::mul || instr.opcode == Opcode::bor ||
+                               instr.opcode == Opcode::bxor || instr.opcode == Opcode::band;
+            if (commutative && std::less<const VirtReg *>()(key.op1, key.op0)) std::swap(key.op0, key.op1);
+            break;
+        }
+        case Opcode::addi:
+        case Opcode::addiu:
+        case Opcode::slti:
+        case Opcode::sltiu:
+        case Opcode::andi:
+        case Opcode::xori:
+        case Opcode::sll:
+        case Opcode::srl:
+        case Opcode::sra: {
+            auto &b = static_cast<const BinaryImm &>(instr);
+            key.op0 = value(b.rhs);
+            key.imm = b.imm;
+            if (!key.op0) return false;
+            break;
+        }
+        case Opcode::move:
+        case Opcode::clo:
+        case Opcode::clz:
+        case Opcode::negu:
+        case Opcode::seb:
+        case Opcode::seh:
+        case Opcode::bnot: {
+            key.op0 = value(static_cast<const Binary &>(instr).rhs);
+            if (!key.op0) return false;
+            break;
+        }
+        case Opcode::li:
+        case Opcode::lui:
+            key.imm = static_cast<const UnaryImm &>(instr).imm;
+            break;
+        case Opcode::lw: {
+            auto &location = *static_cast<const Memory &>(instr).location;
+            if (!arguments || location.status != MemoryLocation::Argument) return false;
+            key.imm = location.offset;
+            break;
+        }
+        default:
+            return false;
+    }
+    auto def = instr.def();
+    return def && value(def) == def.get();
+}
+
+// An expression is the opcode, the operand representatives and the constants. Only registers with a single
+// definition take part; loads are only numbered for argument slots the function never stores to.
+void Function::value_numbering() {
+    auto defs = count_definitions(*this);
+    auto zero = get_special(SpecialReg::zero);
+    // argument slots are constant unless the function stores into them
+    auto arguments = true;
+    for (auto &node : blocks) {
+        for (auto &i : node->instructions) {
+            if (i->opcode == Opcode::sw && static_cast<Memory *>(i.get())->location->status == MemoryLocation::Argument) {
+                arguments = false;
+            }
+        }
+    }
+    // registers of removed instructions, replaced by the register of the dominating instruction
+    unordered_map<const VirtReg *, std::shared_ptr<VirtReg>> replaced;
+    auto value = [&](const std::shared_ptr<VirtReg> &reg) -> const VirtReg * {
+        if (reg->allocated) return *reg == *zero ? zero.get() : nullptr;
+        auto r = replaced.find(reg.get());
+        if (r != replaced.end()) return r->second.get();
+        auto d = defs.find(reg.get());
+        return d != defs.end() && d->second == 1 ? reg.get() : nullptr;
+    };
+
+    auto &info = cfg();
+    std::vector<std::vector<size_t>> children(blocks.size());
+    for (auto n : info.rpo) {
+        if (n != 0) children[info.idom[n]].push_back(n);
+    }
+    unordered_map<ValueKey, std::shared_ptr<VirtReg>, ValueHash> available;
+    std::vector<std::pair<std::shared_ptr<VirtReg>, std::shared_ptr<VirtReg>>> merges;
+    // preorder walk of the dominator tree; the expressions of a node are visible in its subtree only,
+    // and only if they are computed before the first branch (a node may be left from the middle)
+    std::function<void(size_t)> visit = [&](size_t n) {
+        std::vector<ValueKey> scope, local;
+        std::vector<std::shared_ptr<Instruction>> kept;
+        auto exited = false;
+        for (auto &i : blocks[n]->instructions) {
+            ValueKey key{};
+            if (value_key(*i, value, arguments, key)) {
+                auto found = available.find(key);
+                if (found != available.end()) {
+                    replaced[i->def().get()] = found->second;
+                    merges.emplace_back(found->second, i->def());
+                    continue;
+                }
+                available[key] = i->def();
+                (exited ? local : scope).push_back(key);
+            }
+            exited |= i->branch() != nullptr;
+            kept.push_back(i);
+        }
+        blocks[n]->instructions = kept;
+        for (auto &k : local) {
+            available.erase(k);
+        }
+        for (auto c : children[n]) {
+            visit(c);
+        }
+        for (auto &k : scope) {
+            available.erase(k);
+        }
+    };
+    visit(0);
+    if (merges.empty()) return;
+    for (auto &i : merges) {
+        unite(i.first, i.second);
+    }
+    canonicalize();
+    invalidate(Analysis::Liveness | Analysis::Interference);
+}
+
+// Mark and sweep over the use-def graph of the equivalent classes: calls, stores, branches, manual
+// instructions and definitions of special registers are the roots.
+void Function::eliminate_dead_code() {
+    auto &info = cfg();
+    std::vector<std::shared_ptr<CFGNode>> reachable;
+    for (size_t n = 0; n < blocks.size(); ++n) {
+        if (info.rpo_index[n] != CFGInfo::NONE) reachable.push_back(blocks[n]);
+    }
+    // an unreachable node has no edge from a reachable one, so no reachable node falls through into it
+    if (reachable.size() != blocks.size()) {
+        blocks = reachable;
+        invalidate_cfg();
+    }
+
+    unite_phis();
+    canonicalize();
+    // instructions whose only effect is defining a register are removable; all others are roots
+    auto removable = [](const Instruction &i) {
+        auto def = i.def();
+        return def && !def->allocated && i.opcode != Opcode::callfunc;
+    };
+    unordered_map<const VirtReg *, std::vector<const Instruction *>> definitions;
+    std::vector<const Instruction *> worklist;
+    for (auto &node : blocks) {
+        for (auto &i : node->instructions) {
+            if (removable(*i)) {
+                definitions[i->def().get()].push_back(i.get());
+            } else if (i->opcode != Opcode::phi) {
+                worklist.push_back(i.get());
+            }
+        }
+    }
+    unordered_set<const VirtReg *> live;
+    while (!worklist.empty()) {
+        auto instr = worklist.back();
+        worklist.pop_back();
+        unordered_set<std::shared_ptr<VirtReg>> used;
+        instr->collect_register(used);
+        for (auto &reg : used) {
+            if (!live.insert(reg.get()).second) continue;
+            auto defs = definitions.find(reg.get());
+            if (defs != definitions.end()) worklist.insert(worklist.end(), defs->second.begin(), defs->second.end());
+        }
+    }
+
+    auto changed = false;
+    for (auto &node : blocks) {
+        auto &instr = node->instructions;
+        auto end = std::remove_if(instr.begin(), instr.end(), [&](const std::shared_ptr<Instruction> &i) {
+            if (i->opcode == Opcode::phi) {
+                auto &op = static_cast<const phi &>(*i).op0;
+                return !op->allocated && !live.count(op.get());
+            }
+            return removable(*i) && !live.count(i->def().get());
+        });
+        changed |= end != instr.end();
+        instr.erase(end, instr.end());
+    }
+    if (changed) invalidate(Analysis::Liveness | Analysis::Interference);
+}
+
+/*!
+ * The Lattice struct. Value of an equivalent class during constant propagation.
+ */
+struct Lattice {
+    /*!
+     * No executable definition seen yet, a single constant, or several values.
+     */
+    enum Kind {
+        Undefined, Constant, Varying
+    } kind;
+    /*!
+     * The constant.
+     */
+    int32_t value;
+
+    /*!
+     * Combine two values reaching the same class.
+     * @param that the other value.
+     * @return the combined value.
+     */
+    Lattice meet(const Lattice &that) const {
+        if (kind == Undefined) return that;
+        if (that.kind == Undefined) return *this;
+        if (kind == Varying || that.kind == Varying || value != that.value) return {Varying, 0};
+        return *this;
+    }
+};
+
+/*!
+ * Resolves an operand to its lattice value.
+ */
+using LatticeOf = std::function<Lattice(const std::shared_ptr<VirtReg> &)>;
+
+static int32_t leading_zeros(uint32_t x) {
+    int32_t count = 0;
+    for (uint32_t bit = 0x80000000u; bit && !(x & bit); bit >>= 1) count++;
+    return count;
+}
+
+/*!
+ * Fold an instruction.
+ * @param instr the instruction.
+ * @param value lattice value of the operands.
+ * @return the value computed; Varying for instructions that are not folded (memory, calls, trapping overflow).
+ */
+static Lattice evaluate(const Instruction &instr, const LatticeOf &value) {
+    std::shared_ptr<VirtReg> x, y;
+    int64_t imm = 0;
+    switch (instr.opcode) {
+        case Opcode::add:
+        case Opcode::addu:
+        case Opcode::sub:
+        case Opcode::subu:
+        case Opcode::mul:
+        case Opcode::bor:
+        case Opcode::band:
+        case Opcode::bxor:
+        case Opcode::slt:
+        case Opcode::sltu:
+        case Opcode::sllv:
+        case Opcode::srav:
+        case Opcode::srlv:
+            x = static_cast<const Ternary &>(instr).op0;
+            y = static_cast<const Ternary &>(instr).op1;
+            break;
+        case Opcode::addi:
+        case Opcode::addiu:
+        case Opcode::slti:
+        case Opcode::sltiu:
+        case Opcode::andi:
+        case Opcode::xori:
+        case Opcode::sll:
+        case Opcode::srl:
+        case Opcode::sra:
+            x = static_cast<const BinaryImm &>(instr).rhs;
+            imm = static_cast<const BinaryImm &>(instr).imm;
+            break;
+        case Opcode::move:
+        case Opcode::clo:
+        case Opcode::clz:
+        case Opcode::negu:
+        case Opcode::seb:
+        case Opcode::seh:
+        case Opcode::bnot:
+            x = static_cast<const Binary &>(instr).rhs;
+            break;
+        case Opcode::li:
+        case Opcode::lui:
+            imm = static_cast<const UnaryImm &>(instr).imm;
+            break;
+        default:
+            return {Lattice::Varying, 0};
+    }
+    Lattice a{Lattice::Constant, 0}, b{Lattice::Constant, 0};
+    if (x) a = value(x);
+    if (y) b = value(y);
+    if (a.kind == Lattice::Varying || b.kind == Lattice::Varying) return {Lattice::Varying, 0};
+    if (a.kind == Lattice::Undefined || b.kind == Lattice::Undefined) return {Lattice::Undefined, 0};
+    int64_t p = a.value, q = b.value, r;
+    uint32_t u = a.value, v = b.value;
+    switch (instr.opcode) {
+        case Opcode::add:
+            r = p + q;
+            break;
+        case Opcode::addu:
+            r = (int32_t) (u + v);
+            break;
+        case Opcode::sub:
+            r = p - q;
+            break;
+        case Opcode::subu:
+            r = (int32_t) (u - v);
+            break;
+        case Opcode::mul:
+            r = (int32_t) (u * v);
+            break;
+        case Opcode::bor:
+            r = (int32_t) (u | v);
+            break;
+        case Opcode::band:
+            r = (int32_t) (u & v);
+            break;
+        case Opcode::bxor:
+            r = (int32_t) (u ^ v);
+            break;
+        case Opcode::slt:
+            r = p < q;
+            break;
+        case Opcode::sltu:
+            r = u < v;
+            break;
+        case Opcode::sllv:
+            r = (int32_t) (u << (v & 31));
+            break;
+        case Opcode::srav:
+            r = a.value >> (v & 31);
+            break;
+        case Opcode::srlv:
+            r = (int32_t) (u >> (v & 31));
+            break;
+        case Opcode::addi:
+            r = p + (int32_t) imm;
+            break;
+        case Opcode::addiu:
+            r = (int32_t) (u + (uint32_t) imm);
+            break;
+        case Opcode::slti:
+            r = p < (int32_t) imm;
+            break;
+        case Opcode::sltiu:
+            r = u < (uint32_t) imm;
+            break;
+        case Opcode::andi:
+            r = (int32_t) (u & (uint32_t) imm);
+            break;
+        case Opcode::xori:
+            r = (int32_t) (u ^ (uint32_t) imm);
+            break;
+        case Opcode::sll:
+            r = (int32_t) (u << (imm & 31));
+            break;
+        case Opcode::srl:
+            r = (int32_t) (u >> (imm & 31));
+            break;
+        case Opcode::sra:
+            r = a.value >> (imm & 31);
+            break;
+        case Opcode::clo:
+            r = leading_zeros(~u);
+            break;
+        case Opcode::clz:
+            r = leading_zeros(u);
+            break;
+        case Opcode::negu:
+            r = (int32_t) (0u - u);
+            break;
+        case Opcode::seb:
+            r = (int8_t) u;
+            break;
+        case Opcode::seh:
+            r = (int16_t) u;
+            break;
+        case Opcode::bnot:
+            r = (int32_t) ~u;
+            break;
+        case Opcode::li:
+            r = (int32_t) imm;
+            break;
+        case Opcode::lui:
+            r = (int32_t) ((uint32_t) imm << 16);
+            break;
+        default: // move
+            r = p;
+            break;
+    }
+    // add, addi and sub trap on overflow, which must happen at run time
+    if (r != (int32_t) r) return {Lattice::Varying, 0};
+    return {Lattice::Constant, (int32_t) r};
+}
+
+/*!
+ * Decide a conditional branch.
+ * @param instr the branch.
+ * @param value lattice value of the operands.
+ * @return Constant 1 if always taken, Constant 0 if never taken, otherwise Varying (also for jumps).
+ */
+static Lattice taken(const Instruction &instr, const LatticeOf &value) {
+    Lattice a{Lattice::Varying, 0}, b{Lattice::Constant, 0};
+    switch (instr.opcode) {
+        case Opcode::beqz:
+        case Opcode::bnez:
+        case Opcode::blez:
+        case Opcode::bgtz:
+        case Opcode::bltz:
+        case Opcode::bgez:
+            a = value(static_cast<const ZeroBranch &>(instr).target);
+            break;
+        case Opcode::beq:
+        case Opcode::bne:
+        case Opcode::ble:
+        case Opcode::bge:
+        case Opcode::blt:
+        case Opcode::bgt:
+            a = value(static_cast<const CmpBranch &>(instr).lhs);
+            b = value(static_cast<const CmpBranch &>(instr).rhs);
+            break;
+        default:
+            break;
+    }
+    // an undefined operand is not decided, so that both arms stay executable
+    if (a.kind != Lattice::Constant || b.kind != Lattice::Constant) return {Lattice::Varying, 0};
+    bool result;
+    switch (instr.opcode) {
+        case Opcode::beqz:
+        case Opcode::beq:
+            result = a.value == b.value;
+            break;
+        case Opcode::bnez:
+        case Opcode::bne:
+            result = a.value != b.value;
+            break;
+        case Opcode::blez:
+        case Opcode::ble:
+            result = a.value <= b.value;
+            break;
+        case Opcode::bgtz:
+        case Opcode::bgt:
+            result = a.value > b.value;
+            break;
+        case Opcode::bltz:
+        case Opcode::blt:
+            result = a.value < b.value;
+            break;
+        default: // bgez, bge
+            result = a.value >= b.value;
+            break;
+    }
+    return {Lattice::Constant, result};
+}
+
+/*!
+ * Rewrite a register-register operation with a constant operand into its immediate form (shifts by a constant
+ * amount included).
+ * @param instr the instruction.
+ * @param value lattice value of the operands.
+ * @return the immediate form; null if there is none or the constant does not fit.
+ */
+static std::shared_ptr<Instruction> immediate_form(const Instruction &instr, const LatticeOf &value) {
+    auto commutative = false;
+    switch (instr.opcode) {
+        case Opcode::add:
+        case Opcode::addu:
+        case Opcode::band:
+        case Opcode::bxor:
+            commutative = true;
+            break;
+        case Opcode::sub:
+        case Opcode::subu:
+        case Opcode::slt:
+        case Opcode::sltu:
+        case Opcode::sllv:
+        case Opcode::srav:
+        case Opcode::srlv:
+            break;
+        default:
+            return nullptr;
+    }
+    auto &t = static_cast<const Ternary &>(instr);
+    auto reg = t.op0;
+    auto constant = value(t.op1);
+    if (constant.kind != Lattice::Constant && commutative) {
+        reg = t.op1;
+        constant = value(t.op0);
+    }
+    if (constant.kind != Lattice::Constant) return nullptr;
+    int64_t k = constant.value;
+    switch (instr.opcode) {
+        case Opcode::add:
+            return fits_signed16(k) ? std::make_shared<addi>(t.lhs, reg, k) : nullptr;
+        case Opcode::addu:
+            return fits_signed16(k) ? std::make_shared<addiu>(t.lhs, reg, k) : nullptr;
+        case Opcode::sub:
+            return fits_signed16(-k) ? std::make_shared<addi>(t.lhs, reg, -k) : nullptr;
+        case Opcode::subu:
+            return fits_signed16(-k) ? std::make_shared<addiu>(t.lhs, reg, -k) : nullptr;
+        case Opcode::slt:
+            return fits_signed16(k) ? std::make_shared<slti>(t.lhs, reg, k) : nullptr;
+        case Opcode::sltu:
+            return fits_signed16(k) ? std::make_shared<sltiu>(t.lhs, reg, k) : nullptr;
+        case Opcode::band:
+            return fits_unsigned16(k) ? std::make_shared<andi>(t.lhs, reg, k) : nullptr;
+        case Opcode::sllv:
+            return std::make_shared<sll>(t.lhs, reg, k & 31);
+        case Opcode::srav:
+            return std::make_shared<sra>(t.lhs, reg, k & 31);
+        case Opcode::srlv:
+            return std::make_shared<srl>(t.lhs, reg, k & 31);
+        default: // bxor
+            return fits_unsigned16(k) ? std::make_shared<xori>(t.lhs, reg, k) : nullptr;
+    }
+}
+
+// Constants flow through phi nodes and arithmetic over the equivalent classes, along the executable edges only.
+// Register-register operations with a constant operand take their immediate form (addi, addiu, slti, sltiu,
+// andi, xori, sll, sra, srl); branches with a constant condition become j or disappear.
+void Function::propagate_constants() {
+    unite_phis();
+    canonicalize();
+    auto &info = cfg();
+    auto size = blocks.size();
+    auto zero = get_special(SpecialReg::zero);
+    unordered_map<const VirtReg *, Lattice> classes;
+    LatticeOf value = [&](const std::shared_ptr<VirtReg> &reg) -> Lattice {
+        if (reg->allocated) return *reg == *zero ? Lattice{Lattice::Constant, 0} : Lattice{Lattice::Varying, 0};
+        auto found = classes.find(reg.get());
+        return found == classes.end() ? Lattice{Lattice::Undefined, 0} : found->second;
+    };
+
+    // the values of a class only come from its definitions in executable nodes, and the parts of a node after
+    // an always taken branch never run; iterate in reverse postorder until nothing changes
+    std::vector<bool> executable(size, false);
+    executable[0] = true;
+    for (auto changed = true; changed;) {
+        changed = false;
+        auto reach = [&](const std::shared_ptr<CFGNode> &target) {
+            auto v = info.index.find(target.get())->second;
+            if (!executable[v]) executable[v] = changed = true;
+        };
+        for (auto n : info.rpo) {
+            if (!executable[n]) continue;
+            auto falls = true;
+            for (auto &i : blocks[n]->instructions) {
+                auto def = i->def();
+                if (def && !def->allocated) {
+                    auto &current = classes.emplace(def.get(), Lattice{Lattice::Undefined, 0}).first->second;
+                    auto next = current.meet(evaluate(*i, value));
+                    if (next.kind != current.kind || next.value != current.value) {
+                        current = next;
+                        changed = true;
+                    }
+                }
+                auto target = i->branch();
+                auto decided = target ? taken(*i, value) : Lattice{Lattice::Varying, 0};
+                if (target && (decided.kind != Lattice::Constant || decided.value)) reach(target);
+                if (i->terminates() || (decided.kind == Lattice::Constant && decided.value)) {
+                    falls = false;
+                    break;
+                }
+            }
+            if (falls && n + 1 < size) reach(blocks[n + 1]);
+        }
+    }
+
+    std::vector<std::shared_ptr<CFGNode>> kept;
+    for (size_t n = 0; n < size; ++n) {
+        if (!executable[n]) continue;
+        auto &node = *blocks[n];
+        std::vector<std::shared_ptr<Instruction>> code;
+        for (auto &i : node.instructions) {
+            auto target = i->branch();
+            if (target) {
+                auto decided = taken(*i, value);
+                if (decided.kind == Lattice::Constant) {
+                    if (!decided.value) continue;
+                    code.push_back(std::make_shared<vmips::j>(target));
+                    break;
+                }
+            }
+            auto def = i->def();
+            auto folded = def && !def->allocated ? evaluate(*i, value) : Lattice{Lattice::Varying, 0};
+            if (folded.kind == Lattice::Constant) {
+                code.push_back(i->opcode == Opcode::li || i->opcode == Opcode::lui
+                               ? i : std::make_shared<li>(def, folded.value));
+                continue;
+            }
+            auto immediate = immediate_form(*i, value);
+            code.push_back(immediate ? immediate : i);
+        }
+        node.instructions = code;
+
+        // keep the out edges still taken by a branch or by the fall-through, in their order
+        std::vector<std::shared_ptr<CFGNode>> targets;
+        for (auto &i : code) {
+            auto target = i->branch();
+            if (target) targets.push_back(target);
+        }
+        if ((code.empty() || !code.back()->terminates()) && n + 1 < size) targets.push_back(blocks[n + 1]);
+        std::vector<std::weak_ptr<CFGNode>> edges;
+        std::vector<size_t> counts;
+        for (size_t k = 0; k < node.out_edges.size(); ++k) {
+            auto found = std::find(targets.begin(), targets.end(), node.out_edges[k].lock());
+            if (found == targets.end()) continue;
+            targets.erase(found);
+            edges.push_back(node.out_edges[k]);
+            if (k < node.edge_counts.size()) counts.push_back(node.edge_counts[k]);
+        }
+        node.out_edges = edges;
+        node.edge_counts = counts;
+        kept.push_back(blocks[n]);
+    }
+    blocks = kept;
+    invalidate_cfg();
+    invalidate(Analysis::Liveness | Analysis::Interference);
+}
+
+/*!
+ * The SignedMagic struct. Multiplier and shift replacing a signed division by a constant.
+ */
+struct SignedMagic {
+    int32_t multiplier;
+    int shift;
+};
+
+/*!
+ * Compute the magic number of a signed division (Hacker's Delight, 10-1).
+ * @param d the divisor; neither 0, 1, -1 nor a power of two in magnitude.
+ * @return the magic number.
+ */
+static SignedMagic signed_magic(int32_t d) {
+    const uint32_t two31 = 0x80000000u;
+    uint32_t ad = d < 0 ? 0u - (uint32_t) d : (uint32_t) d;
+    uint32_t t = two31 + ((uint32_t) d >> 31);
+    uint32_t anc = t - 1 - t % ad;
+    uint32_t q1 = two31 / anc, r1 = two31 - q1 * anc;
+    uint32_t q2 = two31 / ad, r2 = two31 - q2 * ad;
+    uint32_t delta;
+    int p = 31;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    return {(int32_t) (d < 0 ? 0u - (q2 + 1) : q2 + 1), p - 32};
+}
+
+/*!
+ * The UnsignedMagic struct. Multiplier and shift replacing an unsigned division by a constant.
+ */
+struct UnsignedMagic {
+    uint32_t multiplier;
+    /*!
+     * Whether the multiplier overflows 32 bits, so that the dividend is added back after the multiplication.
+     */
+    bool add;
+    int shift;
+};
+
+/*!
+ * Compute the magic number of an unsigned division (Hacker's Delight, 10-10).
+ * @param d the divisor; neither 0 nor a power of two.
+ * @return the magic number.
+ */
+static UnsignedMagic unsigned_magic(uint32_t d) {
+    auto add = false;
+    uint32_t nc = UINT32_MAX - (0u - d) % d;
+    uint32_t q1 = 0x80000000u / nc, r1 = 0x80000000u - q1 * nc;
+    uint32_t q2 = 0x7fffffffu / d, r2 = 0x7fffffffu - q2 * d;
+    uint32_t delta;
+    int p = 31;
+    do {
+        p++;
+        if (r1 >= nc - r1) {
+            q1 = 2 * q1 + 1;
+            r1 = 2 * r1 - nc;
+        } else {
+            q1 = 2 * q1;
+            r1 = 2 * r1;
+        }
+        if (r2 + 1 >= d - r2) {
+            if (q2 >= 0x7fffffffu) add = true;
+            q2 = 2 * q2 + 1;
+            r2 = 2 * r2 + 1 - d;
+        } else {
+            if (q2 >= 0x80000000u) add = true;
+            q2 = 2 * q2;
+            r2 = 2 * r2 + 1;
+        }
+        delta = d - 1 - r2;
+    } while (p < 64 && (q1 < delta || (q1 == delta && r1 == 0)));
+    return {q2 + 1, add, p - 32};
+}
+
+static bool power_of_two(uint32_t x) {
+    return x && !(x & (x - 1));
+}
+
+static int bit_index(uint32_t x) {
+    int n = 0;
+    while (x >>= 1) n++;
+    return n;
+}
+
+/*!
+ * Generate the shifts and additions of a multiplication by a constant.
+ * @param code instruction accumulator.
+ * @param lhs the product.
+ * @param x the multiplicand.
+ * @param k the constant.
+ * @return whether the constant has a cheap sequence (nothing is generated otherwise).
+ */
+static bool multiply(std::vector<std::shared_ptr<Instruction>> &code, const std::shared_ptr<VirtReg> &lhs,
+                     const std::shared_ptr<VirtReg> &x, int32_t k) {
+    uint32_t u = k;
+    if (u == 0) {
+        code.push_back(std::make_shared<li>(lhs, 0));
+    } else if (u == 1) {
+        code.push_back(std::make_shared<move>(lhs, x));
+    } else if (k == -1) {
+        code.push_back(std::make_shared<negu>(lhs, x));
+    } else if (power_of_two(u)) {
+        code.push_back(std::make_shared<sll>(lhs, x, bit_index(u)));
+    } else if (power_of_two(0u - u)) {
+        auto t = VirtReg::create();
+        code.push_back(std::make_shared<sll>(t, x, bit_index(0u - u)));
+        code.push_back(std::make_shared<negu>(lhs, t));
+    } else if (power_of_two(u - 1)) {
+        auto t = VirtReg::create();
+        code.push_back(std::make_shared<sll>(t, x, bit_index(u - 1)));
+        code.push_back(std::make_shared<addu>(lhs, t, x));
+    } else if (power_of_two(u + 1)) {
+        auto t = VirtReg::create();
+        code.push_back(std::make_shared<sll>(t, x, bit_index(u + 1)));
+        code.push_back(std::make_shared<subu>(lhs, t, x));
+    } else if (power_of_two(u & (u - 1))) {
+        auto high = VirtReg::create(), low = VirtReg::create();
+        code.push_back(std::make_shared<sll>(high, x, bit_index(u & (u - 1))));
+        code.push_back(std::make_shared<sll>(low, x, bit_index(u & (0u - u))));
+        code.push_back(std::make_shared<addu>(lhs, high, low));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * Generate the quotient of a division by a constant.
+ * @param code instruction accumulator.
+ * @param q the quotient.
+ * @param x the dividend.
+ * @param d the divisor (not 0; not INT32_MIN for a signed division).
+ * @param is_signed whether the division is signed (div) or unsigned (divu).
+ */
+static void divide(std::vector<std::shared_ptr<Instruction>> &code, const std::shared_ptr<VirtReg> &q,
+                   const std::shared_ptr<VirtReg> &x, int32_t d, bool is_signed) {
+    uint32_t magnitude = is_signed && d < 0 ? 0u - (uint32_t) d : (uint32_t) d;
+    if (magnitude == 1) {
+        if (is_signed && d < 0) {
+            code.push_back(std::make_shared<negu>(q, x));
+        } else {
+            code.push_back(std::make_shared<move>(q, x));
+        }
+        return;
+    }
+    if (!is_signed && power_of_two(magnitude)) {
+        code.push_back(std::make_shared<srl>(q, x, bit_index(magnitude)));
+        return;
+    }
+    if (!is_signed) {
+        auto magic = unsigned_magic(magnitude);
+        auto m = VirtReg::create(), high = VirtReg::create();
+        code.push_back(std::make_shared<li>(m, (int32_t) magic.multiplier));
+        code.push_back(std::make_shared<multu>(x, m));
+        code.push_back(std::make_shared<mfhi>(high));
+        if (!magic.add) {
+            code.push_back(std::make_shared<srl>(q, high, magic.shift));
+            return;
+        }
+        // q = (((x - high) >> 1) + high) >> (shift - 1)
+        auto diff = VirtReg::create(), half = VirtReg::create(), sum = VirtReg::create();
+        code.push_back(std::make_shared<subu>(diff, x, high));
+        code.push_back(std::make_shared<srl>(half, diff, 1));
+        code.push_back(std::make_shared<addu>(sum, half, high));
+        code.push_back(std::make_shared<srl>(q, sum, magic.shift - 1));
+        return;
+    }
+    auto negative = d < 0;
+    auto result = negative ? VirtReg::create() : q;
+    if (power_of_two(magnitude)) {
+        // round towards zero: add magnitude - 1 to negative dividends before the arithmetic shift
+        auto s = bit_index(magnitude);
+        auto bias = VirtReg::create(), biased = VirtReg::create();
+        if (s == 1) {
+            code.push_back(std::make_shared<srl>(bias, x, 31));
+        } else {
+            auto sign = VirtReg::create();
+            code.push_back(std::make_shared<sra>(sign, x, 31));
+            code.push_back(std::make_shared<srl>(bias, sign, 32 - s));
+        }
+        code.push_back(std::make_shared<addu>(biased, x, bias));
+        code.push_back(std::make_shared<sra>(result, biased, s));
+    } else {
+        auto magic = signed_magic(d);
+        auto m = VirtReg::create(), high = VirtReg::create();
+        code.push_back(std::make_shared<li>(m, magic.multiplier));
+        code.push_back(std::make_shared<mult>(x, m));
+        code.push_back(std::make_shared<mfhi>(high));
+        if (!negative && magic.multiplier < 0) {
+            auto t = VirtReg::create();
+            code.push_back(std::make_shared<addu>(t, high, x));
+            high = t;
+        } else if (negative && magic.multiplier > 0) {
+            auto t = VirtReg::create();
+            code.push_back(std::make_shared<subu>(t, high, x));
+            high = t;
+        }
+        if (magic.shift > 0) {
+            auto t = VirtReg::create();
+            code.push_back(std::make_shared<sra>(t, high, magic.shift));
+            high = t;
+        }
+        // round towards zero: add one to negative quotients
+        auto sign = VirtReg::create();
+        code.push_back(std::make_shared<srl>(sign, high, 31));
+        code.push_back(std::make_shared<addu>(q, high, sign));
+        return;
+    }
+    if (negative) code.push_back(std::make_shared<negu>(q, result));
+}
+
+/*!
+ * Check whether an instruction writes the HI/LO registers.
+ * @param instr the instruction.
+ * @return check result.
+ */
+static bool writes_hilo(const Instruction &instr) {
+    switch (instr.opcode) {
+        case Opcode::div:
+        case Opcode::divu:
+        case Opcode::mult:
+        case Opcode::multu:
+        case Opcode::mul: // may clobber HI/LO
+            return true;
+        default:
+            return false;
+    }
+}
+
+// mul becomes shifts and additions when the constant has at most two bits set (or is one less than a power
+// of two). div and divu read back with mflo/mfhi become shifts for powers of two and multiply-high sequences
+// with a magic number otherwise.
+void Function::reduce_strength() {
+    auto defs = count_definitions(*this);
+    auto zero = get_special(SpecialReg::zero);
+    // constant classes are defined once by li (constant propagation turns folded values into li)
+    unordered_map<const VirtReg *, int32_t> constants;
+    // HI/LO is only tracked within a node, so nothing is rewritten if some node reads it before writing it
+    auto local = true;
+    for (auto &node : blocks) {
+        auto written = false;
+        for (auto &i : node->instructions) {
+            if (i->opcode == Opcode::li && defs[i->def().get()] == 1) {
+                constants[i->def().get()] = (int32_t) static_cast<const UnaryImm &>(*i).imm;
+            }
+            written |= writes_hilo(*i);
+            if (!written && (i->opcode == Opcode::mflo || i->opcode == Opcode::mfhi)) local = false;
+        }
+    }
+    auto constant = [&](const std::shared_ptr<VirtReg> &reg, int32_t &k) {
+        if (*reg == *zero) {
+            k = 0;
+            return true;
+        }
+        auto found = constants.find(reg.get());
+        if (found == constants.end()) return false;
+        k = found->second;
+        return true;
+    };
+
+    auto changed = false;
+    for (auto &node : blocks) {
+        auto &instr = node->instructions;
+        // divisions: the quotient and the remainder are computed where mflo and mfhi read them
+        std::vector<std::vector<std::shared_ptr<Instruction>>> expansion(instr.size());
+        std::vector<bool> dropped(instr.size(), false);
+        for (size_t p = 0; local && p < instr.size(); ++p) {
+            auto is_signed = instr[p]->opcode == Opcode::div;
+            if (!is_signed && instr[p]->opcode != Opcode::divu) continue;
+            auto &division = static_cast<const Binary &>(*instr[p]);
+            auto x = division.lhs, k = division.rhs;
+            int32_t d;
+            if (!constant(k, d) || d == 0 || (is_signed && d == INT32_MIN)) continue;
+            // the operands must still hold their values at every read of the result
+            std::vector<size_t> readers;
+            auto clobbered = false, valid = true;
+            for (auto j = p + 1; j < instr.size() && !writes_hilo(*instr[j]); ++j) {
+                if (instr[j]->opcode == Opcode::mflo || instr[j]->opcode == Opcode::mfhi) {
+                    valid &= !clobbered;
+                    readers.push_back(j);
+                }
+                auto def = instr[j]->def();
+                clobbered |= instr[j]->opcode == Opcode::callfunc || (def && (*def == *x || *def == *k));
+            }
+            if (!valid) continue;
+            dropped[p] = true;
+            for (auto j : readers) {
+                auto target = instr[j]->def();
+                auto &code = expansion[j];
+                dropped[j] = true;
+                if (instr[j]->opcode == Opcode::mflo) {
+                    divide(code, target, x, d, is_signed);
+                } else if (!is_signed && power_of_two((uint32_t) d) && fits_unsigned16((uint32_t) d - 1)) {
+                    code.push_back(std::make_shared<andi>(target, x, (uint32_t) d - 1));
+                } else {
+                    // x - q * d; the multiplication is reduced below
+                    auto q = VirtReg::create(), product = VirtReg::create();
+                    divide(code, q, x, d, is_signed);
+                    code.push_back(std::make_shared<mul>(product, q, k));
+                    code.push_back(std::make_shared<subu>(target, x, product));
+                }
+            }
+        }
+        std::vector<std::shared_ptr<Instruction>> divided;
+        for (size_t p = 0; p < instr.size(); ++p) {
+            if (!dropped[p]) divided.push_back(instr[p]);
+            divided.insert(divided.end(), expansion[p].begin(), expansion[p].end());
+            changed |= dropped[p];
+        }
+
+        // multiplications
+        std::vector<std::shared_ptr<Instruction>> code;
+        for (auto &i : divided) {
+            if (i->opcode == Opcode::mul) {
+                auto &t = static_cast<const Ternary &>(*i);
+                int32_t k;
+                if ((constant(t.op1, k) && multiply(code, t.lhs, t.op0, k)) ||
+                    (constant(t.op0, k) && multiply(code, t.lhs, t.op1, k))) {
+                    changed = true;
+                    continue;
+                }
+            }
+            code.push_back(i);
+        }
+        instr = code;
+    }
+    if (changed) invalidate(Analysis::Liveness | Analysis::Interference);
+}
+
+// A loop is a CFGNode ending with a jump back to itself. An array_load/array_store indexed by a register the
+// loop only advances with addi/addiu goes through a pointer, computed before each entry of the loop and
+// advanced right after the index.
+void Function::reduce_induction_variables() {
+    auto defs = count_definitions(*this);
+    auto &info = cfg();
+    auto changed = false;
+    // the entry has no predecessor to compute the pointers in
+    for (size_t n = 1; n < blocks.size(); ++n) {
+        auto loop = blocks[n];
+        auto &instr = loop->instructions;
+        if (instr.empty() || instr.back()->opcode != Opcode::j || instr.back()->branch() != loop) continue;
+        unordered_map<const VirtReg *, size_t> inner;
+        auto calls = false;
+        for (auto &i : instr) {
+            auto def = i->def();
+            if (def) inner[def.get()]++;
+            calls |= i->opcode == Opcode::callfunc;
+        }
+        // basic induction variables: also defined outside, advanced once per iteration inside
+        unordered_map<const VirtReg *, size_t> steps;
+        for (size_t p = 0; p < instr.size(); ++p) {
+            if (instr[p]->opcode != Opcode::addi && instr[p]->opcode != Opcode::addiu) continue;
+            auto &step = static_cast<const BinaryImm &>(*instr[p]);
+            if (!(*step.lhs == *step.rhs) || step.lhs->allocated || inner[step.lhs.get()] != 1 ||
+                defs[step.lhs.get()] < 2 || !fits_signed16(step.imm * 4)) {
+                continue;
+            }
+            steps[step.lhs.get()] = p;
+        }
+        if (steps.empty()) continue;
+
+        // one pointer per induction variable and array (stack location or base register)
+        struct Pointer {
+            const void *array;
+            const VirtReg *index;
+            std::shared_ptr<VirtReg> reg;
+            std::shared_ptr<ArrayAccess> first;
+        };
+        std::vector<Pointer> pointers;
+        auto pointer_of = [&](const ArrayAccess &access) -> Pointer * {
+            auto &location = *access.location;
+            auto stack = location.status == MemoryLocation::Undetermined;
+            auto array = stack ? (const void *) &location : (const void *) location.base.get();
+            for (auto &k : pointers) {
+                if (k.array == array && k.index == access.offset.get()) return &k;
+            }
+            return nullptr;
+        };
+        for (auto &i : instr) {
+            if (i->opcode != Opcode::array_load && i->opcode != Opcode::array_store) continue;
+            auto &access = static_cast<const ArrayAccess &>(*i);
+            auto &location = *access.location;
+            auto &base = location.base;
+            auto stack = location.status == MemoryLocation::Undetermined;
+            if (!steps.count(access.offset.get()) || (!stack && location.status != MemoryLocation::Static) ||
+                inner.count(base.get()) || (base->allocated && calls && !stack) || pointer_of(access)) {
+                continue;
+            }
+            auto array = stack ? (const void *) &location : (const void *) base.get();
+            pointers.push_back({array, access.offset.get(), VirtReg::create(), std::static_pointer_cast<ArrayAccess>(i)});
+        }
+        if (pointers.empty()) continue;
+
+        std::vector<std::shared_ptr<Instruction>> code;
+        for (size_t p = 0; p < instr.size(); ++p) {
+            auto &i = instr[p];
+            if (i->opcode == Opcode::array_load || i->opcode == Opcode::array_store) {
+                auto &access = static_cast<const ArrayAccess &>(*i);
+                auto pointer = pointer_of(access);
+                if (pointer) {
+                    auto &location = *access.location;
+                    auto stack = location.status == MemoryLocation::Undetermined;
+                    auto element = new_static_mem(4, pointer->reg, stack ? 0 : location.offset);
+                    if (i->opcode == Opcode::array_load) {
+                        code.push_back(std::make_shared<lw>(access.target, element));
+                    } else {
+                        code.push_back(std::make_shared<sw>(access.target, element));
+                    }
+                    continue;
+                }
+            }
+            code.push_back(i);
+            auto step = steps.find(i->def() ? i->def().get() : nullptr);
+            if (step == steps.end() || step->second != p) continue;
+            for (auto &k : pointers) {
+                if (k.index != step->first) continue;
+                auto imm = static_cast<const BinaryImm &>(*i).imm * 4;
+                code.push_back(std::make_shared<addiu>(k.reg, k.reg, imm));
+            }
+        }
+        instr = code;
+
+        // compute the pointers (base + 4 * index) wherever the loop is entered from outside
+        auto setup = [&](std::vector<std::shared_ptr<Instruction>> &into) {
+            for (auto &k : pointers) {
+                auto &access = *k.first;
+                auto &location = access.location;
+                auto scaled = VirtReg::create(), start = VirtReg::create();
+                if (location->status == MemoryLocation::Undetermined) {
+                    auto offset = VirtReg::create();
+                    into.push_back(std::make_shared<address>(offset, location));
+                    into.push_back(std::make_shared<addu>(start, location->base, offset));
+                } else {
+                    into.push_back(std::make_shared<move>(start, location->base));
+                }
+                into.push_back(std::make_shared<sll>(scaled, access.offset, 2));
+                into.push_back(std::make_shared<addu>(k.reg, start, scaled));
+            }
+        };
+        for (auto m : info.predecessors[n]) {
+            if (m == n) continue;
+            auto &entering = blocks[m]->instructions;
+            std::vector<std::shared_ptr<Instruction>> result;
+            for (auto &i : entering) {
+                if (i->branch() == loop) setup(result);
+                result.push_back(i);
+            }
+            if (m + 1 == n && (result.empty() || !result.back()->terminates())) setup(result);
+            entering = result;
+        }
+        changed = true;
+    }
+    if (changed) invalidate(Analysis::Liveness | Analysis::Interference);
+}
+
+/*!
+ * Collect the registers an instruction considered by hoist_invariants() reads.
+ * @param instr the instruction.
+ * @param used the registers (accumulator), including the allocated ones.
+ * @return whether the instruction computes its def from the registers alone (and possibly memory).
+ */
+static bool invariant_operands(const Instruction &instr, std::vector<std::shared_ptr<VirtReg>> &used) {
+    switch (instr.opcode) {
+        case Opcode::add:
+        case Opcode::addu:
+        case Opcode::mul:
+        case Opcode::bor:
+        case Opcode::bxor:
+        case Opcode::band:
+        case Opcode::sub:
+        case Opcode::subu:
+        case Opcode::slt:
+        case Opcode::sltu:
+        case Opcode::sllv:
+        case Opcode::srav:
+        case Opcode::srlv: {
+            auto &t = static_cast<const Ternary &>(instr);
+            used.push_back(t.op0);
+            used.push_back(t.op1);
+            return true;
+        }
+        case Opcode::addi:
+        case Opcode::addiu:
+        case Opcode::slti:
+        case Opcode::sltiu:
+        case Opcode::andi:
+        case Opcode::xori:
+        case Opcode::sll:
+        case Opcode::srl:
+        case Opcode::sra:
+            used.push_back(static_cast<const BinaryImm &>(instr).rhs);
+            return true;
+        case Opcode::move:
+        case Opcode::clo:
+        case Opcode::clz:
+        case Opcode::negu:
+        case Opcode::seb:
+        case Opcode::seh:
+        case Opcode::bnot:
+            used.push_back(static_cast<const Binary &>(instr).rhs);
+            return true;
+        case Opcode::li:
+        case Opcode::lui:
+        case Opcode::la:
+        case Opcode::address:
+            return true;
+        case Opcode::array_load:
+            used.push_back(static_cast<const ArrayAccess &>(instr).offset);
+            // fall through
+        case Opcode::lw: {
+            auto &location = *static_cast<const Memory &>(instr).location;
+            if (location.status == MemoryLocation::Static) used.push_back(location.base);
+            return location.status != MemoryLocation::Assigned;
+        }
+        default:
+            return false;
+    }
+}
+
+/*!
+ * Check whether an instruction may trap or fault when executed on a path it was not on.
+ * @param instr the instruction.
+ * @return check result.
+ */
+static bool may_trap(const Instruction &instr) {
+    switch (instr.opcode) {
+        case Opcode::add:
+        case Opcode::addi:
+        case Opcode::sub:
+        case Opcode::array_load:
+            return true;
+        case Opcode::lw:
+            return static_cast<const Memory &>(instr).location->status == MemoryLocation::Static;
+        default:
+            return false;
+    }
+}
+
+// Pure instructions (la, address, constants and arithmetic) and loads of argument slots and stack memory the
+// loop does not store to move. The only predecessor outside the loop serves as the preheader if the loop is
+// its only successor; otherwise a new CFGNode is inserted before the header. Instructions that may trap (add,
+// addi, sub and loads through a register) only move when they run on every entry of the loop, i.e. from the
+// header before its first branch.
+void Function::hoist_invariants() {
+    auto zero = get_special(SpecialReg::zero);
+    unordered_set<const CFGNode *> visited;
+    auto changed = false;
+    for (;;) {
+        auto &info = cfg();
+        size_t k = 0;
+        while (k < info.loops.size() && visited.count(blocks[info.loops[k].header].get())) ++k;
+        if (k == info.loops.size()) break;
+        auto h = info.loops[k].header;
+        auto in_loop = info.loops[k].body;
+        auto header = blocks[h];
+        visited.insert(header.get());
+
+        auto defs = count_definitions(*this);
+        // what the loop defines, stores and calls
+        unordered_map<const VirtReg *, size_t> inner;
+        std::vector<std::shared_ptr<VirtReg>> specials;
+        std::vector<const MemoryLocation *> stores;
+        auto calls = false, static_stores = false;
+        for (size_t n = 0; n < blocks.size(); ++n) {
+            if (!in_loop[n]) continue;
+            for (auto &i : blocks[n]->instructions) {
+                auto def = i->def();
+                if (def && def->allocated) specials.push_back(def);
+                else if (def) inner[def.get()]++;
+                calls |= i->opcode == Opcode::callfunc;
+                if (i->opcode == Opcode::sw || i->opcode == Opcode::array_store) {
+                    auto location = static_cast<const Memory &>(*i).location.get();
+                    stores.push_back(location);
+                    static_stores |= location->status == MemoryLocation::Static;
+                }
+            }
+        }
+        unordered_set<const VirtReg *> hoisted_defs;
+        auto invariant = [&](const std::shared_ptr<VirtReg> &reg) {
+            if (reg->allocated) {
+                if (*reg == *zero) return true;
+                if (calls) return false;
+                for (auto &s : specials) {
+                    if (*s == *reg) return false;
+                }
+                return true;
+            }
+            return !inner.count(reg.get()) || hoisted_defs.count(reg.get());
+        };
+        auto unaliased = [&](const MemoryLocation &location) {
+            switch (location.status) {
+                case MemoryLocation::Argument:
+                    // argument slots are only written through their own locations (see value_numbering())
+                    for (auto s : stores) {
+                        if (s->status == MemoryLocation::Argument && s->offset == location.offset) return false;
+                    }
+                    return true;
+                case MemoryLocation::Undetermined:
+                    if (calls || static_stores) return false;
+                    for (auto s : stores) {
+                        if (s == &location) return false;
+                    }
+                    return true;
+                default:
+                    return !calls && stores.empty();
+            }
+        };
+
+        // the header runs whenever the loop is entered; so does its code before the first branch
+        std::vector<std::shared_ptr<Instruction>> hoisted;
+        unordered_set<const Instruction *> moved;
+        for (auto progress = true; progress;) {
+            progress = false;
+            for (auto n : info.rpo) {
+                if (!in_loop[n]) continue;
+                auto prefix = n == h;
+                for (auto &i : blocks[n]->instructions) {
+                    if (i->branch() || i->has_delay_slot()) prefix = false;
+                    if (moved.count(i.get())) continue;
+                    auto def = i->def();
+                    std::vector<std::shared_ptr<VirtReg>> used;
+                    if (!def || def->allocated || defs[def.get()] != 1 || !invariant_operands(*i, used)) continue;
+                    if (may_trap(*i) && !prefix) continue;
+                    if ((i->opcode == Opcode::lw || i->opcode == Opcode::array_load) &&
+                        !unaliased(*static_cast<const Memory &>(*i).location)) {
+                        continue;
+                    }
+                    auto all = true;
+                    for (auto &reg : used) all &= invariant(reg);
+                    if (!all) continue;
+                    hoisted.push_back(i);
+                    moved.insert(i.get());
+                    hoisted_defs.insert(def.get());
+                    progress = true;
+                }
+            }
+        }
+        if (hoisted.empty()) continue;
+        for (size_t n = 0; n < blocks.size(); ++n) {
+            if (!in_loop[n]) continue;
+            auto &instr = blocks[n]->instructions;
+            instr.erase(std::remove_if(instr.begin(), instr.end(), [&](const std::shared_ptr<Instruction> &i) {
+                return moved.count(i.get()) != 0;
+            }), instr.end());
+        }
+
+        std::vector<size_t> outside;
+        for (auto p : info.predecessors[h]) {
+            if (!in_loop[p] && info.reachable(p)) outside.push_back(p);
+        }
+        // a single predecessor entering nothing but the loop serves as the preheader
+        if (outside.size() == 1 && info.successors[outside[0]].size() == 1) {
+            auto &instr = blocks[outside[0]]->instructions;
+            size_t branches = 0;
+            for (auto &i : instr) {
+                if (i->branch() || i->has_delay_slot()) branches++;
+            }
+            auto jumps = !instr.empty() && instr.back()->terminates() && instr.back()->branch() == header;
+            auto falls = outside[0] + 1 == h && (instr.empty() || !instr.back()->terminates());
+            if (branches == (jumps ? 1u : 0u) && (jumps || falls)) {
+                instr.insert(jumps ? instr.end() - 1 : instr.end(), hoisted.begin(), hoisted.end());
+                changed = true;
+                continue;
+            }
+        }
+
+        auto pre = std::make_shared<CFGNode>(this, next_name());
+        pre->instructions = hoisted;
+        size_t entered = 0;
+        pre->frequency = 1;
+        for (auto m : outside) {
+            auto &node = *blocks[m];
+            for (auto &i : node.instructions) {
+                if (i->branch() == header) i->retarget(pre);
+            }
+            for (size_t e = 0; e < node.out_edges.size(); ++e) {
+                if (node.out_edges[e].lock() != header) continue;
+                node.out_edges[e] = pre;
+                if (e < node.edge_counts.size()) entered += node.edge_counts[e];
+            }
+            pre->frequency = std::max(pre->frequency, node.frequency);
+        }
+        pre->add_edge(header);
+        if (profiled) pre->edge_counts.push_back(entered);
+        // a loop node falling into the header now has to jump over the preheader
+        if (h > 0 && in_loop[h - 1]) {
+            auto &instr = blocks[h - 1]->instructions;
+            if (instr.empty() || !instr.back()->terminates()) instr.push_back(std::make_shared<j>(header));
+        }
+        blocks.insert(blocks.begin() + h, pre);
+        invalidate_cfg();
+        changed = true;
+    }
+    if (changed) invalidate(Analysis::Liveness | Analysis::Interference);
+}
+
+/*!
+ * Check whether an instruction may run on a path it was not on: it only defines a virtual register, cannot trap
+ * and reads no memory but the stack frame.
+ * @param instr the instruction.
+ * @param used the registers read (accumulator), including a select's own target.
+ * @return check result.
+ */
+static bool speculable(const Instruction &instr, std::vector<std::shared_ptr<VirtReg>> &used) {
+    auto def = instr.def();
+    if (!def || def->allocated) return false;
+    if (instr.opcode == Opcode::movn || instr.opcode == Opcode::movz) {
+        auto &t = static_cast<const Ternary &>(instr);
+        used.insert(used.end(), {t.op0, t.op1, t.lhs});
+        return true;
+    }
+    if (instr.opcode == Opcode::lw) {
+        auto status = static_cast<const Memory &>(instr).location->status;
+        if (status != MemoryLocation::Argument && status != MemoryLocation::Undetermined) return false;
+    }
+    return invariant_operands(instr, used) && !may_trap(instr) && instr.opcode != Opcode::array_load;
+}
+
+/*!
+ * Compute a register that is non-zero exactly when a conditional branch is taken, or zero exactly when it is.
+ * @param branch the branch.
+ * @param code instruction accumulator.
+ * @param zero the $zero register.
+ * @param taken_if_set set to whether the branch is taken when the register is non-zero.
+ * @return the register; null if the instruction is not a conditional branch.
+ */
+static std::shared_ptr<VirtReg> condition(const Instruction &branch, std::vector<std::shared_ptr<Instruction>> &code,
+                                          const std::shared_ptr<VirtReg> &zero, bool &taken_if_set) {
+    auto c = VirtReg::create();
+    switch (branch.opcode) {
+        case Opcode::beqz:
+        case Opcode::bnez:
+            taken_if_set = branch.opcode == Opcode::bnez;
+            return static_cast<const ZeroBranch &>(branch).target;
+        case Opcode::bltz:
+        case Opcode::bgez:
+            code.push_back(std::make_shared<slt>(c, static_cast<const ZeroBranch &>(branch).target, zero));
+            taken_if_set = branch.opcode == Opcode::bltz;
+            return c;
+        case Opcode::bgtz:
+        case Opcode::blez:
+            code.push_back(std::make_shared<slt>(c, zero, static_cast<const ZeroBranch &>(branch).target));
+            taken_if_set = branch.opcode == Opcode::bgtz;
+            return c;
+        default:
+            break;
+    }
+    auto &cmp = static_cast<const Binary &>(branch);
+    switch (branch.opcode) {
+        case Opcode::beq:
+        case Opcode::bne:
+            code.push_back(std::make_shared<bxor>(c, cmp.lhs, cmp.rhs));
+            taken_if_set = branch.opcode == Opcode::bne;
+            return c;
+        case Opcode::blt:
+        case Opcode::bge:
+            code.push_back(std::make_shared<slt>(c, cmp.lhs, cmp.rhs));
+            taken_if_set = branch.opcode == Opcode::blt;
+            return c;
+        case Opcode::bgt:
+        case Opcode::ble:
+            code.push_back(std::make_shared<slt>(c, cmp.rhs, cmp.lhs));
+            taken_if_set = branch.opcode == Opcode::bgt;
+            return c;
+        default:
+            return nullptr;
+    }
+}
+
+// Arms may not store, call or trap. Each arm computes the registers also defined elsewhere into new ones,
+// selected by the branch condition once both arms have run. Only done if the condition, arms, copies and
+// selects take at most IF_CONVERSION_COST instructions. A join entered from nowhere else is merged into the
+// node, so nested conditionals collapse from the inside out.
+void Function::if_convert() {
+    auto zero = get_special(SpecialReg::zero);
+    auto changed = false;
+    for (auto progress = true; progress;) {
+        progress = false;
+        auto defs = count_definitions(*this);
+        auto &info = cfg();
+        // the node an arm continues to, or null if it has other instructions leaving it
+        auto exit_of = [&](size_t n) -> std::shared_ptr<CFGNode> {
+            auto &instr = blocks[n]->instructions;
+            for (size_t p = 0; p + 1 < instr.size(); ++p) {
+                if (instr[p]->branch() || instr[p]->has_delay_slot()) return nullptr;
+            }
+            if (!instr.empty() && instr.back()->opcode == Opcode::j) return instr.back()->branch();
+            if (!instr.empty() && (instr.back()->branch() || instr.back()->has_delay_slot())) return nullptr;
+            return n + 1 < blocks.size() ? blocks[n + 1] : nullptr;
+        };
+        auto is_arm = [&](size_t n, const std::shared_ptr<CFGNode> &join) {
+            return info.reachable(n) && info.predecessors[n].size() == 1 && exit_of(n) == join &&
+                   blocks[n]->out_edges.size() == 1 && blocks[n]->out_edges[0].lock() == join;
+        };
+        for (size_t a = 0; a < blocks.size() && !progress; ++a) {
+            auto node = blocks[a];
+            auto &head = node->instructions;
+            if (!info.reachable(a) || head.empty()) continue;
+            // the node ends with a conditional branch, either falling through or jumping to the other arm
+            auto jumps = head.back()->opcode == Opcode::j && head.size() >= 2;
+            auto branch = head[head.size() - (jumps ? 2 : 1)];
+            if (!branch->branch() || (!jumps && a + 1 == blocks.size())) continue;
+            std::vector<std::shared_ptr<Instruction>> code;
+            auto taken_if_set = false;
+            auto c = condition(*branch, code, zero, taken_if_set);
+            if (!c) continue;
+            auto target = branch->branch();
+            auto fall = jumps ? head.back()->branch() : blocks[a + 1];
+            auto t = info.index.find(target.get())->second, f = info.index.find(fall.get())->second;
+            // a diamond, or a triangle with one of the arms empty
+            std::shared_ptr<CFGNode> join;
+            std::vector<size_t> arms;
+            if (t != f && t != a && f != a) {
+                auto after = exit_of(f);
+                if (after == target && is_arm(f, target)) {
+                    join = target;
+                    arms = {f};
+                } else if (exit_of(t) == fall && is_arm(t, fall)) {
+                    join = fall;
+                    arms = {t};
+                } else if (after && after != node && is_arm(f, after) && is_arm(t, after)) {
+                    join = after;
+                    arms = {f, t};
+                }
+            }
+            if (!join) continue;
+
+            // the cost of the straight-line code: the condition, both arms, copies and selects
+            auto cost = code.size();
+            auto valid = true;
+            unordered_set<const VirtReg *> selected;
+            for (auto n : arms) {
+                unordered_set<const VirtReg *> renamed;
+                for (auto &i : blocks[n]->instructions) {
+                    if (i->opcode == Opcode::j || i->opcode == Opcode::phi) continue;
+                    std::vector<std::shared_ptr<VirtReg>> used;
+                    if (!speculable(*i, used)) {
+                        valid = false;
+                        break;
+                    }
+                    cost++;
+                    auto def = i->def();
+                    if (defs[def.get()] < 2 || !renamed.insert(def.get()).second) continue;
+                    // a select per register defined on both paths; a copy if the arm reads the old value first
+                    cost++;
+                    for (auto &reg : used) {
+                        if (*reg == *def) {
+                            cost++;
+                            break;
+                        }
+                    }
+                    selected.insert(def.get());
+                }
+            }
+            if (!c->allocated && selected.count(c.get())) cost++;
+            if (!valid || cost > IF_CONVERSION_COST) continue;
+
+            // the join is merged into the node if it is not entered otherwise
+            auto merge = join != blocks[0];
+            for (auto p : info.predecessors[info.index.find(join.get())->second]) {
+                merge &= p == a || std::find(arms.begin(), arms.end(), p) != arms.end();
+            }
+
+            // the arms compute into new registers, selected once both have run
+            if (!c->allocated && selected.count(c.get())) {
+                auto copy = VirtReg::create();
+                code.push_back(std::make_shared<move>(copy, c));
+                c = copy;
+            }
+            std::vector<std::shared_ptr<Instruction>> selects;
+            auto defined_in = [](const std::shared_ptr<CFGNode> &arm, const std::shared_ptr<VirtReg> &reg) {
+                for (auto &i : arm->instructions) {
+                    auto def = i->def();
+                    if (def && *def == *reg) return true;
+                }
+                return false;
+            };
+            for (auto n : arms) {
+                auto set = (blocks[n] == target) == taken_if_set;
+                unordered_map<const VirtReg *, std::shared_ptr<VirtReg>> renamed;
+                for (auto &i : blocks[n]->instructions) {
+                    if (i->opcode == Opcode::j) continue;
+                    if (i->opcode == Opcode::phi) {
+                        code.push_back(i);
+                        continue;
+                    }
+                    std::vector<std::shared_ptr<VirtReg>> used;
+                    speculable(*i, used);
+                    for (auto &reg : used) {
+                        auto r = renamed.find(reg.get());
+                        if (r != renamed.end()) i->replace(reg, r->second);
+                    }
+                    auto def = i->def();
+                    auto r = renamed.find(def.get());
+                    if (r != renamed.end()) i->replace(def, r->second);
+                    // a register defined once only exists on this path and may be computed on both
+                    if (defs[def.get()] > 1 && r == renamed.end()) {
+                        auto value = VirtReg::create();
+                        for (auto &reg : used) {
+                            if (*reg == *def) {
+                                code.push_back(std::make_shared<move>(value, def));
+                                break;
+                            }
+                        }
+                        i->replace(def, value);
+                        renamed[def.get()] = value;
+                        // a register defined in both arms is copied from the first one, the second one selects
+                        if (selected.count(def.get()) && n == arms[0] && arms.size() == 2 &&
+                            defined_in(blocks[arms[1]], def)) {
+                            selects.insert(selects.begin(), std::make_shared<move>(def, value));
+                        } else if (set) {
+                            selects.push_back(std::make_shared<movn>(def, value, c));
+                        } else {
+                            selects.push_back(std::make_shared<movz>(def, value, c));
+                        }
+                    }
+                    code.push_back(i);
+                }
+            }
+            head.resize(head.size() - (jumps ? 2 : 1));
+            head.insert(head.end(), code.begin(), code.end());
+            head.insert(head.end(), selects.begin(), selects.end());
+
+            // the node continues to the join instead of the arms
+            size_t entering = 0;
+            auto leaves = [&](const std::shared_ptr<CFGNode> &to) {
+                for (size_t e = 0; e < node->out_edges.size(); ++e) {
+                    if (node->out_edges[e].lock() != to) continue;
+                    node->out_edges.erase(node->out_edges.begin() + e);
+                    if (e < node->edge_counts.size()) {
+                        entering += node->edge_counts[e];
+                        node->edge_counts.erase(node->edge_counts.begin() + e);
+                    }
+                    return;
+                }
+            };
+            leaves(target);
+            leaves(fall);
+            std::vector<std::shared_ptr<CFGNode>> removed;
+            for (auto n : arms) removed.push_back(blocks[n]);
+            blocks.erase(std::remove_if(blocks.begin(), blocks.end(), [&](const std::shared_ptr<CFGNode> &n) {
+                return std::find(removed.begin(), removed.end(), n) != removed.end();
+            }), blocks.end());
+            a = std::find(blocks.begin(), blocks.end(), node) - blocks.begin();
+            if (merge) {
+                // the node takes over the code and the exits of the join
+                auto &instr = join->instructions;
+                size_t n = std::find(blocks.begin(), blocks.end(), join) - blocks.begin();
+                head.insert(head.end(), instr.begin(), instr.end());
+                node->out_edges.insert(node->out_edges.end(), join->out_edges.begin(), join->out_edges.end());
+                if (profiled) {
+                    node->edge_counts.insert(node->edge_counts.end(), join->edge_counts.begin(), join->edge_counts.end());
+                }
+                if ((instr.empty() || !instr.back()->terminates()) && n != a + 1) {
+                    if (n + 1 == blocks.size()) {
+                        head.push_back(return_jump());
+                    } else {
+                        head.push_back(std::make_shared<j>(blocks[n + 1]));
+                    }
+                }
+                blocks.erase(blocks.begin() + n);
+            } else {
+                node->out_edges.push_back(join);
+                if (profiled) node->edge_counts.push_back(entering);
+                if (a + 1 >= blocks.size() || blocks[a + 1] != join) head.push_back(std::make_shared<j>(join));
+            }
+            invalidate_cfg();
+            changed = progress = true;
+        }
+    }
+    if (changed) invalidate(Analysis::Liveness | Analysis::Interference);
+}
+
+/*!
+ * Copy an instruction that computes a value or accesses memory.
+ * @param instr the instruction.
+ * @return the copy; null for branches, calls and other instructions that cannot be copied.
+ */
+static std::shared_ptr<Instruction> clone(const Instruction &instr) {
+    std::shared_ptr<Instruction> copy;
+    switch (instr.opcode) {
+#define VMIPS_CLONE(S) case Opcode::S: copy = std::make_shared<vmips::S>(static_cast<const vmips::S &>(instr)); break;
+        VMIPS_CLONE(add) VMIPS_CLONE(addiu) VMIPS_CLONE(addi) VMIPS_CLONE(addu)
+        VMIPS_CLONE(clo) VMIPS_CLONE(clz) VMIPS_CLONE(li) VMIPS_CLONE(lui)
+        VMIPS_CLONE(move) VMIPS_CLONE(negu) VMIPS_CLONE(seb) VMIPS_CLONE(seh)
+        VMIPS_CLONE(sub) VMIPS_CLONE(subu) VMIPS_CLONE(lw) VMIPS_CLONE(sw)
+        VMIPS_CLONE(slt) VMIPS_CLONE(mul) VMIPS_CLONE(mflo) VMIPS_CLONE(mfhi)
+        VMIPS_CLONE(movn) VMIPS_CLONE(movz) VMIPS_CLONE(sllv) VMIPS_CLONE(srav)
+        VMIPS_CLONE(srlv) VMIPS_CLONE(sltu) VMIPS_CLONE(sltiu) VMIPS_CLONE(slti)
+        VMIPS_CLONE(andi) VMIPS_CLONE(xori) VMIPS_CLONE(bnot) VMIPS_CLONE(bor)
+        VMIPS_CLONE(bxor) VMIPS_CLONE(band) VMIPS_CLONE(sll) VMIPS_CLONE(srl)
+        VMIPS_CLONE(sra) VMIPS_CLONE(mult) VMIPS_CLONE(multu) VMIPS_CLONE(divu)
+        VMIPS_CLONE(div) VMIPS_CLONE(la) VMIPS_CLONE(address) VMIPS_CLONE(array_load)
+        VMIPS_CLONE(array_store)
+#undef VMIPS_CLONE
+        default:
+            return nullptr;
+    }
+    return copy;
+}
+
+// A counted loop is a node ending with a jump to itself, left only by a beq or beqz of a counter and a bound
+// not defined in the loop; the counter is advanced by addi/addiu of 1 or -1 after the test. A new node
+// running unroll_factor copies of the body without the exit test is entered instead, as long as at least
+// that many iterations remain; the original loop runs the rest. Registers living within an iteration are
+// renamed in every copy. Loops with calls, other branches or more than MAX_UNROLL_SIZE unrolled instructions
+// are kept.
+void Function::unroll_loops() {
+    auto defs = count_definitions(*this);
+    auto zero = get_special(SpecialReg::zero);
+    auto loops = blocks;
+    auto changed = false;
+    for (auto &loop : loops) {
+        auto &instr = loop->instructions;
+        if (instr.size() < 2 || instr.back()->opcode != Opcode::j || instr.back()->branch() != loop) continue;
+        if (instr.size() * unroll_factor > MAX_UNROLL_SIZE) continue;
+        // a single exit, comparing the counter with a bound
+        size_t exit = instr.size();
+        auto valid = true;
+        unordered_map<const VirtReg *, size_t> inner;
+        for (size_t p = 0; p + 1 < instr.size(); ++p) {
+            auto def = instr[p]->def();
+            if (def) inner[def.get()]++;
+            if (instr[p]->opcode == Opcode::phi) continue;
+            if (instr[p]->opcode == Opcode::beq || instr[p]->opcode == Opcode::beqz) {
+                valid &= exit == instr.size() && instr[p]->branch() != loop;
+                exit = p;
+            } else {
+                valid &= instr[p]->opcode != Opcode::callfunc && clone(*instr[p]) != nullptr;
+            }
+        }
+        if (!valid || exit == instr.size()) continue;
+        std::shared_ptr<VirtReg> x, y;
+        if (instr[exit]->opcode == Opcode::beqz) {
+            x = static_cast<const ZeroBranch &>(*instr[exit]).target;
+            y = zero;
+        } else {
+            x = static_cast<const Binary &>(*instr[exit]).lhs;
+            y = static_cast<const Binary &>(*instr[exit]).rhs;
+        }
+        auto invariant = [&](const std::shared_ptr<VirtReg> &reg) {
+            for (size_t p = 0; p + 1 < instr.size(); ++p) {
+                auto def = instr[p]->def();
+                if (def && *def == *reg) return false;
+            }
+            return true;
+        };
+        // the counter advances by one after the exit test, exactly once per iteration
+        ssize_t step = 0;
+        std::shared_ptr<VirtReg> counter, bound;
+        for (size_t p = exit + 1; p + 1 < instr.size(); ++p) {
+            if (instr[p]->opcode != Opcode::addi && instr[p]->opcode != Opcode::addiu) continue;
+            auto &advance = static_cast<const BinaryImm &>(*instr[p]);
+            if (!(*advance.lhs == *advance.rhs) || advance.lhs->allocated || inner[advance.lhs.get()] != 1 ||
+                (advance.imm != 1 && advance.imm != -1)) {
+                continue;
+            }
+            if (*advance.lhs == *x && invariant(y)) {
+                counter = x;
+                bound = y;
+            } else if (*advance.lhs == *y && invariant(x)) {
+                counter = y;
+                bound = x;
+            } else {
+                continue;
+            }
+            step = advance.imm;
+            break;
+        }
+        if (!counter) continue;
+
+        // registers only living within an iteration get new ones in every copy
+        unordered_set<const VirtReg *> outside;
+        for (auto &node : blocks) {
+            if (node == loop) continue;
+            unordered_set<std::shared_ptr<VirtReg>> used;
+            for (auto &i : node->instructions) i->collect_register(used);
+            for (auto &reg : used) outside.insert(reg.get());
+        }
+        std::vector<std::shared_ptr<VirtReg>> local;
+        for (size_t p = 0; p + 1 < instr.size(); ++p) {
+            auto def = instr[p]->def();
+            if (!def || def->allocated || defs[def.get()] != 1 || outside.count(def.get())) continue;
+            auto early = false;
+            for (size_t q = 0; q < p; ++q) early |= instr[q]->used_register(def);
+            if (!early) local.push_back(def);
+        }
+
+        // the unrolled loop runs while at least factor iterations remain, the original loop runs the rest
+        auto unrolled = std::make_shared<CFGNode>(this, next_name());
+        auto &code = unrolled->instructions;
+        auto remaining = counter, few = VirtReg::create();
+        if (!(*bound == *zero) || step > 0) {
+            remaining = VirtReg::create();
+            if (step > 0) code.push_back(std::make_shared<subu>(remaining, bound, counter));
+            else code.push_back(std::make_shared<subu>(remaining, counter, bound));
+        }
+        code.push_back(std::make_shared<slti>(few, remaining, (ssize_t) unroll_factor));
+        code.push_back(std::make_shared<bnez>(loop, few));
+        for (size_t k = 0; k < unroll_factor; ++k) {
+            std::vector<std::shared_ptr<VirtReg>> renamed;
+            for (size_t r = 0; r < local.size(); ++r) renamed.push_back(VirtReg::create());
+            for (size_t p = 0; p + 1 < instr.size(); ++p) {
+                if (p == exit || instr[p]->opcode == Opcode::phi) continue;
+                auto copy = clone(*instr[p]);
+                for (size_t r = 0; r < local.size(); ++r) copy->replace(local[r], renamed[r]);
+                code.push_back(copy);
+            }
+        }
+        code.push_back(std::make_shared<j>(unrolled));
+        unrolled->add_edge(loop);
+        unrolled->add_edge(unrolled);
+        unrolled->frequency = loop->frequency;
+
+        // enter the unrolled loop instead of the original one
+        auto &info = cfg();
+        auto index = info.index.find(loop.get())->second;
+        size_t entering = 0;
+        for (auto m : info.predecessors[index]) {
+            if (m == index) continue;
+            auto &node = *blocks[m];
+            for (auto &i : node.instructions) {
+                if (i->branch() == loop) i->retarget(unrolled);
+            }
+            for (size_t e = 0; e < node.out_edges.size(); ++e) {
+                if (node.out_edges[e].lock() != loop) continue;
+                node.out_edges[e] = unrolled;
+                if (e < node.edge_counts.size()) entering += node.edge_counts[e];
+            }
+        }
+        if (profiled) {
+            // the original loop still runs the last few iterations of every entry
+            size_t iterations = 0;
+            for (size_t e = 0; e < loop->out_edges.size(); ++e) {
+                if (loop->out_edges[e].lock() == loop && e < loop->edge_counts.size()) iterations = loop->edge_counts[e];
+            }
+            unrolled->edge_counts = {entering, iterations / unroll_factor};
+        }
+        blocks.insert(std::find(blocks.begin(), blocks.end(), loop), unrolled);
+        invalidate_cfg();
+        changed = true;
+    }
+    if (changed) invalidate(Analysis::Liveness | Analysis::Interference);
+}
+
+// A call followed only by the return of its result (or by the return of nothing) is a tail call. A tail call
+// of the function itself copies the arguments into $a0-$a3 and the argument slots, then jumps back to the
+// entry, whose code follows the prologue. Other tail calls reuse the incoming argument slots, so only callees
+// of the module with at most as many arguments as the function qualify; only the remaining calls need $ra
+// saved.
+void Function::eliminate_tail_calls() {
+    // the frame is reused or torn down, so the stack slots must not be addressed
+    std::vector<bool> loaded;
+    for (auto &node : blocks) {
+        for (auto &i : node->instructions) {
+            if (i->opcode == Opcode::address) return;
+            if (i->opcode != Opcode::lw) continue;
+            auto &location = *static_cast<const Memory &>(*i).location;
+            if (location.status != MemoryLocation::Argument) continue;
+            if (location.offset >= loaded.size()) loaded.resize(location.offset + 1, false);
+            loaded[location.offset] = true;
+        }
+    }
+    auto v0 = get_special(SpecialReg::v0);
+    auto changed = false;
+    for (size_t n = 0; n < blocks.size(); ++n) {
+        auto node = blocks[n];
+        auto &instr = node->instructions;
+        // the node returns by the epilogue jump or by falling off the end of the function
+        auto end = instr.size();
+        if (end > 0 && is_return_jump(*instr.back())) {
+            --end;
+        } else if (n + 1 < blocks.size()) {
+            continue;
+        }
+        if (end == 0) continue;
+        auto p = end - 1;
+        std::shared_ptr<VirtReg> result = nullptr;
+        if (instr[p]->opcode == Opcode::move && *instr[p]->def() == *v0 && p > 0) {
+            result = static_cast<const Binary &>(*instr[p]).rhs;
+            --p;
+        }
+        if (instr[p]->opcode != Opcode::callfunc) continue;
+        auto call = std::static_pointer_cast<callfunc>(instr[p]);
+        if (result && (!call->ret || !(*call->ret == *result))) continue;
+        auto callee = call->function.lock();
+
+        if (callee.get() == this) {
+            // copy first: the arguments may read the registers being assigned
+            std::vector<std::shared_ptr<Instruction>> code;
+            std::vector<std::shared_ptr<VirtReg>> copies;
+            for (auto &arg : call->call_with) {
+                copies.push_back(VirtReg::create());
+                code.push_back(std::make_shared<move>(copies.back(), arg));
+            }
+            for (size_t k = 0; k < copies.size(); ++k) {
+                if (k < 4) {
+                    auto special = (SpecialReg) ((size_t) SpecialReg::a0 + k);
+                    code.push_back(std::make_shared<move>(get_special(special), copies[k]));
+                }
+                if (k >= 4 || (k < loaded.size() && loaded[k])) {
+                    code.push_back(std::make_shared<sw>(copies[k], argument(k)));
+                }
+            }
+            code.push_back(std::make_shared<j>(blocks[0]));
+            instr.erase(instr.begin() + p, instr.end());
+            instr.insert(instr.end(), code.begin(), code.end());
+            if (profiled) {
+                auto &info = cfg();
+                size_t entering = 0;
+                for (auto m : info.predecessors[n]) {
+                    auto &pred = *blocks[m];
+                    for (size_t e = 0; e < pred.out_edges.size(); ++e) {
+                        if (pred.out_edges[e].lock() == node && e < pred.edge_counts.size()) {
+                            entering += pred.edge_counts[e];
+                        }
+                    }
+                }
+                node->edge_counts.resize(node->out_edges.size(), 0);
+                node->edge_counts.push_back(entering);
+            }
+            node->add_edge(blocks[0]);
+            changed = true;
+        } else if (!callee->blocks.empty() && callee->argc <= argc && call->call_with.size() <= argc) {
+            // externs are only entered by jal; other callees must fit in the incoming argument slots
+            // the callee leaves $v0 to the caller
+            call->tail = true;
+            call->ret = nullptr;
+            if (result) instr.erase(instr.begin() + p + 1);
+            changed = true;
+        }
+    }
+    if (!changed) return;
+    // only the calls returning here need $ra saved and an outgoing argument area
+    has_sub = false;
+    sub_argc = 0;
+    for (auto &node : blocks) {
+        for (auto &i : node->instructions) {
+            if (i->opcode != Opcode::callfunc) continue;
+            auto &call = static_cast<const callfunc &>(*i);
+            if (call.tail) continue;
+            has_sub = true;
+            sub_argc = std::max(sub_argc, call.function.lock()->argc);
+        }
+    }
+    invalidate(Analysis::Liveness | Analysis::Interference);
+}
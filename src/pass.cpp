@@ -0,0 +1,135 @@
+//
+// Pass manager of the Virtual MIPS IR.
+//
+
+#include <vcfg/pass.h>
+#include <vcfg/virtual_mips.h>
+
+using namespace vmips;
+
+std::vector<FunctionPass>::iterator PassManager::find(const std::string &name) {
+    return std::find_if(passes.begin(), passes.end(), [&](const FunctionPass &pass) { return pass.name == name; });
+}
+
+void PassManager::add(FunctionPass pass) {
+    passes.push_back(std::move(pass));
+}
+
+bool PassManager::add_before(const std::string &name, FunctionPass pass) {
+    auto position = find(name);
+    if (position == passes.end()) return false;
+    passes.insert(position, std::move(pass));
+    return true;
+}
+
+bool PassManager::add_after(const std::string &name, FunctionPass pass) {
+    auto position = find(name);
+    if (position == passes.end()) return false;
+    passes.insert(position + 1, std::move(pass));
+    return true;
+}
+
+bool PassManager::remove(const std::string &name) {
+    auto position = find(name);
+    if (position == passes.end()) return false;
+    passes.erase(position);
+    return true;
+}
+
+std::vector<std::string> PassManager::names() const {
+    std::vector<std::string> result;
+    for (auto &i : passes) {
+        result.push_back(i.name);
+    }
+    return result;
+}
+
+void PassManager::run(Function &function) {
+    function.statistics.phase_times.clear();
+    for (auto &pass : passes) {
+        function.ensure(pass.required);
+        auto &stats = statistics[pass.name];
+        stats.runs++;
+        stats.instructions_before += function.instruction_count();
+        auto start = std::chrono::steady_clock::now();
+        pass.run(function);
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        stats.time += elapsed;
+        function.statistics.phase_times.emplace_back(pass.name, elapsed);
+        stats.instructions_after += function.instruction_count();
+        function.invalidate(Analysis::All & ~pass.preserved);
+    }
+}
+
+void PassManager::run(Module &module) {
+    for (auto &i : module.bottom_up_order()) {
+        run(*i);
+    }
+}
+
+PassStatistics PassManager::statistics_of(const std::string &name) const {
+    auto stats = statistics.find(name);
+    return stats == statistics.end() ? PassStatistics{} : stats->second;
+}
+
+void PassManager::report(std::ostream &out) const {
+    for (auto &i : passes) {
+        auto stats = statistics_of(i.name);
+        out << i.name << ": runs " << stats.runs
+            << ", time " << std::chrono::duration_cast<std::chrono::microseconds>(stats.time).count() << "us"
+            << ", instructions " << stats.instructions_before << " -> " << stats.instructions_after << std::endl;
+    }
+}
+
+PassManager PassManager::standard() {
+    PassManager manager;
+    manager.add({"tail-calls", [](Function &f) {
+        if (f.optimize) f.eliminate_tail_calls();
+    }});
+    manager.add({"constant-propagation", [](Function &f) {
+        if (f.optimize) f.propagate_constants();
+    }});
+    manager.add({"if-conversion", [](Function &f) {
+        if (f.optimize) f.if_convert();
+    }});
+    manager.add({"strength-reduction", [](Function &f) {
+        if (f.optimize) f.reduce_strength();
+    }, Analysis::None, Analysis::CFG});
+    manager.add({"induction-variables", [](Function &f) {
+        if (f.optimize) f.reduce_induction_variables();
+    }, Analysis::None, Analysis::CFG});
+    manager.add({"loop-invariant-motion", [](Function &f) {
+        if (f.optimize) f.hoist_invariants();
+    }});
+    manager.add({"loop-unrolling", [](Function &f) {
+        if (f.unroll_factor > 1) f.unroll_loops();
+    }});
+    manager.add({"value-numbering", [](Function &f) {
+        if (f.optimize) f.value_numbering();
+    }, Analysis::None, Analysis::CFG});
+    manager.add({"dead-code", [](Function &f) {
+        if (f.optimize) f.eliminate_dead_code();
+    }});
+    manager.add({"layout", [](Function &f) {
+        if (f.reorder_blocks) f.layout();
+    }});
+    manager.add({"schedule-before-allocation", [](Function &f) {
+        if (f.scheduling == Scheduling::BeforeAllocation) f.schedule();
+    }, Analysis::None, Analysis::CFG});
+    manager.add({"color", [](Function &f) {
+        f.color();
+    }, Analysis::None, Analysis::All});
+    manager.add({"scan-overlap", [](Function &f) {
+        f.scan_overlap();
+    }, Analysis::Liveness, Analysis::All});
+    manager.add({"alloca", [](Function &f) {
+        f.handle_alloca();
+    }, Analysis::None, Analysis::All});
+    manager.add({"schedule-after-allocation", [](Function &f) {
+        if (f.scheduling == Scheduling::AfterAllocation) f.schedule();
+    }, Analysis::None, Analysis::CFG});
+    manager.add({"fill-delay-slots", [](Function &f) {
+        if (f.noreorder) f.fill_delay_slots();
+    }, Analysis::None, Analysis::CFG});
+    return manager;
+}
@@ -0,0 +1,241 @@
+//
+// Edge profiling of the Virtual MIPS IR.
+//
+
+#include <vcfg/virtual_mips.h>
+#include <numeric>
+
+using namespace vmips;
+
+/*!
+ * The ProfileEdge struct. An edge of the flow graph of a function: a CFG edge, an exit into the epilogue or
+ * the edge from the epilogue back to the entry, which stands for the calls of the function.
+ */
+struct ProfileEdge {
+    /*!
+     * Source and target node index; Function::blocks.size() is the epilogue.
+     */
+    size_t from, to;
+    /*!
+     * Position in the out edges of the source; CFGInfo::NONE for exits and calls.
+     */
+    size_t out_edge;
+    /*!
+     * Instruction the edge leaves from; the instruction count of the source for a fall-through.
+     */
+    size_t position;
+    /*!
+     * Estimated frequency.
+     */
+    size_t weight;
+    /*!
+     * Counter of the edge; CFGInfo::NONE for the spanning tree edges.
+     */
+    size_t counter;
+};
+
+/*!
+ * Build the flow graph of a function and choose the counted edges. The edges of a maximum spanning tree of the
+ * estimated frequencies are not counted: starting from the leaves, flow conservation gives their counts.
+ * The calls edge is always part of the tree.
+ * @param f the function.
+ * @param counters number of counters allocated so far (accumulator).
+ * @return the edges, the calls edge first.
+ */
+static std::vector<ProfileEdge> plan(Function &f, size_t &counters) {
+    f.estimate_frequency();
+    auto &info = f.cfg();
+    auto size = f.blocks.size();
+    std::vector<ProfileEdge> edges;
+    edges.push_back({size, 0, CFGInfo::NONE, 0, 0, CFGInfo::NONE});
+    for (size_t u = 0; u < size; ++u) {
+        auto &node = *f.blocks[u];
+        auto &instr = node.instructions;
+        std::vector<bool> matched(node.out_edges.size(), false);
+        for (size_t p = 0; p < instr.size(); ++p) {
+            if (f.is_return_jump(*instr[p])) {
+                edges.push_back({u, size, CFGInfo::NONE, p, node.frequency, CFGInfo::NONE});
+                continue;
+            }
+            auto target = instr[p]->branch();
+            if (!target) continue;
+            for (size_t k = 0; k < node.out_edges.size(); ++k) {
+                if (matched[k] || node.out_edges[k].lock() != target) continue;
+                auto v = info.index.find(target.get())->second;
+                matched[k] = true;
+                edges.push_back({u, v, k, p, std::min(node.frequency, target->frequency), CFGInfo::NONE});
+                break;
+            }
+        }
+        if (!instr.empty() && instr.back()->terminates()) continue;
+        if (u + 1 == size) {
+            edges.push_back({u, size, CFGInfo::NONE, instr.size(), node.frequency, CFGInfo::NONE});
+            continue;
+        }
+        // edges matching neither a branch nor the fall-through are never taken
+        for (size_t k = 0; k < node.out_edges.size(); ++k) {
+            if (matched[k] || node.out_edges[k].lock() != f.blocks[u + 1]) continue;
+            auto weight = std::min(node.frequency, f.blocks[u + 1]->frequency);
+            edges.push_back({u, u + 1, k, instr.size(), weight, CFGInfo::NONE});
+            break;
+        }
+    }
+
+    std::vector<size_t> parent(size + 1);
+    std::iota(parent.begin(), parent.end(), 0);
+    auto find = [&](size_t x) {
+        while (parent[x] != x) x = parent[x] = parent[parent[x]];
+        return x;
+    };
+    parent[size] = 0;
+    std::vector<size_t> order(edges.size() - 1);
+    std::iota(order.begin(), order.end(), 1);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return edges[a].weight > edges[b].weight;
+    });
+    for (auto i : order) {
+        auto a = find(edges[i].from), b = find(edges[i].to);
+        if (a != b) {
+            parent[a] = b;
+        } else {
+            edges[i].counter = counters++;
+        }
+    }
+    return edges;
+}
+
+/*!
+ * Generate the increment of a counter.
+ * @param f the function.
+ * @param code instruction accumulator.
+ * @param counters the counter array.
+ * @param counter counter index.
+ */
+static void increment(Function &f, std::vector<std::shared_ptr<Instruction>> &code,
+                      const std::shared_ptr<Data> &counters, size_t counter) {
+    auto base = VirtReg::create();
+    code.push_back(std::make_shared<la>(base, counters));
+    size_t offset = counter * 4;
+    if (offset > INT16_MAX) {
+        auto shift = VirtReg::create(), moved = VirtReg::create();
+        code.push_back(std::make_shared<li>(shift, offset));
+        code.push_back(std::make_shared<addu>(moved, base, shift));
+        base = moved;
+        offset = 0;
+    }
+    auto value = VirtReg::create(), next = VirtReg::create();
+    auto location = f.new_static_mem(4, base, offset);
+    code.push_back(std::make_shared<lw>(value, location));
+    code.push_back(std::make_shared<addiu>(next, value, 1));
+    code.push_back(std::make_shared<sw>(next, location));
+}
+
+size_t Module::instrument() {
+    VMIPS_TRACE_SCOPE("instrument", name);
+    size_t counters = 0;
+    std::vector<std::vector<ProfileEdge>> plans;
+    for (auto &f : functions) {
+        plans.push_back(plan(*f, counters));
+    }
+    edge_counters = create_data<word>(false, std::max(counters, (size_t) 1), 0);
+    for (size_t i = 0; i < functions.size(); ++i) {
+        auto &f = *functions[i];
+        auto &edges = plans[i];
+        std::vector<std::shared_ptr<CFGNode>> splits;
+        // later positions first, so that the insertions keep the earlier positions valid
+        std::stable_sort(edges.begin(), edges.end(), [](const ProfileEdge &a, const ProfileEdge &b) {
+            return a.position > b.position;
+        });
+        for (auto &e : edges) {
+            if (e.counter == CFGInfo::NONE) continue;
+            auto node = f.blocks[e.from];
+            auto &instr = node->instructions;
+            auto jump = e.position < instr.size() ? instr[e.position] : nullptr;
+            if (jump && jump->branch() && jump->opcode != Opcode::j && jump->opcode != Opcode::b) {
+                // a conditional branch is redirected to a new node counting the edge
+                auto target = jump->branch();
+                auto split = std::make_shared<CFGNode>(&f, f.next_name());
+                increment(f, split->instructions, edge_counters, e.counter);
+                split->instructions.push_back(std::make_shared<vmips::j>(target));
+                split->add_edge(target);
+                jump->retarget(split);
+                node->out_edges[e.out_edge] = split;
+                splits.push_back(split);
+            } else {
+                std::vector<std::shared_ptr<Instruction>> code;
+                increment(f, code, edge_counters, e.counter);
+                instr.insert(instr.begin() + e.position, code.begin(), code.end());
+            }
+        }
+        if (splits.empty()) continue;
+        auto &last = f.blocks.back()->instructions;
+        if (last.empty() || !last.back()->terminates()) {
+            f.blocks.back()->instructions.push_back(f.return_jump());
+        }
+        f.blocks.insert(f.blocks.end(), splits.begin(), splits.end());
+        f.invalidate_cfg();
+    }
+    return counters;
+}
+
+bool Module::attach_profile(const std::vector<int32_t> &counters) {
+    size_t total = 0;
+    std::vector<std::vector<ProfileEdge>> plans;
+    for (auto &f : functions) {
+        plans.push_back(plan(*f, total));
+    }
+    if (counters.size() < total) return false;
+    for (size_t i = 0; i < functions.size(); ++i) {
+        auto &f = *functions[i];
+        auto &edges = plans[i];
+        auto size = f.blocks.size();
+        std::vector<int64_t> count(edges.size(), 0);
+        std::vector<bool> known(edges.size(), false);
+        std::vector<std::vector<size_t>> incident(size + 1);
+        for (size_t e = 0; e < edges.size(); ++e) {
+            if (edges[e].counter != CFGInfo::NONE) {
+                count[e] = (uint32_t) counters[edges[e].counter];
+                known[e] = true;
+            }
+            // a self loop enters and leaves its node, so it never changes the balance
+            if (edges[e].from == edges[e].to) continue;
+            incident[edges[e].from].push_back(e);
+            incident[edges[e].to].push_back(e);
+        }
+        // flow conservation: a node with a single unknown edge determines it
+        for (auto changed = true; changed;) {
+            changed = false;
+            for (size_t x = 0; x <= size; ++x) {
+                size_t unknown = CFGInfo::NONE, missing = 0;
+                int64_t balance = 0;
+                for (auto e : incident[x]) {
+                    if (!known[e]) {
+                        unknown = e;
+                        missing++;
+                    } else {
+                        balance += edges[e].to == x ? count[e] : -count[e];
+                    }
+                }
+                if (missing != 1) continue;
+                count[unknown] = std::max<int64_t>(edges[unknown].to == x ? -balance : balance, 0);
+                known[unknown] = true;
+                changed = true;
+            }
+        }
+        auto calls = (size_t) count[0];
+        if (!calls) continue;
+        std::vector<size_t> runs(size, 0);
+        for (auto &node : f.blocks) {
+            node->edge_counts.assign(node->out_edges.size(), 0);
+        }
+        for (size_t e = 1; e < edges.size(); ++e) {
+            runs[edges[e].from] += count[e];
+            if (edges[e].out_edge != CFGInfo::NONE) f.blocks[edges[e].from]->edge_counts[edges[e].out_edge] = count[e];
+        }
+        for (size_t n = 0; n < size; ++n) {
+            f.blocks[n]->frequency = runs[n] ? std::max((runs[n] + calls / 2) / calls, (size_t) 1) : 0;
+        }
+        f.profiled = true;
+    }
+    return true;
+}
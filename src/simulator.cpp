@@ -0,0 +1,1139 @@
+//
+// MIPS32el Simulator.
+//
+
+#include <vsim/simulator.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+using namespace vsim;
+
+#define HI 32
+#define LO 33
+#define SINK 34  // destination of writes to $zero
+#define NONE 35  // unused operand, always ready
+
+/*
+ * Operations: X(Name, Form, "mnemonic"). Pseudo instructions are executed as a single operation and their
+ * expansion is only reflected in the cycle estimation.
+ */
+#define VSIM_OPERATIONS(X)             \
+    X(add, Ternary, "add")             \
+    X(addu, Ternary, "addu")           \
+    X(sub, Ternary, "sub")             \
+    X(subu, Ternary, "subu")           \
+    X(band, Ternary, "and")            \
+    X(bor, Ternary, "or")              \
+    X(bxor, Ternary, "xor")            \
+    X(nor, Ternary, "nor")             \
+    X(slt, Ternary, "slt")             \
+    X(sltu, Ternary, "sltu")           \
+    X(mul, Ternary, "mul")             \
+    X(sllv, Ternary, "sllv")           \
+    X(srlv, Ternary, "srlv")           \
+    X(srav, Ternary, "srav")           \
+    X(movn, Ternary, "movn")           \
+    X(movz, Ternary, "movz")           \
+    X(addi, BinaryImm, "addi")         \
+    X(addiu, BinaryImm, "addiu")       \
+    X(slti, BinaryImm, "slti")         \
+    X(sltiu, BinaryImm, "sltiu")       \
+    X(andi, LogicImm, "andi")          \
+    X(ori, LogicImm, "ori")            \
+    X(xori, LogicImm, "xori")          \
+    X(sll, Shift, "sll")               \
+    X(srl, Shift, "srl")               \
+    X(sra, Shift, "sra")               \
+    X(move, Binary, "move")            \
+    X(neg, Binary, "neg")              \
+    X(negu, Binary, "negu")            \
+    X(bnot, Binary, "not")             \
+    X(clo, Binary, "clo")              \
+    X(clz, Binary, "clz")              \
+    X(seb, Binary, "seb")              \
+    X(seh, Binary, "seh")              \
+    X(li, UnaryImm, "li")              \
+    X(lui, UnaryImm, "lui")            \
+    X(la, Address, "la")               \
+    X(mult, HiLo, "mult")              \
+    X(multu, HiLo, "multu")            \
+    X(div, HiLo, "div")                \
+    X(divu, HiLo, "divu")              \
+    X(mfhi, MoveFrom, "mfhi")          \
+    X(mflo, MoveFrom, "mflo")          \
+    X(mthi, MoveTo, "mthi")            \
+    X(mtlo, MoveTo, "mtlo")            \
+    X(lw, Load, "lw")                  \
+    X(lh, Load, "lh")                  \
+    X(lhu, Load, "lhu")                \
+    X(lb, Load, "lb")                  \
+    X(lbu, Load, "lbu")                \
+    X(sw, Store, "sw")                 \
+    X(sh, Store, "sh")                 \
+    X(sb, Store, "sb")                 \
+    X(b, Jump, "b")                    \
+    X(j, Jump, "j")                    \
+    X(jal, Call, "jal")                \
+    X(jr, JumpRegister, "jr")          \
+    X(jalr, CallRegister, "jalr")      \
+    X(beq, CmpBranch, "beq")           \
+    X(bne, CmpBranch, "bne")           \
+    X(blt, CmpBranch, "blt")           \
+    X(ble, CmpBranch, "ble")           \
+    X(bgt, CmpBranch, "bgt")           \
+    X(bge, CmpBranch, "bge")           \
+    X(bltu, CmpBranch, "bltu")         \
+    X(bleu, CmpBranch, "bleu")         \
+    X(bgtu, CmpBranch, "bgtu")         \
+    X(bgeu, CmpBranch, "bgeu")         \
+    X(beqz, ZeroBranch, "beqz")        \
+    X(bnez, ZeroBranch, "bnez")        \
+    X(blez, ZeroBranch, "blez")        \
+    X(bgtz, ZeroBranch, "bgtz")        \
+    X(bltz, ZeroBranch, "bltz")        \
+    X(bgez, ZeroBranch, "bgez")        \
+    X(nop, Nullary, "nop")             \
+    X(syscall, Nullary, "syscall")     \
+    X(external, Internal, "")          \
+    X(halt, Internal, "")
+
+namespace {
+    enum class Op : uint8_t {
+#define VSIM_OP(S, F, N) S,
+        VSIM_OPERATIONS(VSIM_OP)
+#undef VSIM_OP
+    };
+
+    /*!
+     * Operand layout of the assembly form of an operation.
+     */
+    enum class Form {
+        Ternary,      /**< rd, rs, rt */
+        BinaryImm,    /**< rt, rs, signed immediate */
+        LogicImm,     /**< rt, rs, unsigned immediate */
+        Shift,        /**< rd, rt, shift amount */
+        Binary,       /**< rd, rs */
+        UnaryImm,     /**< rt, immediate */
+        Address,      /**< rt, label */
+        HiLo,         /**< rs, rt */
+        MoveFrom,     /**< rd */
+        MoveTo,       /**< rs */
+        Load,         /**< rt, offset(base) */
+        Store,        /**< rt, offset(base) */
+        Jump,         /**< label */
+        Call,         /**< label */
+        JumpRegister, /**< rs */
+        CallRegister, /**< [rd,] rs */
+        CmpBranch,    /**< rs, rt, label */
+        ZeroBranch,   /**< rs, label */
+        Nullary,      /**< no operand */
+        Internal      /**< not available in assembly */
+    };
+
+    struct Mnemonic {
+        Op op;
+        Form form;
+    };
+
+    const phmap::flat_hash_map<std::string, Mnemonic> &mnemonics() {
+        static const phmap::flat_hash_map<std::string, Mnemonic> table = [] {
+            phmap::flat_hash_map<std::string, Mnemonic> result;
+#define VSIM_MNEMONIC(S, F, N) if (Form::F != Form::Internal) result[N] = {Op::S, Form::F};
+            VSIM_OPERATIONS(VSIM_MNEMONIC)
+#undef VSIM_MNEMONIC
+            return result;
+        }();
+        return table;
+    }
+
+    const char *const REGISTER_NAMES[32] = {
+            "zero", "at", "v0", "v1", "a0", "a1", "a2", "a3",
+            "t0", "t1", "t2", "t3", "t4", "t5", "t6", "t7",
+            "s0", "s1", "s2", "s3", "s4", "s5", "s6", "s7",
+            "t8", "t9", "k0", "k1", "gp", "sp", "s8", "ra"
+    };
+
+    inline bool fits_signed16(int64_t x) {
+        return x >= -32768 && x <= 32767;
+    }
+
+    inline bool fits_unsigned16(int64_t x) {
+        return x >= 0 && x <= 65535;
+    }
+
+    /*!
+     * Number of machine instructions needed to load a constant.
+     * @param x the constant.
+     * @return 1 (addiu, ori or lui) or 2 (lui and ori).
+     */
+    inline uint8_t constant_cost(int64_t x) {
+        return fits_signed16(x) || fits_unsigned16(x) || (x & 0xffff) == 0 ? 1 : 2;
+    }
+
+    inline int32_t leading_zeros(uint32_t x) {
+        int32_t n = 0;
+        for (uint32_t bit = 0x80000000u; bit && !(x & bit); bit >>= 1) ++n;
+        return n;
+    }
+
+    inline std::string trim(const std::string &s) {
+        auto begin = s.find_first_not_of(" \t\r");
+        if (begin == std::string::npos) return {};
+        auto end = s.find_last_not_of(" \t\r");
+        return s.substr(begin, end - begin + 1);
+    }
+
+    /*!
+     * Remove a trailing comment, ignoring '#' inside quotes.
+     */
+    std::string strip_comment(const std::string &line) {
+        char quote = 0;
+        for (size_t i = 0; i < line.size(); ++i) {
+            auto ch = line[i];
+            if (quote) {
+                if (ch == '\\') ++i;
+                else if (ch == quote) quote = 0;
+            } else if (ch == '"' || ch == '\'') {
+                quote = ch;
+            } else if (ch == '#') {
+                return line.substr(0, i);
+            }
+        }
+        return line;
+    }
+
+    /*!
+     * Split operands by commas outside of quotes.
+     */
+    std::vector<std::string> split_operands(const std::string &s) {
+        std::vector<std::string> result;
+        std::string current;
+        char quote = 0;
+        for (size_t i = 0; i < s.size(); ++i) {
+            auto ch = s[i];
+            if (quote) {
+                if (ch == '\\' && i + 1 < s.size()) {
+                    current.push_back(ch);
+                    ch = s[++i];
+                } else if (ch == quote) {
+                    quote = 0;
+                }
+            } else if (ch == '"' || ch == '\'') {
+                quote = ch;
+            } else if (ch == ',') {
+                result.push_back(trim(current));
+                current.clear();
+                continue;
+            }
+            current.push_back(ch);
+        }
+        current = trim(current);
+        if (!current.empty() || !result.empty()) result.push_back(current);
+        return result;
+    }
+
+    bool parse_integer(const std::string &s, int64_t &value) {
+        if (s.empty()) return false;
+        char *end = nullptr;
+        value = std::strtoll(s.c_str(), &end, 0);
+        return *end == 0 && value >= INT32_MIN && value <= UINT32_MAX;
+    }
+
+    bool parse_register(const std::string &s, uint8_t &reg) {
+        if (s.size() < 2 || s[0] != '$') return false;
+        auto name = s.substr(1);
+        for (uint8_t i = 0; i < 32; ++i) {
+            if (name == REGISTER_NAMES[i]) {
+                reg = i;
+                return true;
+            }
+        }
+        if (name == "fp") {
+            reg = 30;
+            return true;
+        }
+        int64_t number;
+        if (std::isdigit(name[0]) && parse_integer(name, number) && number < 32) {
+            reg = number;
+            return true;
+        }
+        return false;
+    }
+
+    /*!
+     * Decode a C style escaped string literal (quotes included).
+     */
+    bool parse_string(const std::string &s, char quote, std::string &value) {
+        if (s.size() < 2 || s.front() != quote || s.back() != quote) return false;
+        value.clear();
+        for (size_t i = 1; i + 1 < s.size(); ++i) {
+            auto ch = s[i];
+            if (ch != '\\') {
+                value.push_back(ch);
+                continue;
+            }
+            if (++i + 1 >= s.size()) return false;
+            ch = s[i];
+            switch (ch) {
+                case 'n': value.push_back('\n'); break;
+                case 't': value.push_back('\t'); break;
+                case 'r': value.push_back('\r'); break;
+                case 'a': value.push_back('\a'); break;
+                case 'b': value.push_back('\b'); break;
+                case 'f': value.push_back('\f'); break;
+                case 'v': value.push_back('\v'); break;
+                case 'x': {
+                    int code = 0;
+                    while (i + 2 < s.size() && std::isxdigit(s[i + 1])) {
+                        auto d = s[++i];
+                        code = code * 16 + (std::isdigit(d) ? d - '0' : std::tolower(d) - 'a' + 10);
+                    }
+                    value.push_back((char) code);
+                    break;
+                }
+                default:
+                    if (ch >= '0' && ch <= '7') {
+                        int code = ch - '0';
+                        for (int k = 0; k < 2 && i + 2 < s.size() && s[i + 1] >= '0' && s[i + 1] <= '7'; ++k) {
+                            code = code * 8 + s[++i] - '0';
+                        }
+                        value.push_back((char) code);
+                    } else {
+                        value.push_back(ch); // \\, \", \', \?
+                    }
+            }
+        }
+        return true;
+    }
+
+    /*!
+     * Parse a memory operand "offset(base)".
+     */
+    bool parse_memory(const std::string &s, int64_t &offset, uint8_t &base) {
+        auto open = s.find('(');
+        if (open == std::string::npos || s.back() != ')') return false;
+        auto off = trim(s.substr(0, open));
+        offset = 0;
+        if (!off.empty() && !parse_integer(off, offset)) return false;
+        return parse_register(trim(s.substr(open + 1, s.size() - open - 2)), base);
+    }
+
+    /*!
+     * The Fixup struct. A label reference resolved after parsing.
+     */
+    struct Fixup {
+        enum Kind {
+            Branch,  /**< instruction target */
+            Call,    /**< instruction target, possibly an external function */
+            Address, /**< instruction immediate */
+            Word     /**< data word */
+        } kind;
+        uint32_t where;
+        std::string name;
+        size_t line;
+    };
+}
+
+Simulator::Simulator(size_t memory_size) : memory(memory_size & ~(size_t) 7) {
+    define_external("write", [](Simulator &sim) {
+        auto size = (uint32_t) sim.argument(2);
+        auto bytes = sim.data(sim.argument(1), size);
+        if (!bytes) return -1;
+        sim.write(reinterpret_cast<const char *>(bytes), size);
+        return (int32_t) size;
+    });
+    define_external("putchar", [](Simulator &sim) {
+        char ch = (char) sim.argument(0);
+        sim.write(&ch, 1);
+        return sim.argument(0) & 0xff;
+    });
+    define_external("exit", [](Simulator &sim) {
+        sim.exit(sim.argument(0));
+        return 0;
+    });
+    define_external("malloc", [](Simulator &sim) {
+        return (int32_t) sim.allocate(sim.argument(0));
+    });
+    define_external("calloc", [](Simulator &sim) {
+        auto size = (uint64_t) (uint32_t) sim.argument(0) * (uint32_t) sim.argument(1);
+        if (size > UINT32_MAX) return 0;
+        auto address = sim.allocate(size);
+        if (address) std::memset(sim.data(address, size), 0, size);
+        return (int32_t) address;
+    });
+    define_external("free", [](Simulator &) {
+        return 0;
+    });
+    auto move = [](Simulator &sim) {
+        auto size = (uint32_t) sim.argument(2);
+        auto dst = sim.data(sim.argument(0), size);
+        auto src = sim.data(sim.argument(1), size);
+        if (dst && src) std::memmove(dst, src, size);
+        return sim.argument(0);
+    };
+    define_external("memcpy", move);
+    define_external("memmove", move);
+    define_external("memset", [](Simulator &sim) {
+        auto size = (uint32_t) sim.argument(2);
+        auto dst = sim.data(sim.argument(0), size);
+        if (dst) std::memset(dst, sim.argument(1), size);
+        return sim.argument(0);
+    });
+}
+
+void Simulator::define_external(const std::string &name, External handler) {
+    for (auto &i : externals) {
+        if (i.first == name) {
+            i.second = std::move(handler);
+            return;
+        }
+    }
+    externals.emplace_back(name, std::move(handler));
+}
+
+bool Simulator::load(const std::string &assembly) {
+    code.clear();
+    image.clear();
+    symbols.clear();
+    message.clear();
+    threaded = false;
+
+    phmap::flat_hash_map<std::string, uint32_t> labels; // text labels, by instruction index
+    std::vector<Fixup> fixups;
+    auto text = true, noreorder = false;
+    std::istringstream in(assembly);
+    std::string raw;
+    size_t line = 0;
+
+    auto fail = [&](const std::string &what) {
+        std::stringstream ss;
+        ss << "line " << line << ": " << what << ": " << trim(raw);
+        message = ss.str();
+        code.clear();
+        return false;
+    };
+    auto align = [&](size_t alignment) {
+        while (image.size() % alignment) image.push_back(0);
+    };
+    auto put = [&](uint32_t value, size_t size) {
+        for (size_t i = 0; i < size; ++i) image.push_back(value >> (8 * i));
+    };
+
+    while (std::getline(in, raw)) {
+        ++line;
+        auto content = trim(strip_comment(raw));
+
+        // labels
+        for (;;) {
+            auto colon = content.find(':');
+            if (colon == std::string::npos || colon == 0) break;
+            auto name = content.substr(0, colon);
+            if (name.find_first_of(" \t\"',") != std::string::npos) break;
+            if (symbols.count(name)) return fail("duplicated label " + name);
+            if (text) {
+                labels[name] = code.size();
+                symbols[name] = VSIM_TEXT_BASE + 4 * code.size();
+            } else {
+                symbols[name] = VSIM_DATA_BASE + image.size();
+            }
+            content = trim(content.substr(colon + 1));
+        }
+        if (content.empty()) continue;
+
+        auto space = content.find_first_of(" \t");
+        auto head = content.substr(0, space);
+        auto operands = space == std::string::npos ? std::vector<std::string>{}
+                                                   : split_operands(trim(content.substr(space)));
+
+        // directives
+        if (head[0] == '.') {
+            if (head == ".text") {
+                text = true;
+            } else if (head == ".data" || head == ".rdata" || head == ".sdata" || head == ".bss") {
+                text = false;
+            } else if (head == ".set") {
+                if (operands.size() == 1 && operands[0] == "noreorder") noreorder = true;
+                if (operands.size() == 1 && operands[0] == "reorder") noreorder = false;
+            } else if (head == ".globl" || head == ".global" || head == ".ent" || head == ".end"
+                       || head == ".extern" || head == ".frame" || head == ".cpload" || head == ".cprestore"
+                       || head == ".mask" || head == ".fmask") {
+                // assembler bookkeeping: $gp is not modelled
+            } else if (text) {
+                return fail("data directive in text section");
+            } else if (head == ".align") {
+                int64_t n;
+                if (operands.size() != 1 || !parse_integer(operands[0], n) || n < 0 || n > 12) {
+                    return fail("invalid alignment");
+                }
+                align((size_t) 1 << n);
+            } else if (head == ".space") {
+                int64_t n;
+                if (operands.size() != 1 || !parse_integer(operands[0], n) || n < 0) return fail("invalid size");
+                image.resize(image.size() + n, 0);
+            } else if (head == ".ascii" || head == ".asciiz") {
+                // values may be separated by spaces or commas
+                auto rest = space == std::string::npos ? std::string() : trim(content.substr(space));
+                while (!rest.empty()) {
+                    size_t end = 1;
+                    while (end < rest.size() && rest[end] != '"') end += rest[end] == '\\' ? 2 : 1;
+                    std::string value;
+                    if (end >= rest.size() || !parse_string(rest.substr(0, end + 1), '"', value)) {
+                        return fail("invalid string");
+                    }
+                    image.insert(image.end(), value.begin(), value.end());
+                    if (head == ".asciiz") image.push_back(0);
+                    rest = trim(rest.substr(end + 1));
+                    if (!rest.empty() && rest[0] == ',') rest = trim(rest.substr(1));
+                }
+            } else if (head == ".byte" || head == ".half" || head == ".hword" || head == ".word") {
+                size_t size = head == ".byte" ? 1 : head == ".word" ? 4 : 2;
+                align(size);
+                std::vector<std::string> values;
+                for (auto &i : operands) {
+                    std::istringstream words(i);
+                    std::string word;
+                    // character literals may contain a space
+                    if (i.size() >= 3 && i[0] == '\'') {
+                        values.push_back(i);
+                        continue;
+                    }
+                    while (words >> word) values.push_back(word);
+                }
+                for (auto &i : values) {
+                    int64_t value;
+                    std::string ch;
+                    if (i[0] == '\'' && parse_string(i, '\'', ch) && ch.size() == 1) {
+                        value = (unsigned char) ch[0];
+                    } else if (!parse_integer(i, value)) {
+                        if (size != 4) return fail("invalid value");
+                        fixups.push_back({Fixup::Word, (uint32_t) image.size(), i, line});
+                        value = 0;
+                    }
+                    put(value, size);
+                }
+            } else {
+                return fail("unsupported directive");
+            }
+            continue;
+        }
+
+        // instructions
+        if (!text) return fail("instruction in data section");
+        auto mnemonic = mnemonics().find(head);
+        if (mnemonic == mnemonics().end()) return fail("unsupported instruction");
+        auto op = mnemonic->second.op;
+        Decoded inst{};
+        inst.op = (uint8_t) op;
+        inst.d = inst.s = inst.t = NONE;
+        inst.latency = 1;
+        inst.line = line;
+        uint8_t reg[3];
+        int64_t imm = 0;
+
+        auto expect = [&](size_t count) { return operands.size() == count; };
+        auto registers = [&](size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                if (!parse_register(operands[i], reg[i])) return false;
+            }
+            return true;
+        };
+        auto dest = [](uint8_t r) -> uint8_t { return r == 0 ? SINK : r; };
+        auto slot = [&] {
+            inst.delay = noreorder;
+            if (!noreorder) inst.extra += 1; // nop in the delay slot
+        };
+        auto branch = [&](const std::string &label, Fixup::Kind kind) {
+            slot();
+            fixups.push_back({kind, (uint32_t) code.size(), label, line});
+        };
+
+        switch (mnemonic->second.form) {
+            case Form::Ternary:
+                if (!expect(3) || !registers(3)) return fail("expected three registers");
+                inst.d = dest(reg[0]), inst.s = reg[1], inst.t = reg[2];
+                if (op == Op::mul) inst.latency = 3;
+                break;
+            case Form::BinaryImm:
+            case Form::LogicImm:
+            case Form::Shift:
+                if (!expect(3) || !registers(2) || !parse_integer(operands[2], imm)) {
+                    return fail("expected two registers and an immediate");
+                }
+                inst.d = dest(reg[0]), inst.s = reg[1], inst.imm = (int32_t) imm;
+                if (mnemonic->second.form == Form::Shift) {
+                    if (imm < 0 || imm > 31) return fail("invalid shift amount");
+                } else if (mnemonic->second.form == Form::LogicImm ? !fits_unsigned16(imm) : !fits_signed16(imm)) {
+                    inst.extra = constant_cost(imm); // loaded into $at
+                }
+                break;
+            case Form::Binary:
+                if (!expect(2) || !registers(2)) return fail("expected two registers");
+                inst.d = dest(reg[0]), inst.s = reg[1];
+                break;
+            case Form::UnaryImm:
+                if (!expect(2) || !registers(1) || !parse_integer(operands[1], imm)) {
+                    return fail("expected a register and an immediate");
+                }
+                inst.d = dest(reg[0]), inst.imm = (int32_t) imm;
+                if (op == Op::lui) {
+                    if (!fits_unsigned16(imm)) return fail("invalid immediate");
+                } else {
+                    inst.extra = constant_cost(imm) - 1;
+                }
+                break;
+            case Form::Address:
+                if (!expect(2) || !registers(1)) return fail("expected a register and a label");
+                inst.d = dest(reg[0]), inst.extra = 1; // lui and addiu
+                fixups.push_back({Fixup::Address, (uint32_t) code.size(), operands[1], line});
+                break;
+            case Form::HiLo:
+                if (!expect(2) || !registers(2)) return fail("expected two registers");
+                inst.d = HI, inst.s = reg[0], inst.t = reg[1];
+                inst.latency = op == Op::div || op == Op::divu ? 20 : 3;
+                if (op == Op::div || op == Op::divu) inst.extra = 2; // division by zero check
+                break;
+            case Form::MoveFrom:
+                if (!expect(1) || !registers(1)) return fail("expected a register");
+                inst.d = dest(reg[0]), inst.s = HI;
+                break;
+            case Form::MoveTo:
+                if (!expect(1) || !registers(1)) return fail("expected a register");
+                inst.d = HI, inst.s = reg[0];
+                break;
+            case Form::Load:
+            case Form::Store:
+                if (!expect(2) || !registers(1) || !parse_memory(operands[1], imm, reg[1])) {
+                    return fail("expected a register and a memory operand");
+                }
+                inst.s = reg[1], inst.imm = (int32_t) imm;
+                if (mnemonic->second.form == Form::Load) {
+                    inst.d = dest(reg[0]), inst.latency = 2;
+                } else {
+                    inst.t = reg[0];
+                }
+                if (!fits_signed16(imm)) inst.extra = 2; // lui and addu into $at
+                break;
+            case Form::Jump:
+            case Form::Call:
+                if (!expect(1)) return fail("expected a label");
+                if (op == Op::jal) inst.d = 31;
+                branch(operands[0], op == Op::jal ? Fixup::Call : Fixup::Branch);
+                break;
+            case Form::JumpRegister:
+                if (!expect(1) || !registers(1)) return fail("expected a register");
+                inst.s = reg[0];
+                slot();
+                break;
+            case Form::CallRegister:
+                if (expect(1) && registers(1)) {
+                    inst.d = 31, inst.s = reg[0];
+                } else if (expect(2) && registers(2)) {
+                    inst.d = dest(reg[0]), inst.s = reg[1];
+                } else {
+                    return fail("expected a register");
+                }
+                slot();
+                break;
+            case Form::CmpBranch:
+                if (!expect(3) || !registers(2)) return fail("expected two registers and a label");
+                inst.s = reg[0], inst.t = reg[1];
+                if (op != Op::beq && op != Op::bne) inst.extra = 1; // slt
+                branch(operands[2], Fixup::Branch);
+                break;
+            case Form::ZeroBranch:
+                if (!expect(2) || !registers(1)) return fail("expected a register and a label");
+                inst.s = reg[0];
+                branch(operands[1], Fixup::Branch);
+                break;
+            case Form::Nullary:
+                if (!expect(0)) return fail("unexpected operand");
+                if (op == Op::syscall) inst.s = 2, inst.t = 4;
+                break;
+            case Form::Internal:
+                return fail("unsupported instruction");
+        }
+        code.push_back(inst);
+    }
+
+    // the return address of top level calls
+    halt_index = code.size();
+    Decoded halt{};
+    halt.op = (uint8_t) Op::halt;
+    halt.d = SINK, halt.s = halt.t = NONE;
+    halt.latency = 1;
+    code.push_back(halt);
+
+    // link
+    phmap::flat_hash_map<std::string, uint32_t> stubs;
+    for (auto &i : fixups) {
+        line = i.line;
+        raw = i.name;
+        if (i.kind == Fixup::Branch || i.kind == Fixup::Call) {
+            auto label = labels.find(i.name);
+            if (label != labels.end()) {
+                code[i.where].target = label->second;
+                continue;
+            }
+            auto external = std::find_if(externals.begin(), externals.end(),
+                                         [&](const std::pair<std::string, External> &e) {
+                                             return e.first == i.name;
+                                         });
+            if (i.kind == Fixup::Branch || external == externals.end()) return fail("undefined label");
+            if (!stubs.count(i.name)) {
+                stubs[i.name] = code.size();
+                Decoded stub{};
+                stub.op = (uint8_t) Op::external;
+                stub.d = 2, stub.s = stub.t = NONE;
+                stub.latency = 1;
+                stub.imm = external - externals.begin();
+                code.push_back(stub);
+            }
+            code[i.where].target = stubs[i.name];
+        } else {
+            auto symbol = symbols.find(i.name);
+            if (symbol == symbols.end()) return fail("undefined symbol");
+            if (i.kind == Fixup::Address) {
+                code[i.where].imm = symbol->second;
+            } else {
+                for (size_t k = 0; k < 4; ++k) image[i.where + k] = symbol->second >> (8 * k);
+            }
+        }
+    }
+
+    data_end = VSIM_DATA_BASE + image.size();
+    if (image.size() > memory.size() / 2) {
+        message = "data sections do not fit into memory";
+        code.clear();
+        return false;
+    }
+    reset();
+    return true;
+}
+
+void Simulator::reset() {
+    std::fill(memory.begin(), memory.end(), 0);
+    std::copy(image.begin(), image.end(), memory.begin());
+    heap = (data_end + 7) & ~7u;
+    exit_status = 0;
+    written.clear();
+}
+
+Status Simulator::call(const std::string &name, const std::vector<int32_t> &args) {
+    auto address = symbol(name);
+    auto index = (address - VSIM_TEXT_BASE) / 4;
+    if (code.empty() || address < VSIM_TEXT_BASE || index >= halt_index) {
+        message = "undefined function " + name;
+        return Status::Fault;
+    }
+    std::fill(std::begin(regs), std::end(regs), 0);
+    auto top = VSIM_DATA_BASE + (uint32_t) memory.size();
+    auto sp = (top - std::max<uint32_t>(16, 4 * args.size()) - 64) & ~7u;
+    for (size_t i = 0; i < args.size(); ++i) {
+        write_word(sp + 4 * i, args[i]);
+        if (i < 4) regs[4 + i] = args[i];
+    }
+    regs[25] = address;                                // $t9
+    regs[28] = VSIM_DATA_BASE + 0x8000;                // $gp
+    regs[29] = sp;                                     // $sp
+    regs[30] = sp;                                     // $s8
+    regs[31] = VSIM_TEXT_BASE + 4 * halt_index;        // $ra
+    message.clear();
+    return run(index);
+}
+
+// direct threading uses the labels-as-values extension of GCC and Clang
+#ifndef VSIM_THREADED
+#if defined(__GNUC__)
+#define VSIM_THREADED 1
+#else
+#define VSIM_THREADED 0
+#endif
+#endif
+
+Status Simulator::run(uint32_t pc) {
+#if VSIM_THREADED
+    static const void *const handlers[] = {
+#define VSIM_LABEL(S, F, N) &&op_##S,
+            VSIM_OPERATIONS(VSIM_LABEL)
+#undef VSIM_LABEL
+    };
+    if (!threaded) {
+        for (auto &i : code) i.handler = handlers[i.op];
+        threaded = true;
+    }
+#endif
+    auto r = regs;
+    auto mem = memory.data();
+    auto size = (uint32_t) memory.size();
+    auto base = code.data();
+    const Decoded *inst = nullptr;
+    uint32_t npc = pc + 1;
+    uint64_t executed = 0, limit = step_limit, cycle = counter.cycles, ready[NONE + 1] = {};
+    Status status = Status::Returned;
+
+    // one cycle per issued instruction; an instruction waits until its operands are ready
+#define VSIM_FETCH()                                                    \
+    do {                                                                \
+        if (executed == limit) {                                        \
+            status = Status::StepLimit;                                 \
+            goto done;                                                  \
+        }                                                               \
+        inst = base + pc;                                               \
+        pc = npc;                                                       \
+        npc = pc + 1;                                                   \
+        ++executed;                                                     \
+        auto operands = std::max(ready[inst->s], ready[inst->t]);       \
+        if (operands > cycle) {                                         \
+            counter.stalls += operands - cycle;                         \
+            cycle = operands;                                           \
+        }                                                               \
+        ready[inst->d] = cycle + inst->latency;                         \
+        cycle += 1 + inst->extra;                                       \
+    } while (0)
+#if VSIM_THREADED
+#define VSIM_HANDLER(S) op_##S:
+#define VSIM_NEXT() do { VSIM_FETCH(); goto *inst->handler; } while (0)
+#else
+#define VSIM_HANDLER(S) case Op::S:
+#define VSIM_NEXT() goto dispatch
+#endif
+#define VSIM_JUMP(T)                                                    \
+    do {                                                                \
+        if (inst->delay) {                                              \
+            npc = (T);                                                  \
+        } else {                                                        \
+            pc = (T);                                                   \
+            npc = pc + 1;                                               \
+        }                                                               \
+    } while (0)
+#define VSIM_FAULT(WHAT)                                                \
+    do {                                                                \
+        std::stringstream ss;                                           \
+        ss << "line " << inst->line << ": " << WHAT;                    \
+        message = ss.str();                                             \
+        status = Status::Fault;                                         \
+        goto done;                                                      \
+    } while (0)
+#define VSIM_ADDRESS(A, SIZE)                                           \
+    uint32_t A = r[inst->s] + inst->imm - VSIM_DATA_BASE;               \
+    if (A > size - SIZE || (A & (SIZE - 1)))                            \
+        VSIM_FAULT("invalid memory access at 0x" << std::hex << A + VSIM_DATA_BASE)
+#define VSIM_BRANCH(COND)                                               \
+    do {                                                                \
+        counter.branches++;                                             \
+        if (COND) {                                                     \
+            counter.taken_branches++;                                   \
+            VSIM_JUMP(inst->target);                                    \
+        }                                                               \
+        VSIM_NEXT();                                                    \
+    } while (0)
+#define VSIM_RETURN_TO(A)                                               \
+    do {                                                                \
+        uint32_t target = ((A) - VSIM_TEXT_BASE) / 4;                   \
+        if (((A) & 3) || (A) < VSIM_TEXT_BASE || target >= code.size()) \
+            VSIM_FAULT("invalid jump to 0x" << std::hex << (A));        \
+        VSIM_JUMP(target);                                              \
+    } while (0)
+
+#if !VSIM_THREADED
+    dispatch:
+#endif
+    VSIM_FETCH();
+#if VSIM_THREADED
+    goto *inst->handler;
+#else
+    switch ((Op) inst->op) {
+#endif
+    VSIM_HANDLER(add) { r[inst->d] = (uint32_t) r[inst->s] + (uint32_t) r[inst->t]; VSIM_NEXT(); }
+    VSIM_HANDLER(addu) { r[inst->d] = (uint32_t) r[inst->s] + (uint32_t) r[inst->t]; VSIM_NEXT(); }
+    VSIM_HANDLER(sub) { r[inst->d] = (uint32_t) r[inst->s] - (uint32_t) r[inst->t]; VSIM_NEXT(); }
+    VSIM_HANDLER(subu) { r[inst->d] = (uint32_t) r[inst->s] - (uint32_t) r[inst->t]; VSIM_NEXT(); }
+    VSIM_HANDLER(band) { r[inst->d] = r[inst->s] & r[inst->t]; VSIM_NEXT(); }
+    VSIM_HANDLER(bor) { r[inst->d] = r[inst->s] | r[inst->t]; VSIM_NEXT(); }
+    VSIM_HANDLER(bxor) { r[inst->d] = r[inst->s] ^ r[inst->t]; VSIM_NEXT(); }
+    VSIM_HANDLER(nor) { r[inst->d] = ~(r[inst->s] | r[inst->t]); VSIM_NEXT(); }
+    VSIM_HANDLER(slt) { r[inst->d] = r[inst->s] < r[inst->t]; VSIM_NEXT(); }
+    VSIM_HANDLER(sltu) { r[inst->d] = (uint32_t) r[inst->s] < (uint32_t) r[inst->t]; VSIM_NEXT(); }
+    VSIM_HANDLER(mul) { r[inst->d] = (uint32_t) r[inst->s] * (uint32_t) r[inst->t]; VSIM_NEXT(); }
+    VSIM_HANDLER(sllv) { r[inst->d] = (uint32_t) r[inst->s] << (r[inst->t] & 31); VSIM_NEXT(); }
+    VSIM_HANDLER(srlv) { r[inst->d] = (uint32_t) r[inst->s] >> (r[inst->t] & 31); VSIM_NEXT(); }
+    VSIM_HANDLER(srav) { r[inst->d] = r[inst->s] >> (r[inst->t] & 31); VSIM_NEXT(); }
+    VSIM_HANDLER(movn) { if (r[inst->t] != 0) r[inst->d] = r[inst->s]; VSIM_NEXT(); }
+    VSIM_HANDLER(movz) { if (r[inst->t] == 0) r[inst->d] = r[inst->s]; VSIM_NEXT(); }
+    VSIM_HANDLER(addi) { r[inst->d] = (uint32_t) r[inst->s] + (uint32_t) inst->imm; VSIM_NEXT(); }
+    VSIM_HANDLER(addiu) { r[inst->d] = (uint32_t) r[inst->s] + (uint32_t) inst->imm; VSIM_NEXT(); }
+    VSIM_HANDLER(slti) { r[inst->d] = r[inst->s] < inst->imm; VSIM_NEXT(); }
+    VSIM_HANDLER(sltiu) { r[inst->d] = (uint32_t) r[inst->s] < (uint32_t) inst->imm; VSIM_NEXT(); }
+    VSIM_HANDLER(andi) { r[inst->d] = r[inst->s] & inst->imm; VSIM_NEXT(); }
+    VSIM_HANDLER(ori) { r[inst->d] = r[inst->s] | inst->imm; VSIM_NEXT(); }
+    VSIM_HANDLER(xori) { r[inst->d] = r[inst->s] ^ inst->imm; VSIM_NEXT(); }
+    VSIM_HANDLER(sll) { r[inst->d] = (uint32_t) r[inst->s] << inst->imm; VSIM_NEXT(); }
+    VSIM_HANDLER(srl) { r[inst->d] = (uint32_t) r[inst->s] >> inst->imm; VSIM_NEXT(); }
+    VSIM_HANDLER(sra) { r[inst->d] = r[inst->s] >> inst->imm; VSIM_NEXT(); }
+    VSIM_HANDLER(move) { r[inst->d] = r[inst->s]; VSIM_NEXT(); }
+    VSIM_HANDLER(neg) { r[inst->d] = -(uint32_t) r[inst->s]; VSIM_NEXT(); }
+    VSIM_HANDLER(negu) { r[inst->d] = -(uint32_t) r[inst->s]; VSIM_NEXT(); }
+    VSIM_HANDLER(bnot) { r[inst->d] = ~r[inst->s]; VSIM_NEXT(); }
+    VSIM_HANDLER(clo) { r[inst->d] = leading_zeros(~r[inst->s]); VSIM_NEXT(); }
+    VSIM_HANDLER(clz) { r[inst->d] = leading_zeros(r[inst->s]); VSIM_NEXT(); }
+    VSIM_HANDLER(seb) { r[inst->d] = (int8_t) r[inst->s]; VSIM_NEXT(); }
+    VSIM_HANDLER(seh) { r[inst->d] = (int16_t) r[inst->s]; VSIM_NEXT(); }
+    VSIM_HANDLER(li) { r[inst->d] = inst->imm; VSIM_NEXT(); }
+    VSIM_HANDLER(lui) { r[inst->d] = (uint32_t) inst->imm << 16; VSIM_NEXT(); }
+    VSIM_HANDLER(la) { r[inst->d] = inst->imm; VSIM_NEXT(); }
+    VSIM_HANDLER(mult) {
+        auto product = (int64_t) r[inst->s] * r[inst->t];
+        r[HI] = (int32_t) (product >> 32), r[LO] = (int32_t) product;
+        VSIM_NEXT();
+    }
+    VSIM_HANDLER(multu) {
+        auto product = (uint64_t) (uint32_t) r[inst->s] * (uint32_t) r[inst->t];
+        r[HI] = (int32_t) (product >> 32), r[LO] = (int32_t) product;
+        VSIM_NEXT();
+    }
+    VSIM_HANDLER(div) {
+        if (r[inst->t] == 0) VSIM_FAULT("division by zero");
+        if (r[inst->s] == INT32_MIN && r[inst->t] == -1) {
+            r[HI] = 0, r[LO] = INT32_MIN;
+        } else {
+            r[HI] = r[inst->s] % r[inst->t], r[LO] = r[inst->s] / r[inst->t];
+        }
+        VSIM_NEXT();
+    }
+    VSIM_HANDLER(divu) {
+        if (r[inst->t] == 0) VSIM_FAULT("division by zero");
+        r[HI] = (uint32_t) r[inst->s] % (uint32_t) r[inst->t];
+        r[LO] = (uint32_t) r[inst->s] / (uint32_t) r[inst->t];
+        VSIM_NEXT();
+    }
+    VSIM_HANDLER(mfhi) { r[inst->d] = r[HI]; VSIM_NEXT(); }
+    VSIM_HANDLER(mflo) { r[inst->d] = r[LO]; VSIM_NEXT(); }
+    VSIM_HANDLER(mthi) { r[HI] = r[inst->s]; VSIM_NEXT(); }
+    VSIM_HANDLER(mtlo) { r[LO] = r[inst->s]; VSIM_NEXT(); }
+    VSIM_HANDLER(lw) {
+        VSIM_ADDRESS(a, 4);
+        r[inst->d] = (int32_t) (mem[a] | mem[a + 1] << 8 | mem[a + 2] << 16 | (uint32_t) mem[a + 3] << 24);
+        counter.loads++;
+        VSIM_NEXT();
+    }
+    VSIM_HANDLER(lh) {
+        VSIM_ADDRESS(a, 2);
+        r[inst->d] = (int16_t) (mem[a] | mem[a + 1] << 8);
+        counter.loads++;
+        VSIM_NEXT();
+    }
+    VSIM_HANDLER(lhu) {
+        VSIM_ADDRESS(a, 2);
+        r[inst->d] = (uint16_t) (mem[a] | mem[a + 1] << 8);
+        counter.loads++;
+        VSIM_NEXT();
+    }
+    VSIM_HANDLER(lb) {
+        VSIM_ADDRESS(a, 1);
+        r[inst->d] = (int8_t) mem[a];
+        counter.loads++;
+        VSIM_NEXT();
+    }
+    VSIM_HANDLER(lbu) {
+        VSIM_ADDRESS(a, 1);
+        r[inst->d] = mem[a];
+        counter.loads++;
+        VSIM_NEXT();
+    }
+    VSIM_HANDLER(sw) {
+        VSIM_ADDRESS(a, 4);
+        auto x = (uint32_t) r[inst->t];
+        mem[a] = x, mem[a + 1] = x >> 8, mem[a + 2] = x >> 16, mem[a + 3] = x >> 24;
+        counter.stores++;
+        VSIM_NEXT();
+    }
+    VSIM_HANDLER(sh) {
+        VSIM_ADDRESS(a, 2);
+        auto x = (uint32_t) r[inst->t];
+        mem[a] = x, mem[a + 1] = x >> 8;
+        counter.stores++;
+        VSIM_NEXT();
+    }
+    VSIM_HANDLER(sb) {
+        VSIM_ADDRESS(a, 1);
+        mem[a] = r[inst->t];
+        counter.stores++;
+        VSIM_NEXT();
+    }
+    VSIM_HANDLER(b) { VSIM_JUMP(inst->target); VSIM_NEXT(); }
+    VSIM_HANDLER(j) { VSIM_JUMP(inst->target); VSIM_NEXT(); }
+    VSIM_HANDLER(jal) {
+        counter.calls++;
+        r[31] = VSIM_TEXT_BASE + 4 * (uint32_t) (inst - base + 1 + inst->delay);
+        VSIM_JUMP(inst->target);
+        VSIM_NEXT();
+    }
+    VSIM_HANDLER(jr) {
+        auto address = (uint32_t) r[inst->s];
+        VSIM_RETURN_TO(address);
+        VSIM_NEXT();
+    }
+    VSIM_HANDLER(jalr) {
+        auto address = (uint32_t) r[inst->s];
+        counter.calls++;
+        r[inst->d] = VSIM_TEXT_BASE + 4 * (uint32_t) (inst - base + 1 + inst->delay);
+        VSIM_RETURN_TO(address);
+        VSIM_NEXT();
+    }
+    VSIM_HANDLER(beq) { VSIM_BRANCH(r[inst->s] == r[inst->t]); }
+    VSIM_HANDLER(bne) { VSIM_BRANCH(r[inst->s] != r[inst->t]); }
+    VSIM_HANDLER(blt) { VSIM_BRANCH(r[inst->s] < r[inst->t]); }
+    VSIM_HANDLER(ble) { VSIM_BRANCH(r[inst->s] <= r[inst->t]); }
+    VSIM_HANDLER(bgt) { VSIM_BRANCH(r[inst->s] > r[inst->t]); }
+    VSIM_HANDLER(bge) { VSIM_BRANCH(r[inst->s] >= r[inst->t]); }
+    VSIM_HANDLER(bltu) { VSIM_BRANCH((uint32_t) r[inst->s] < (uint32_t) r[inst->t]); }
+    VSIM_HANDLER(bleu) { VSIM_BRANCH((uint32_t) r[inst->s] <= (uint32_t) r[inst->t]); }
+    VSIM_HANDLER(bgtu) { VSIM_BRANCH((uint32_t) r[inst->s] > (uint32_t) r[inst->t]); }
+    VSIM_HANDLER(bgeu) { VSIM_BRANCH((uint32_t) r[inst->s] >= (uint32_t) r[inst->t]); }
+    VSIM_HANDLER(beqz) { VSIM_BRANCH(r[inst->s] == 0); }
+    VSIM_HANDLER(bnez) { VSIM_BRANCH(r[inst->s] != 0); }
+    VSIM_HANDLER(blez) { VSIM_BRANCH(r[inst->s] <= 0); }
+    VSIM_HANDLER(bgtz) { VSIM_BRANCH(r[inst->s] > 0); }
+    VSIM_HANDLER(bltz) { VSIM_BRANCH(r[inst->s] < 0); }
+    VSIM_HANDLER(bgez) { VSIM_BRANCH(r[inst->s] >= 0); }
+    VSIM_HANDLER(nop) { VSIM_NEXT(); }
+    VSIM_HANDLER(syscall) {
+        switch (r[2]) {
+            case 4001: // exit
+                exit_status = r[4];
+                status = Status::Exited;
+                goto done;
+            case 4004: { // write
+                auto bytes = data(r[5], (uint32_t) r[6]);
+                if (!bytes) VSIM_FAULT("invalid buffer of write");
+                write(reinterpret_cast<const char *>(bytes), (uint32_t) r[6]);
+                r[2] = r[6], r[7] = 0;
+                break;
+            }
+            default:
+                VSIM_FAULT("unsupported system call " << std::dec << r[2]);
+        }
+        VSIM_NEXT();
+    }
+    VSIM_HANDLER(external) {
+        // called as a leaf function: returns to $ra without a delay slot
+        counter.external_calls++;
+        if (!call_external(inst->imm)) {
+            status = Status::Exited;
+            goto done;
+        }
+        auto address = (uint32_t) r[31];
+        VSIM_RETURN_TO(address);
+        VSIM_NEXT();
+    }
+    VSIM_HANDLER(halt) {
+        --executed, --cycle;
+        goto done;
+    }
+#if !VSIM_THREADED
+    }
+#endif
+
+#undef VSIM_FETCH
+#undef VSIM_HANDLER
+#undef VSIM_NEXT
+#undef VSIM_JUMP
+#undef VSIM_FAULT
+#undef VSIM_ADDRESS
+#undef VSIM_BRANCH
+#undef VSIM_RETURN_TO
+
+    done:
+    counter.instructions += executed;
+    counter.cycles = cycle;
+    return status;
+}
+
+bool Simulator::call_external(size_t index) {
+    regs[2] = externals[index].second(*this);
+    if (!halted) return true;
+    halted = false;
+    return false;
+}
+
+int32_t Simulator::result() const {
+    return regs[2];
+}
+
+int32_t Simulator::exit_code() const {
+    return exit_status;
+}
+
+const std::string &Simulator::error() const {
+    return message;
+}
+
+const std::string &Simulator::output() const {
+    return written;
+}
+
+const Counters &Simulator::counters() const {
+    return counter;
+}
+
+void Simulator::reset_counters() {
+    counter = Counters{};
+}
+
+int32_t Simulator::reg(size_t index) const {
+    return index < 32 ? regs[index] : 0;
+}
+
+int32_t Simulator::argument(size_t index) {
+    if (index < 4) return regs[4 + index];
+    int32_t value = 0;
+    read_word(regs[29] + 4 * index, value);
+    return value;
+}
+
+uint32_t Simulator::symbol(const std::string &name) const {
+    auto iter = symbols.find(name);
+    return iter == symbols.end() ? 0 : iter->second;
+}
+
+uint8_t *Simulator::data(uint32_t address, size_t size) {
+    uint32_t offset = address - VSIM_DATA_BASE;
+    if (offset > memory.size() || size > memory.size() - offset) return nullptr;
+    return memory.data() + offset;
+}
+
+bool Simulator::read_word(uint32_t address, int32_t &value) {
+    auto bytes = data(address, 4);
+    if (!bytes || (address & 3)) return false;
+    value = (int32_t) (bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t) bytes[3] << 24);
+    return true;
+}
+
+bool Simulator::write_word(uint32_t address, int32_t value) {
+    auto bytes = data(address, 4);
+    if (!bytes || (address & 3)) return false;
+    for (size_t i = 0; i < 4; ++i) bytes[i] = (uint32_t) value >> (8 * i);
+    return true;
+}
+
+uint32_t Simulator::allocate(uint32_t size) {
+    // bump allocation below the stack area (the upper quarter of the memory)
+    auto limit = VSIM_DATA_BASE + (uint32_t) (memory.size() - memory.size() / 4);
+    size = (size + 7) & ~7u;
+    if (size > limit - heap) return 0;
+    auto address = heap;
+    heap += size;
+    return address;
+}
+
+void Simulator::write(const char *bytes, size_t size) {
+    written.append(bytes, size);
+}
+
+void Simulator::exit(int32_t status) {
+    exit_status = status;
+    halted = true;
+}
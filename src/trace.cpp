@@ -0,0 +1,143 @@
+//
+// Compilation tracing of the Virtual MIPS IR.
+//
+
+#include <vcfg/trace.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+
+namespace vmips {
+
+    void json_string(std::ostream &out, const std::string &s) {
+        out << '"';
+        for (auto ch : s) {
+            if (ch == '"' || ch == '\\') {
+                out << '\\' << ch;
+            } else if ((unsigned char) ch < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", ch);
+                out << buf;
+            } else {
+                out << ch;
+            }
+        }
+        out << '"';
+    }
+
+    namespace trace {
+
+        /*!
+         * The Ring struct. Span buffer of one thread.
+         * The lock is only contended while the spans are collected.
+         */
+        struct Ring {
+            std::mutex lock;
+            std::vector<Event> events;
+            size_t next = 0;
+            size_t thread;
+
+            explicit Ring(size_t thread) : thread(thread) {}
+        };
+
+        /*!
+         * The Registry struct. Keeps the rings alive after their threads finish.
+         */
+        struct Registry {
+            std::mutex lock;
+            std::vector<std::shared_ptr<Ring>> rings;
+            std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+        };
+
+        static Registry &registry() {
+            static Registry instance;
+            return instance;
+        }
+
+        static Ring &local_ring() {
+            thread_local std::shared_ptr<Ring> ring = [] {
+                auto &reg = registry();
+                std::lock_guard<std::mutex> guard(reg.lock);
+                reg.rings.push_back(std::make_shared<Ring>(reg.rings.size()));
+                return reg.rings.back();
+            }();
+            return *ring;
+        }
+
+        uint64_t now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - registry().epoch).count();
+        }
+
+        void record(const char *name, std::string detail, uint64_t begin, uint64_t end) {
+            auto &ring = local_ring();
+            std::lock_guard<std::mutex> guard(ring.lock);
+            Event event{name, std::move(detail), begin, end - begin, ring.thread};
+            if (ring.events.size() < RING_SIZE) {
+                ring.events.push_back(std::move(event));
+            } else {
+                ring.events[ring.next] = std::move(event);
+            }
+            ring.next = (ring.next + 1) % RING_SIZE;
+        }
+
+        std::vector<Event> collect() {
+            std::vector<Event> result;
+            auto &reg = registry();
+            std::lock_guard<std::mutex> guard(reg.lock);
+            for (auto &i : reg.rings) {
+                std::lock_guard<std::mutex> ring_guard(i->lock);
+                result.insert(result.end(), i->events.begin(), i->events.end());
+            }
+            std::stable_sort(result.begin(), result.end(), [](const Event &a, const Event &b) {
+                return a.begin < b.begin;
+            });
+            return result;
+        }
+
+        void clear() {
+            auto &reg = registry();
+            std::lock_guard<std::mutex> guard(reg.lock);
+            for (auto &i : reg.rings) {
+                std::lock_guard<std::mutex> ring_guard(i->lock);
+                i->events.clear();
+                i->next = 0;
+            }
+        }
+
+        /*!
+         * Print nanoseconds as fractional microseconds, the time unit of the Chrome trace format.
+         * @param out output stream.
+         * @param ns nanoseconds.
+         */
+        static void micros(std::ostream &out, uint64_t ns) {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%llu.%03llu", (unsigned long long) (ns / 1000), (unsigned long long) (ns % 1000));
+            out << buf;
+        }
+
+        void export_chrome(std::ostream &out) {
+            auto events = collect();
+            out << "{\"traceEvents\": [";
+            for (size_t i = 0; i < events.size(); ++i) {
+                auto &e = events[i];
+                out << (i ? ",\n" : "\n") << "{\"name\": ";
+                json_string(out, e.name);
+                out << ", \"cat\": \"vcfg\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << e.thread
+                    << ", \"ts\": ";
+                micros(out, e.begin);
+                out << ", \"dur\": ";
+                micros(out, e.duration);
+                if (!e.detail.empty()) {
+                    out << ", \"args\": {\"detail\": ";
+                    json_string(out, e.detail);
+                    out << "}";
+                }
+                out << "}";
+            }
+            out << "\n], \"displayTimeUnit\": \"ns\"}" << std::endl;
+        }
+    }
+}
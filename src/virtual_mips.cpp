@@ -42,10 +42,12 @@ void vmips::unite(std::shared_ptr<VirtReg> x, std::shared_ptr<VirtReg> y) {
         std::swap(x, y);
     }
     y->parent = x;
+    y->representative = false;
     x->union_size += y->union_size;
 }
 
 std::shared_ptr<VirtReg> vmips::find_root(std::shared_ptr<VirtReg> x) {
+    if (x->representative) return x;
     std::shared_ptr<VirtReg> root = x;
     while (root->parent.lock() != root) {
         root = root->parent.lock();
@@ -62,8 +64,12 @@ std::shared_ptr <VirtReg> vmips::div::def() const {
     return nullptr;
 }
 
+bool vmips::div::fits_delay_slot() const {
+    return false; // expanded with division checks, writes HI/LO
+}
+
 std::ostream &vmips::operator<<(std::ostream &out, const VirtReg &reg) {
-    auto root = find_root(reg.parent.lock());
+    auto root = reg.representative ? &reg : find_root(reg.parent.lock()).get();
     if (root->allocated) {
         out << "$" << root->id.name;
     } else {
@@ -74,7 +80,8 @@ std::ostream &vmips::operator<<(std::ostream &out, const VirtReg &reg) {
 
 std::ostream &vmips::operator<<(std::ostream &out, const MemoryLocation &location) {
     if (location.status == MemoryLocation::Argument) {
-        out << location.offset * 4 + location.function->stack_size << "(" << *location.base << ")";
+        out << location.offset * 4 + location.function->stack_size << "(" << *location.function->frame_register()
+            << ")";
     } else if (location.status == MemoryLocation::Assigned || location.status == MemoryLocation::Static) {
         out << location.offset << "(" << *location.base << ")";
     } else {
@@ -131,10 +138,41 @@ bool Instruction::used_register(const std::shared_ptr<VirtReg> &reg) const {
 void Instruction::replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<VirtReg> &target) {
 }
 
+void Instruction::canonicalize() {
+}
+
+/*!
+ * Replace a register operand with the representative of its equivalent class.
+ * @param reg the operand.
+ */
+static inline void canonical(std::shared_ptr<VirtReg> &reg) {
+    if (reg && !reg->representative) reg = find_root(reg);
+}
+
 std::shared_ptr<CFGNode> Instruction::branch() {
     return nullptr;
 }
 
+void Instruction::retarget(const std::shared_ptr<CFGNode> &) {
+}
+
+bool Instruction::has_delay_slot() const {
+    return false;
+}
+
+bool Instruction::terminates() {
+    return has_delay_slot() && (!branch() || opcode == Opcode::j || opcode == Opcode::b);
+}
+
+bool Instruction::fits_delay_slot() const {
+    return false;
+}
+
+std::shared_ptr<Instruction> Instruction::rematerialize(std::shared_ptr<VirtReg>) const {
+    return nullptr;
+}
+
+
 
 void Ternary::collect_register(unordered_set<std::shared_ptr<VirtReg>> &set) const {
     if (!lhs->allocated) set.insert(lhs);
@@ -161,16 +199,26 @@ void Ternary::replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr
     if (*op1 == *reg) op1 = target;
 }
 
+void Ternary::canonicalize() {
+    canonical(lhs);
+    canonical(op0);
+    canonical(op1);
+}
+
 void Ternary::output(std::ostream &out) const {
     out << name() << " " << *lhs << ", " << *op0 << ", " << *op1;
 }
 
+bool Ternary::fits_delay_slot() const {
+    return opcode != Opcode::mul; // mul clobbers HI/LO
+}
+
 void CFGNode::dfs_collect(unordered_set<std::shared_ptr<VirtReg>> &regs) {
     if (visited) return;
     visited = true;
     for (auto &i : instructions) {
-        auto trial = dynamic_cast<phi *>(i.get());
-        if (trial) {
+        if (i->opcode == Opcode::phi) {
+            auto trial = static_cast<phi *>(i.get());
             unite(trial->op0, trial->op1);
         }
         i->collect_register(regs);
@@ -182,15 +230,143 @@ void CFGNode::dfs_collect(unordered_set<std::shared_ptr<VirtReg>> &regs) {
     visited = false;
 }
 
+/*
+ * Operand slots of each instruction kind (everything used_register matches); the return value is
+ * the defined register.
+ */
+
+static std::shared_ptr<VirtReg> operands(const Instruction &, std::vector<std::shared_ptr<VirtReg>> &) {
+    return nullptr;
+}
+
+static std::shared_ptr<VirtReg> operands(const Ternary &i, std::vector<std::shared_ptr<VirtReg>> &ops) {
+    ops.insert(ops.end(), {i.lhs, i.op0, i.op1});
+    return i.lhs;
+}
+
+static std::shared_ptr<VirtReg> operands(const BinaryImm &i, std::vector<std::shared_ptr<VirtReg>> &ops) {
+    ops.insert(ops.end(), {i.lhs, i.rhs});
+    return i.lhs;
+}
+
+static std::shared_ptr<VirtReg> operands(const Binary &i, std::vector<std::shared_ptr<VirtReg>> &ops) {
+    ops.insert(ops.end(), {i.lhs, i.rhs});
+    return i.def(); // nothing for div and the HiLo instructions
+}
+
+static std::shared_ptr<VirtReg> operands(const CmpBranch &i, std::vector<std::shared_ptr<VirtReg>> &ops) {
+    ops.insert(ops.end(), {i.lhs, i.rhs});
+    return nullptr;
+}
+
+static std::shared_ptr<VirtReg> operands(const Unary &i, std::vector<std::shared_ptr<VirtReg>> &ops) {
+    ops.push_back(i.target);
+    return i.opcode == Opcode::jr ? nullptr : i.target;
+}
+
+static std::shared_ptr<VirtReg> operands(const ZeroBranch &i, std::vector<std::shared_ptr<VirtReg>> &ops) {
+    ops.push_back(i.target);
+    return nullptr;
+}
+
+static std::shared_ptr<VirtReg> operands(const UnaryImm &i, std::vector<std::shared_ptr<VirtReg>> &ops) {
+    ops.push_back(i.target);
+    return i.target;
+}
+
+static std::shared_ptr<VirtReg> operands(const Memory &i, std::vector<std::shared_ptr<VirtReg>> &ops) {
+    ops.insert(ops.end(), {i.target, i.location->base});
+    return i.def();
+}
+
+static std::shared_ptr<VirtReg> operands(const ArrayAccess &i, std::vector<std::shared_ptr<VirtReg>> &ops) {
+    ops.insert(ops.end(), {i.target, i.location->base, i.offset});
+    return i.def();
+}
+
+static std::shared_ptr<VirtReg> operands(const callfunc &i, std::vector<std::shared_ptr<VirtReg>> &ops) {
+    if (i.ret) ops.push_back(i.ret);
+    ops.insert(ops.end(), i.call_with.begin(), i.call_with.end());
+    return i.ret;
+}
+
+void CFGNode::pack() {
+    packed.code.clear();
+    packed.overflow.clear();
+    packed.last_use.clear();
+    std::vector<std::shared_ptr<VirtReg>> ops;
+    for (size_t j = 0; j < instructions.size(); ++j) {
+        auto &instr = *instructions[j];
+        std::shared_ptr<VirtReg> def = nullptr;
+        ops.clear();
+        switch (instr.opcode) {
+#define VMIPS_OPERANDS(S, B, N) case Opcode::S: def = operands(static_cast<const B &>(instr), ops); break;
+            VMIPS_INSTRUCTIONS(VMIPS_OPERANDS)
+#undef VMIPS_OPERANDS
+            case Opcode::div:
+                def = operands(static_cast<const Binary &>(instr), ops);
+                break;
+            case Opcode::jr:
+            case Opcode::la:
+            case Opcode::address:
+                def = operands(static_cast<const Unary &>(instr), ops);
+                break;
+            case Opcode::array_load:
+            case Opcode::array_store:
+                def = operands(static_cast<const ArrayAccess &>(instr), ops);
+                break;
+            case Opcode::callfunc:
+                def = operands(static_cast<const callfunc &>(instr), ops);
+                break;
+            default: // phi and text touch no register
+                break;
+        }
+        PackedInstruction record{};
+        record.opcode = instr.opcode;
+        record.count = ops.size();
+        record.def = def ? function->packed_id(def) : PackedInstruction::NONE;
+        auto slots = record.slots;
+        if (ops.size() > PackedInstruction::INLINE_SLOTS) {
+            record.slots[0] = packed.overflow.size();
+            packed.overflow.resize(packed.overflow.size() + ops.size());
+            slots = packed.overflow.data() + record.slots[0];
+        }
+        for (size_t k = 0; k < ops.size(); ++k) {
+            slots[k] = function->packed_id(ops[k]);
+            packed.last_use[slots[k]] = j;
+        }
+        packed.code.push_back(record);
+    }
+}
+
+/*!
+ * Check whether a block reads a register before defining it.
+ * @param block the packed block.
+ * @param id packed id of the register.
+ * @return check result.
+ */
+static bool upward_exposed(const PackedBlock &block, uint32_t id) {
+    for (auto &record : block.code) {
+        auto slots = record.count > PackedInstruction::INLINE_SLOTS ? block.overflow.data() + record.slots[0]
+                                                                    : record.slots;
+        size_t uses = 0;
+        for (size_t k = 0; k < record.count; ++k) uses += slots[k] == id;
+        // the defined register is one of the slots; a select keeps the old value if its condition fails
+        if (record.def == id) return uses > 1 || record.opcode == Opcode::movn || record.opcode == Opcode::movz;
+        if (uses) return true;
+    }
+    return false;
+}
+
 void CFGNode::setup_living(const unordered_set<std::shared_ptr<VirtReg>> &reg) {
     if (visited) return;
     visited = true;
     for (auto &i : reg) {
-        for (size_t j = 0; j < instructions.size(); ++j) {
-            if (instructions[j]->used_register(i)) {
-                lives[i] = lives.count(i) == 0 ? j : std::max(lives[i], j);
-            }
-        }
+        auto id = function->packed_ids.find(find_root(i).get());
+        if (id == function->packed_ids.end()) continue;
+        auto last = packed.last_use.find(id->second);
+        if (last == packed.last_use.end()) continue;
+        lives[i] = lives.count(i) == 0 ? last->second : std::max(lives[i], last->second);
     }
     for (auto &i : out_edges) {
         std::shared_ptr<CFGNode> n{i};
@@ -200,9 +376,13 @@ void CFGNode::setup_living(const unordered_set<std::shared_ptr<VirtReg>> &reg) {
         if (i->spilled) continue;
         for (auto &j: out_edges) {
             std::shared_ptr<CFGNode> n{j};
-            if (n->lives.count(i)) {
-                lives[i] = instructions.size();
+            if (!n->lives.count(i)) continue;
+            // around a self loop, only what the node reads before defining it lives to the end
+            if (n.get() == this) {
+                auto id = function->packed_ids.find(find_root(i).get());
+                if (id != function->packed_ids.end() && !upward_exposed(packed, id->second)) continue;
             }
+            lives[i] = instructions.size();
         }
     }
     visited = false;
@@ -230,11 +410,15 @@ void CFGNode::generate_web(unordered_set<std::shared_ptr<VirtReg>> &liveness) {
     // find new birth
     for (size_t i = 0; i < instructions.size(); ++i) {
         auto def = instructions[i]->def();
-        if (def) {
-            liveness.insert(def);
-            birth[def] = i;
+        // operands are canonical: a class is born at its first definition, unless it is already living
+        // on entry (a loop carried value redefined in the node)
+        if (def && !liveness.count(def)) {
+            birth.insert({def, i});
         }
     }
+    for (auto &i : birth) {
+        liveness.insert(i.first);
+    }
 
     // find neighbour
     for (auto &i : liveness) {
@@ -301,11 +485,14 @@ void CFGNode::spill(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<M
             auto save = Memory::create<sw>(tmp, location);
             new_instr.push_back(load);
             new_instr.push_back(instructions[i]);
-            if (instructions[i]->def() && *instructions[i]->def() == *reg)
+            function->statistics.spill_loads++;
+            if (instructions[i]->def() && *instructions[i]->def() == *reg) {
                 new_instr.push_back(save);
+                function->statistics.spill_stores++;
+            }
             instructions[i]->replace(reg, tmp);
         } else {
-            if (dynamic_cast<phi *>(instructions[i].get())) {
+            if (instructions[i]->opcode == Opcode::phi) {
                 continue;
             }
             new_instr.push_back(instructions[i]);
@@ -319,6 +506,30 @@ void CFGNode::spill(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<M
     visited = false;
 }
 
+void CFGNode::rematerialize(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<Instruction> &definition) {
+    if (visited) return;
+    visited = true;
+    std::vector<std::shared_ptr<Instruction>> new_instr;
+    for (auto &i : instructions) {
+        if (i == definition) continue;
+        if (i->used_register(reg)) {
+            if (i->opcode == Opcode::phi) continue;
+            auto tmp = VirtReg::create();
+            tmp->spilled = true;
+            new_instr.push_back(definition->rematerialize(tmp));
+            function->statistics.rematerialized_instructions++;
+            i->replace(reg, tmp);
+        }
+        new_instr.push_back(i);
+    }
+    instructions = new_instr;
+    for (auto &i : out_edges) {
+        std::shared_ptr<CFGNode> n{i};
+        n->rematerialize(reg, definition);
+    }
+    visited = false;
+}
+
 void CFGNode::dfs_reset() {
     if (visited) return;
     visited = true;
@@ -336,15 +547,15 @@ void CFGNode::dfs_reset() {
 size_t CFGNode::color(const std::shared_ptr<VirtReg> &sp) {
     auto success = false;
     unordered_set<size_t> res;
+    bitmask_t temps = 0;
     do {
-        unordered_set<std::shared_ptr<VirtReg>> regs;
-        dfs_collect(regs);
+        VMIPS_TRACE_SCOPE("coloring round", function->name);
+        function->statistics.coloring_rounds++;
+        auto regs = function->analyze_registers();
         if (regs.empty()) {
+            function->clobbers = 0;
             return 0;
         }
-        setup_living(regs);
-        unordered_set<std::shared_ptr<VirtReg>> liveness;
-        generate_web(liveness);
         std::vector<std::shared_ptr<VirtReg>> vec;
         for (auto &i : regs) {
             if (find_root(i) == i) {
@@ -362,32 +573,81 @@ size_t CFGNode::color(const std::shared_ptr<VirtReg> &sp) {
         std::vector<std::pair<size_t, size_t>> edges;
         for (auto &i : vec) {
             for (auto &j : i->neighbors) {
-                if (j->id.number < i->id.number) continue;
+                // pre-allocated registers (e.g. $v0 assignments) are not part of the graph
+                if (j->id.number < i->id.number || !idx_map.count(j->id.number)) continue;
                 else {
                     edges.emplace_back(idx_map[i->id.number], idx_map[j->id.number]);
                 }
             }
         }
         auto g = Graph(edges, vec.size());
-        auto colors = g.color(REG_NUM);
+        std::vector<size_t> preferred;
+        if (function->prefer_callee_saved && function->has_sub) {
+            // compare the save/restore traffic around each crossed call with the one-time prologue save
+            unordered_map<size_t, unordered_map<const callfunc *, size_t>> crossing;
+            unordered_set<std::shared_ptr<VirtReg>> living;
+            scan_calls(living, [&](CFGNode &node, callfunc &call, const std::vector<std::shared_ptr<VirtReg>> &regs) {
+                for (auto &i : regs) {
+                    auto k = find_root(i);
+                    if (!k->allocated) crossing[k->id.number][&call] = node.frequency;
+                }
+            });
+            preferred.resize(vec.size(), 0);
+            for (auto &i : crossing) {
+                if (!idx_map.count(i.first)) continue;
+                size_t cost = 0, above = 0;
+                for (auto &j : i.second) {
+                    auto clobbers = j.first->function.lock()->clobbers;
+                    if (!clobbers) continue;
+                    cost += 2 * j.second; // one sw and one lw per call
+                    above = std::max(above, (size_t) (sizeof(bitmask_t) * 8 - __builtin_clzll(clobbers)));
+                }
+                if (above < SAVE_START) {
+                    // some temporaries survive all the crossed calls for free
+                    preferred[idx_map[i.first]] = above;
+                } else if (cost > CALLEE_SAVE_COST) {
+                    preferred[idx_map[i.first]] = SAVE_START;
+                }
+            }
+        }
+        auto colors = g.color(function->register_count(), preferred);
         std::shared_ptr<VirtReg> failure = nullptr;
         if (colors.first.empty()) {
             for (auto &i: vec) {
                 i->neighbors.clear();
                 i->union_size = 1;
                 i->parent = i;
+                i->representative = true;
             }
             dfs_reset();
+            // prefer values that can be recomputed at their uses over a stack slot
+            std::shared_ptr<Instruction> definition = nullptr;
             for (auto &i : colors.second) {
-                if (!vec[i]->spilled) {
+                if (!vec[i]->spilled && (definition = function->rematerializable(vec[i]))) {
                     failure = vec[i];
                     break;
                 }
             }
-            auto location = function->new_memory(4);
-            spill(failure, location);
+            if (definition) {
+                rematerialize(failure, definition);
+                function->statistics.rematerialized_registers++;
+            } else {
+                for (auto &i : colors.second) {
+                    if (!vec[i]->spilled) {
+                        failure = vec[i];
+                        break;
+                    }
+                }
+                auto location = function->new_memory(4);
+                spill(failure, location);
+                function->statistics.spilled_registers++;
+            }
+            function->invalidate(Analysis::Liveness | Analysis::Interference);
         } else {
             success = true;
+            function->statistics.interference_nodes = vec.size();
+            function->statistics.interference_edges = edges.size();
+            function->statistics.max_pressure = function->register_pressure();
             for (auto i = 0; i < vec.size(); ++i) {
                 vec[i]->allocated = true;
                 vec[i]->id.number = 0;
@@ -395,10 +655,17 @@ size_t CFGNode::color(const std::shared_ptr<VirtReg> &sp) {
             }
             for (auto i : colors.first) {
                 if (i >= SAVE_START) res.insert(i);
+                else mark(temps, i);
             }
         }
     } while (!success);
-    return res.size();
+    function->clobbers = temps;
+    // saved registers are stored from $s0, so the highest one decides the area
+    size_t saved = 0;
+    for (auto i : res) {
+        saved = std::max(saved, i - SAVE_START + 1);
+    }
+    return saved;
 }
 
 Memory::Memory(std::shared_ptr<VirtReg> target, std::shared_ptr<MemoryLocation> location)
@@ -412,10 +679,7 @@ void Memory::collect_register(unordered_set<std::shared_ptr<VirtReg>> &set) cons
 }
 
 std::shared_ptr<VirtReg> Memory::def() const {
-    if (name()[0] == 'l' || name()[1] == 'l') {
-        return target;
-    }
-    return nullptr;
+    return opcode == Opcode::lw || opcode == Opcode::array_load ? target : nullptr;
 }
 
 bool Memory::used_register(const std::shared_ptr<VirtReg> &reg) const {
@@ -424,13 +688,33 @@ bool Memory::used_register(const std::shared_ptr<VirtReg> &reg) const {
 
 void Memory::replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<VirtReg> &target) {
     if (*this->target == *reg) { this->target = target; }
-    if (*this->location->base == *reg) { location->base = target; }
+    if (*this->location->base == *reg) {
+        // locations may be shared between instructions: the others keep their base
+        location = std::make_shared<MemoryLocation>(*location);
+        location->base = target;
+    }
+}
+
+void Memory::canonicalize() {
+    canonical(target);
+    canonical(location->base);
 }
 
 void Memory::output(std::ostream &out) const {
     out << name() << " " << *target << ", " << *location;
 }
 
+bool Memory::fits_delay_slot() const {
+    switch (location->status) {
+        case MemoryLocation::Undetermined:
+            return false;
+        case MemoryLocation::Argument:
+            return fits_signed16(location->offset * 4 + location->function->stack_size);
+        default:
+            return fits_signed16(location->offset);
+    }
+}
+
 BinaryImm::BinaryImm(std::shared_ptr<VirtReg> lhs, std::shared_ptr<VirtReg> rhs, ssize_t imm)
         : lhs(std::move(lhs)), rhs(std::move(rhs)), imm(imm) {
 }
@@ -453,10 +737,34 @@ void BinaryImm::replace(const std::shared_ptr<VirtReg> &reg, const std::shared_p
     if (*rhs == *reg) rhs = target;
 }
 
+void BinaryImm::canonicalize() {
+    canonical(lhs);
+    canonical(rhs);
+}
+
 void BinaryImm::output(std::ostream &out) const {
     out << name() << " " << *lhs << ", " << *rhs << ", " << imm;
 }
 
+std::shared_ptr<Instruction> BinaryImm::rematerialize(std::shared_ptr<VirtReg> target) const {
+    if (!(*rhs == *get_special(SpecialReg::zero))) return nullptr;
+    switch (opcode) {
+        case Opcode::addi:
+            return std::make_shared<addi>(std::move(target), rhs, imm);
+        case Opcode::addiu:
+            return std::make_shared<addiu>(std::move(target), rhs, imm);
+        default:
+            return nullptr;
+    }
+}
+
+bool BinaryImm::fits_delay_slot() const {
+    if (opcode == Opcode::andi || opcode == Opcode::xori) {
+        return fits_unsigned16(imm);
+    }
+    return fits_signed16(imm);
+}
+
 Binary::Binary(std::shared_ptr<VirtReg> lhs, std::shared_ptr<VirtReg> rhs)
         : lhs(std::move(lhs)), rhs(std::move(rhs)) {
 
@@ -483,6 +791,10 @@ void Unary::replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<V
     if (*this->target == *reg) this->target = target;
 }
 
+void Unary::canonicalize() {
+    canonical(target);
+}
+
 void Unary::output(std::ostream &out) const {
     out << name() << " " << *target;
 }
@@ -505,6 +817,11 @@ void Binary::replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<
     if (*rhs == *reg) rhs = target;
 }
 
+void Binary::canonicalize() {
+    canonical(lhs);
+    canonical(rhs);
+}
+
 void Binary::output(std::ostream &out) const {
     out << name() << " " << *lhs << ", " << *rhs;
 }
@@ -514,14 +831,46 @@ void Binary::collect_register(unordered_set<std::shared_ptr<VirtReg>> &set) cons
     if (!rhs->allocated) set.insert(rhs);
 }
 
+bool Binary::fits_delay_slot() const {
+    return true;
+}
+
+HiLo::HiLo(std::shared_ptr<VirtReg> op0, std::shared_ptr<VirtReg> op1) : Binary(std::move(op0), std::move(op1)) {
+
+}
+
+std::shared_ptr<VirtReg> HiLo::def() const {
+    return nullptr;
+}
+
+bool HiLo::fits_delay_slot() const {
+    return false; // writes HI/LO
+}
+
 void CFGNode::output(std::ostream &out) {
     if (visited) return;
     visited = true;
     out << label << ":" << std::endl;
+    auto split = split_first;
     for (auto &i : instructions) {
-        if (!dynamic_cast<callfunc *>(i.get())) out << "\t";
+        if (i->opcode != Opcode::callfunc) out << "\t";
         i->output(out);
-        if (!dynamic_cast<callfunc *>(i.get())) out << "\n";
+        if (i->opcode != Opcode::callfunc) out << "\n";
+        if (function->noreorder && i->has_delay_slot()) {
+            out << "\t";
+            if (i->delay_slot) {
+                i->delay_slot->output(out);
+            } else {
+                out << "nop";
+            }
+            out << "\n";
+        }
+        if (split && i->opcode != Opcode::phi) {
+            out << label << ".ds:" << std::endl;
+            split = false;
+        }
+        // the return after a tail call is never reached
+        if (i->opcode == Opcode::callfunc && static_cast<callfunc &>(*i).tail) break;
     }
     visited = false;
 }
@@ -531,36 +880,54 @@ CFGNode::CFGNode(Function *function, std::string name) : label(std::move(name)),
 }
 
 void CFGNode::scan_overlap(unordered_set<std::shared_ptr<VirtReg>> &liveness) {
+    scan_calls(liveness, [](CFGNode &node, callfunc &call, const std::vector<std::shared_ptr<VirtReg>> &crossing) {
+        call.scanned = true;
+        auto clobbers = call.function.lock()->clobbers;
+        for (auto &i : crossing) {
+            auto k = find_root(i);
+            if (k->id.name[0] != 't') continue;
+            if (!(clobbers & ((bitmask_t) 1 << std::strtoul(k->id.name + 1, nullptr, 10)))) continue;
+            call.overlap_temp.insert(k);
+            if (!k->overlap_location) {
+                k->overlap_location = node.function->new_memory(4);
+            }
+        }
+    });
+}
+
+void CFGNode::scan_calls(unordered_set<std::shared_ptr<VirtReg>> &liveness,
+                         const std::function<void(CFGNode &, callfunc &,
+                                                  const std::vector<std::shared_ptr<VirtReg>> &)> &visitor) {
     if (visited) return;
 
     visited = true;
     unordered_map<std::shared_ptr<VirtReg>, size_t> birth; // marks define in this scope
 
-    // find new birth
+    // find new birth (see generate_web)
     for (size_t i = 0; i < instructions.size(); ++i) {
         auto def = instructions[i]->def();
-        if (def) {
-            liveness.insert(def);
-            birth[def] = i;
+        if (def && !liveness.count(def)) {
+            birth.insert({def, i});
         }
     }
+    for (auto &i : birth) {
+        liveness.insert(i.first);
+    }
 
 
     for (size_t j = 0; j < instructions.size(); ++j) {
-        auto call = dynamic_cast<callfunc *>(instructions[j].get());
-        if (!call) continue;
-        call->scanned = true;
+        if (instructions[j]->opcode != Opcode::callfunc) continue;
+        auto call = static_cast<callfunc *>(instructions[j].get());
+        std::vector<std::shared_ptr<VirtReg>> crossing;
         for (auto &i : liveness) {
-            auto k = find_root(i);
-            if (k->id.name[0] != 't') continue;
-            auto interleaved = (lives.count(i) && lives[i] < j) || (birth.count(i) && birth[i] >= j);
+            // arguments are staged on the stack before the call, so a register whose last use is the call
+            // itself does not need to survive it
+            auto interleaved = (lives.count(i) && lives[i] <= j) || (birth.count(i) && birth[i] >= j);
             if (!interleaved) {
-                call->overlap_temp.insert(k);
-                if (!k->overlap_location) {
-                    k->overlap_location = function->new_memory(4);
-                }
+                crossing.push_back(i);
             }
         }
+        visitor(*this, *call, crossing);
     }
 
     // kill death
@@ -573,7 +940,7 @@ void CFGNode::scan_overlap(unordered_set<std::shared_ptr<VirtReg>> &liveness) {
     // handle child
     for (auto &i : out_edges) {
         std::shared_ptr<CFGNode> n{i};
-        n->scan_overlap(liveness);
+        n->scan_calls(liveness, visitor);
     }
 
     // recover liveness
@@ -605,20 +972,50 @@ void UnaryImm::replace(const std::shared_ptr<VirtReg> &reg, const std::shared_pt
     if (*this->target == *reg) this->target = target;
 }
 
+void UnaryImm::canonicalize() {
+    canonical(target);
+}
+
 void UnaryImm::output(std::ostream &out) const {
     out << name() << " " << *target << ", " << imm;
 }
 
+std::shared_ptr<Instruction> UnaryImm::rematerialize(std::shared_ptr<VirtReg> target) const {
+    switch (opcode) {
+        case Opcode::li:
+            return std::make_shared<li>(std::move(target), imm);
+        case Opcode::lui:
+            return std::make_shared<lui>(std::move(target), imm);
+        default:
+            return nullptr;
+    }
+}
+
+bool UnaryImm::fits_delay_slot() const {
+    if (opcode == Opcode::li) {
+        return fits_signed16(imm) || fits_unsigned16(imm);
+    }
+    return true;
+}
+
 Unconditional::Unconditional(std::weak_ptr<CFGNode> block) : block(std::move(block)) {}
 
 void Unconditional::output(std::ostream &out) const {
-    out << name() << " " << block.lock()->label;
+    out << name() << " " << block.lock()->label << (skip_first ? ".ds" : "");
+}
+
+bool Unconditional::has_delay_slot() const {
+    return true;
 }
 
 std::shared_ptr<CFGNode> Unconditional::branch() {
     return block.lock();
 }
 
+void Unconditional::retarget(const std::shared_ptr<CFGNode> &target) {
+    block = target;
+}
+
 std::shared_ptr<VirtReg> Unconditional::def() const {
     return nullptr;
 }
@@ -636,10 +1033,18 @@ std::shared_ptr<CFGNode> ZeroBranch::branch() {
     return block.lock();
 }
 
+void ZeroBranch::retarget(const std::shared_ptr<CFGNode> &target) {
+    block = target;
+}
+
 std::shared_ptr<VirtReg> ZeroBranch::def() const {
     return nullptr;
 }
 
+bool ZeroBranch::has_delay_slot() const {
+    return true;
+}
+
 CmpBranch::CmpBranch(std::weak_ptr<CFGNode> block,
                      std::shared_ptr<VirtReg> op0, std::shared_ptr<VirtReg> op1)
         : Binary(std::move(op0), std::move(op1)), block(std::move(block)) {
@@ -654,10 +1059,22 @@ std::shared_ptr<CFGNode> CmpBranch::branch() {
     return block.lock();
 }
 
+void CmpBranch::retarget(const std::shared_ptr<CFGNode> &target) {
+    block = target;
+}
+
 std::shared_ptr<VirtReg> CmpBranch::def() const {
     return nullptr;
 }
 
+bool CmpBranch::fits_delay_slot() const {
+    return false;
+}
+
+bool CmpBranch::has_delay_slot() const {
+    return true;
+}
+
 std::string Function::next_name() {
     std::stringstream ss;
     ss << ".L"<< name << "_" << count++;
@@ -667,6 +1084,7 @@ std::string Function::next_name() {
 std::shared_ptr<CFGNode> Function::entry() {
     auto ret = std::make_shared<CFGNode>(this, next_name());
     blocks.push_back(ret);
+    invalidate_cfg();
     switch_to(ret);
     return ret;
 }
@@ -682,11 +1100,16 @@ void Function::output(std::ostream &out) const {
     out << "\t.ent " << name << std::endl;
     out << name << ":" << std::endl;
     out << "\t# prologue area" << std::endl;
-    if (allocated) {
+    if (noreorder) {
         out << "\t.set noreorder" << std::endl;
-        out << "\t.frame $s8, " << stack_size << ", $ra" << std::endl;
+    }
+    if (allocated && leaf) {
+        out << "\t.frame $sp, 0, $ra" << std::endl;
+    } else if (allocated) {
+        if (!noreorder) out << "\t.set noreorder" << std::endl;
+        out << "\t.frame " << *frame_register() << ", " << stack_size << ", $ra" << std::endl;
         out << "\t.cpload $t9" << std::endl;
-        out << "\t.set reorder " << std::endl;
+        if (!noreorder) out << "\t.set reorder " << std::endl;
         out << "\taddi $sp, $sp, -" << stack_size << std::endl;
         out << "\t.cprestore " << pic_location.offset << std::endl;
         if (has_sub) {
@@ -699,17 +1122,27 @@ void Function::output(std::ostream &out) const {
                     << base + i * 4 << "($sp)" << std::endl;
             }
         }
-        out << "\tsw $s8, " << s8_location << std::endl;
-        out << "\tmove $s8, $sp" << std::endl;
+        if (!omit_frame_pointer) {
+            out << "\tsw $s8, " << s8_location << std::endl;
+            out << "\tmove $s8, $sp" << std::endl;
+        }
     }
     for (auto &i : blocks) {
         i->output(out);
     }
     out << ".L" << name << "_epilogue:" << std::endl;
     out << "\t# epilogue area" << std::endl;
-    if (allocated) {
-        out << "\tmove $sp, $s8" << std::endl;
-        out << "\tlw $s8, " << s8_location << std::endl;
+    output_epilogue(out, "jr $ra");
+    if (noreorder) out << "\t.set reorder" << std::endl;
+    out << "\t.end " << name << std::endl;
+}
+
+void Function::output_epilogue(std::ostream &out, const std::string &jump) const {
+    if (allocated && !leaf) {
+        if (!omit_frame_pointer) {
+            out << "\tmove $sp, $s8" << std::endl;
+            out << "\tlw $s8, " << s8_location << std::endl;
+        }
         if (save_regs > 0) {
             auto base = sub_argc * 4 + EXTRA_STACK;
             for (size_t i = 0; i < save_regs; ++i) {
@@ -720,15 +1153,184 @@ void Function::output(std::ostream &out) const {
         if (has_sub) {
             out << "\tlw $ra, " << ra_location << std::endl;
         }
-        out << "\taddi $sp, $sp, " << stack_size << std::endl;
+        if (!noreorder) out << "\taddi $sp, $sp, " << stack_size << std::endl;
+    }
+    out << "\t" << jump << std::endl;
+    if (noreorder) {
+        // the stack pointer is restored in the delay slot
+        if (allocated && !leaf) {
+            out << "\taddi $sp, $sp, " << stack_size << std::endl;
+        } else {
+            out << "\tnop" << std::endl;
+        }
     }
-    out << "\tjr $ra" << std::endl;
-    out << "\t.end " << name << std::endl;
 }
 
 size_t Function::color() {
+    VMIPS_TRACE_SCOPE("color", name);
     auto s8 = get_special(SpecialReg::s8);
-    return save_regs = blocks[0]->color(s8);
+    auto phases = std::move(statistics.phase_times);
+    statistics = FunctionStatistics{};
+    statistics.phase_times = std::move(phases);
+    estimate_frequency();
+    save_regs = blocks[0]->color(s8);
+    // whatever the callees clobber is also clobbered by calling this function
+    for (auto &i : blocks) {
+        for (auto &j : i->instructions) {
+            if (j->opcode == Opcode::callfunc) clobbers |= static_cast<callfunc *>(j.get())->function.lock()->clobbers;
+        }
+    }
+    return save_regs;
+}
+
+void Function::estimate_frequency() {
+    if (profiled) return;
+    auto &info = cfg();
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        blocks[i]->frequency = 1;
+        for (size_t d = 0; d < std::min(info.loop_depth[i], (size_t) MAX_LOOP_DEPTH); ++d) {
+            blocks[i]->frequency *= LOOP_WEIGHT;
+        }
+    }
+}
+
+void CFGNode::add_edge(const std::shared_ptr<CFGNode> &node) {
+    out_edges.push_back(node);
+    function->invalidate_cfg();
+}
+
+constexpr size_t CFGInfo::NONE;
+
+bool CFGInfo::dominates(size_t a, size_t b) const {
+    if (!reachable(a) || !reachable(b)) return false;
+    // walk up the dominator tree; dominators come earlier in reverse postorder
+    while (rpo_index[b] > rpo_index[a]) {
+        b = idom[b];
+    }
+    return a == b;
+}
+
+void Function::invalidate_cfg() {
+    cfg_info.valid = false;
+}
+
+const CFGInfo &Function::cfg() {
+    if (cfg_info.valid) return cfg_info;
+    auto &info = cfg_info;
+    auto n = blocks.size();
+    info.index.clear();
+    info.successors.assign(n, {});
+    info.predecessors.assign(n, {});
+    info.rpo.clear();
+    info.rpo_index.assign(n, CFGInfo::NONE);
+    info.idom.assign(n, CFGInfo::NONE);
+    info.loop_header.assign(n, CFGInfo::NONE);
+    info.loop_depth.assign(n, 0);
+    for (size_t i = 0; i < n; ++i) {
+        info.index[blocks[i].get()] = i;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        for (auto &e : blocks[i]->out_edges) {
+            auto target = info.index.find(e.lock().get());
+            if (target == info.index.end()) continue;
+            auto &succ = info.successors[i];
+            if (std::find(succ.begin(), succ.end(), target->second) != succ.end()) continue;
+            succ.push_back(target->second);
+            info.predecessors[target->second].push_back(i);
+        }
+    }
+    info.valid = true;
+    if (n == 0) return info;
+
+    // iterative DFS for the postorder
+    std::vector<bool> seen(n, false);
+    std::vector<std::pair<size_t, size_t>> stack{{0, 0}};
+    seen[0] = true;
+    while (!stack.empty()) {
+        auto &top = stack.back();
+        if (top.second < info.successors[top.first].size()) {
+            auto next = info.successors[top.first][top.second++];
+            if (!seen[next]) {
+                seen[next] = true;
+                stack.emplace_back(next, 0);
+            }
+        } else {
+            info.rpo.push_back(top.first);
+            stack.pop_back();
+        }
+    }
+    std::reverse(info.rpo.begin(), info.rpo.end());
+    for (size_t i = 0; i < info.rpo.size(); ++i) {
+        info.rpo_index[info.rpo[i]] = i;
+    }
+
+    // Cooper, Harvey and Kennedy: iterate the intersection of the processed predecessors to a fixed point
+    info.idom[0] = 0;
+    auto intersect = [&](size_t a, size_t b) {
+        while (a != b) {
+            while (info.rpo_index[a] > info.rpo_index[b]) a = info.idom[a];
+            while (info.rpo_index[b] > info.rpo_index[a]) b = info.idom[b];
+        }
+        return a;
+    };
+    for (auto changed = true; changed;) {
+        changed = false;
+        for (size_t k = 1; k < info.rpo.size(); ++k) {
+            auto node = info.rpo[k];
+            auto dom = CFGInfo::NONE;
+            for (auto p : info.predecessors[node]) {
+                if (info.idom[p] == CFGInfo::NONE) continue;
+                dom = dom == CFGInfo::NONE ? p : intersect(p, dom);
+            }
+            if (dom != info.idom[node]) {
+                info.idom[node] = dom;
+                changed = true;
+            }
+        }
+    }
+
+    // natural loops: a back edge targets a dominator; the body reaches the source without the header
+    info.loops.clear();
+    for (auto tail : info.rpo) {
+        for (auto head : info.successors[tail]) {
+            if (!info.dominates(head, tail)) continue;
+            size_t k = 0;
+            while (k < info.loops.size() && info.loops[k].header != head) ++k;
+            if (k == info.loops.size()) {
+                info.loops.push_back({head, std::vector<bool>(n, false), 1});
+                info.loops[k].body[head] = true;
+            }
+            auto &loop = info.loops[k];
+            std::vector<size_t> work;
+            if (!loop.body[tail]) {
+                loop.body[tail] = true;
+                loop.size++;
+                work.push_back(tail);
+            }
+            while (!work.empty()) {
+                auto m = work.back();
+                work.pop_back();
+                for (auto p : info.predecessors[m]) {
+                    if (!info.reachable(p) || loop.body[p]) continue;
+                    loop.body[p] = true;
+                    loop.size++;
+                    work.push_back(p);
+                }
+            }
+        }
+    }
+    std::sort(info.loops.begin(), info.loops.end(), [](const CFGInfo::Loop &a, const CFGInfo::Loop &b) {
+        return a.size < b.size || (a.size == b.size && a.header > b.header);
+    });
+    // visit outer loops first so that inner headers overwrite them
+    for (auto i = info.loops.rbegin(); i != info.loops.rend(); ++i) {
+        for (size_t m = 0; m < n; ++m) {
+            if (!i->body[m]) continue;
+            info.loop_header[m] = i->header;
+            info.loop_depth[m]++;
+        }
+    }
+    return info;
 }
 
 Function::Function(std::string name, size_t argc) : name(std::move(name)), argc(argc) {
@@ -748,12 +1350,12 @@ Function::Function(std::string name, size_t argc) : name(std::move(name)), argc(
     s8_location.base = get_special(SpecialReg::sp);
 }
 
-std::shared_ptr<MemoryLocation> Function::new_static_mem(size_t size, std::shared_ptr<VirtReg> reg, size_t) {
+std::shared_ptr<MemoryLocation> Function::new_static_mem(size_t size, std::shared_ptr<VirtReg> reg, size_t offset) {
     auto res = std::make_shared<MemoryLocation>();
     res->size = size;
     res->identifier = memory_count++;
     res->status = MemoryLocation::Static;
-    res->offset = -1;
+    res->offset = offset;
     res->base = std::move(reg);
     return res;
 }
@@ -764,15 +1366,18 @@ std::shared_ptr<MemoryLocation> Function::new_memory(size_t size) {
     res->identifier = memory_count++;
     res->status = MemoryLocation::Undetermined;
     res->offset = -1;
-    res->base = get_special(SpecialReg::s8);
+    res->base = get_special(omit_frame_pointer ? SpecialReg::sp : SpecialReg::s8);
     mem_blocks.push_back(res);
     return res;
 }
 
 std::shared_ptr<CFGNode> Function::join(const std::shared_ptr<CFGNode> &x, const std::shared_ptr<CFGNode> &y) {
     auto node = std::make_shared<CFGNode>(this, next_name());
+    // the last block falls through into the new one
     if (blocks.back() != x) x->branch_existing<j>(node);
+    else x->add_edge(node);
     if (blocks.back() != y) y->branch_existing<j>(node);
+    else y->add_edge(node);
     blocks.push_back(node);
     switch_to(node);
     return node;
@@ -786,12 +1391,159 @@ void Function::switch_to(const std::shared_ptr<CFGNode> &target) {
     cursor = target;
 }
 
+void Function::pack() {
+    packed_regs.clear();
+    packed_ids.clear();
+    for (auto &i : blocks) {
+        i->pack();
+    }
+}
+
+uint32_t Function::packed_id(const std::shared_ptr<VirtReg> &reg) {
+    auto root = find_root(reg).get();
+    auto it = packed_ids.find(root);
+    if (it != packed_ids.end()) return it->second;
+    packed_regs.push_back(root);
+    return packed_ids[root] = packed_regs.size() - 1;
+}
+
+unordered_set<std::shared_ptr<VirtReg>> Function::analyze_registers() {
+    unordered_set<std::shared_ptr<VirtReg>> regs;
+    for (auto &i : blocks) {
+        i->lives.clear();
+    }
+    blocks[0]->dfs_collect(regs);
+    register_analyses = Analysis::Liveness | Analysis::Interference;
+    if (regs.empty()) return regs;
+    // phi nodes are united now; keep only the representatives from here on
+    canonicalize();
+    unordered_set<std::shared_ptr<VirtReg>> roots;
+    for (auto &i : regs) {
+        auto root = find_root(i);
+        root->neighbors.clear();
+        roots.insert(root);
+    }
+    pack();
+    blocks[0]->setup_living(roots);
+    unordered_set<std::shared_ptr<VirtReg>> liveness;
+    blocks[0]->generate_web(liveness);
+    return roots;
+}
+
+void Function::invalidate(AnalysisSet analyses) {
+    if (analyses & Analysis::CFG) invalidate_cfg();
+    register_analyses &= ~analyses;
+}
+
+void Function::ensure(AnalysisSet analyses) {
+    if (analyses & Analysis::CFG) cfg();
+    if ((analyses & register_analyses) != (analyses & (Analysis::Liveness | Analysis::Interference))) {
+        analyze_registers();
+    }
+}
+
+std::shared_ptr<Instruction> Function::rematerializable(const std::shared_ptr<VirtReg> &reg) const {
+    std::shared_ptr<Instruction> definition = nullptr;
+    for (auto &i : blocks) {
+        for (auto &j : i->instructions) {
+            auto def = j->def();
+            if (!def || !(*def == *reg)) continue;
+            if (definition) return nullptr; // several definitions coalesced by phi nodes
+            definition = j;
+        }
+    }
+    return definition && definition->rematerialize(reg) ? definition : nullptr;
+}
+
+size_t Function::register_pressure() {
+    auto &info = cfg();
+    size_t pressure = 0;
+    for (size_t b = 0; b < blocks.size(); ++b) {
+        auto &node = *blocks[b];
+        unordered_map<std::shared_ptr<VirtReg>, size_t> birth;
+        for (size_t i = 0; i < node.instructions.size(); ++i) {
+            auto def = node.instructions[i]->def();
+            if (def) birth.insert({def, i});
+        }
+        // +1 at the start of each lifetime, -1 right after its end
+        std::vector<std::pair<size_t, int>> events;
+        for (auto &i : node.lives) {
+            auto live_in = !birth.count(i.first);
+            for (auto p : info.predecessors[b]) {
+                auto &pred = *blocks[p];
+                auto out = pred.lives.find(i.first);
+                if (out != pred.lives.end() && out->second == pred.instructions.size()) live_in = true;
+            }
+            events.emplace_back(live_in ? 0 : birth[i.first], 1);
+            events.emplace_back(i.second + 1, -1);
+        }
+        std::sort(events.begin(), events.end());
+        size_t current = 0;
+        for (auto &i : events) {
+            current += i.second;
+            pressure = std::max(pressure, current);
+        }
+    }
+    return pressure;
+}
+
+void Function::dump_statistics(std::ostream &out) const {
+    out << "{\"name\": ";
+    json_string(out, name);
+    out << ", \"coloring_rounds\": " << statistics.coloring_rounds
+        << ", \"spilled_registers\": " << statistics.spilled_registers
+        << ", \"rematerialized_registers\": " << statistics.rematerialized_registers
+        << ", \"rematerialized_instructions\": " << statistics.rematerialized_instructions
+        << ", \"spill_loads\": " << statistics.spill_loads
+        << ", \"spill_stores\": " << statistics.spill_stores
+        << ", \"interference_nodes\": " << statistics.interference_nodes
+        << ", \"interference_edges\": " << statistics.interference_edges
+        << ", \"max_pressure\": " << statistics.max_pressure
+        << ", \"overlap_saves\": [";
+    for (size_t i = 0; i < statistics.overlap_saves.size(); ++i) {
+        out << (i ? ", " : "") << statistics.overlap_saves[i];
+    }
+    out << "], \"stack_size\": " << statistics.stack_size << ", \"phase_times_us\": {";
+    for (size_t i = 0; i < statistics.phase_times.size(); ++i) {
+        out << (i ? ", " : "");
+        json_string(out, statistics.phase_times[i].first);
+        out << ": " << std::chrono::duration<double, std::micro>(statistics.phase_times[i].second).count();
+    }
+    out << "}}";
+}
+
+size_t Function::instruction_count() const {
+    size_t count = 0;
+    for (auto &i : blocks) {
+        count += i->instructions.size();
+    }
+    return count;
+}
+
 void Function::scan_overlap() {
+    VMIPS_TRACE_SCOPE("scan_overlap", name);
     unordered_set<std::shared_ptr<VirtReg>> liveness;
     blocks[0]->scan_overlap(liveness);
+    statistics.overlap_saves.clear();
+    for (auto &i : blocks) {
+        for (auto &j : i->instructions) {
+            if (j->opcode == Opcode::callfunc) {
+                statistics.overlap_saves.push_back(static_cast<callfunc *>(j.get())->overlap_temp.size());
+            }
+        }
+    }
 }
 
 void Function::handle_alloca() {
+    VMIPS_TRACE_SCOPE("handle_alloca", name);
+    leaf = !has_sub && save_regs == 0 && mem_blocks.empty() && !needs_gp();
+    if (leaf) {
+        // nothing to save and nothing to address: arguments are read directly off the caller's frame
+        stack_size = 0;
+        allocated = true;
+        return;
+    }
+
     stack_size = 4 * sub_argc + EXTRA_STACK + 4 * save_regs; // sub args | PIC section | saved registers
 
     // ra and pic
@@ -805,9 +1557,11 @@ void Function::handle_alloca() {
     pic_location.offset = stack_size;
     stack_size += pic_location.size;
 
-    s8_location.status = MemoryLocation::Assigned;
-    s8_location.offset = stack_size;
-    stack_size += s8_location.size;
+    if (!omit_frame_pointer) {
+        s8_location.status = MemoryLocation::Assigned;
+        s8_location.offset = stack_size;
+        stack_size += s8_location.size;
+    }
 
     stack_size += (-stack_size & MASK);
 
@@ -819,12 +1573,472 @@ void Function::handle_alloca() {
         }
     }
     stack_size += (-stack_size & MASK); // align
+    statistics.stack_size = stack_size;
     allocated = true;
 }
 
+std::shared_ptr<VirtReg> Function::frame_register() const {
+    return get_special(omit_frame_pointer || leaf ? SpecialReg::sp : SpecialReg::s8);
+}
+
+size_t Function::register_count() const {
+    return omit_frame_pointer ? REG_NUM + 1 : REG_NUM;
+}
+
+bool Function::needs_gp() const {
+    if (has_sub) return true;
+    for (auto &i : blocks) {
+        for (auto &j : i->instructions) {
+            if (j->opcode == Opcode::la) return true;
+        }
+    }
+    return false;
+}
+
 void Function::add_ret() {
-    static auto ending = std::make_shared<text>(std::string{"j "} + ".L" + this->name + "_epilogue");
-    cursor->instructions.push_back(ending);
+    cursor->instructions.push_back(return_jump());
+}
+
+std::shared_ptr<Instruction> Function::return_jump() const {
+    return std::make_shared<text>("j .L" + name + "_epilogue", true);
+}
+
+bool Function::is_return_jump(Instruction &instr) const {
+    return instr.opcode == Opcode::text && instr.name() == "j .L" + name + "_epilogue";
+}
+
+/*!
+ * Check whether an instruction loads or stores memory.
+ * @param instr the instruction.
+ * @return check result.
+ */
+static bool accesses_memory(const Instruction &instr) {
+    switch (instr.opcode) {
+        case Opcode::lw:
+        case Opcode::sw:
+        case Opcode::array_load:
+        case Opcode::array_store:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*!
+ * Check whether an instruction can be moved after another one.
+ * @param moved instruction to be moved.
+ * @param other instruction to be crossed.
+ * @return check result.
+ */
+static bool independent(const Instruction &moved, const Instruction &other) {
+    auto def = moved.def();
+    if (def && other.used_register(def)) return false;
+    auto other_def = other.def();
+    if (other_def && moved.used_register(other_def)) return false;
+    // loads may pass loads, everything else keeps the memory order
+    return !(accesses_memory(moved) && accesses_memory(other) && (!def || !other_def));
+}
+
+/*!
+ * Check whether an instruction reads or writes the HI/LO registers.
+ * @param instr the instruction.
+ * @return check result.
+ */
+static bool uses_hilo(const Instruction &instr) {
+    switch (instr.opcode) {
+        case Opcode::div:
+        case Opcode::divu:
+        case Opcode::mult:
+        case Opcode::multu:
+        case Opcode::mul:
+        case Opcode::mflo:
+        case Opcode::mfhi:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*!
+ * Estimated cycles before the result of an instruction can be used.
+ * @param instr the instruction.
+ * @return latency in cycles.
+ */
+static size_t latency(const Instruction &instr) {
+    switch (instr.opcode) {
+        case Opcode::lw:
+        case Opcode::array_load:
+            return 2; // load delay
+        case Opcode::mul:
+        case Opcode::mult:
+        case Opcode::multu:
+            return 3;
+        case Opcode::div:
+        case Opcode::divu:
+            return 20;
+        default:
+            return 1;
+    }
+}
+
+void CFGNode::schedule() {
+    std::vector<std::shared_ptr<Instruction>> result;
+    std::vector<std::shared_ptr<Instruction>> segment, phis;
+    auto flush = [&]() {
+        auto n = segment.size();
+        std::vector<std::vector<size_t>> successors(n);
+        std::vector<size_t> pending(n, 0), priority(n, 0), ready(n, 0);
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t j = i + 1; j < n; ++j) {
+                if (!independent(*segment[i], *segment[j]) || (uses_hilo(*segment[i]) && uses_hilo(*segment[j]))) {
+                    successors[i].push_back(j);
+                    pending[j]++;
+                }
+            }
+        }
+        // critical path to the end of the segment
+        for (size_t i = n; i-- > 0;) {
+            priority[i] = latency(*segment[i]);
+            for (auto j : successors[i]) {
+                priority[i] = std::max(priority[i], latency(*segment[i]) + priority[j]);
+            }
+        }
+        std::vector<bool> done(n, false);
+        size_t cycle = 0;
+        for (size_t step = 0; step < n; ++step) {
+            size_t pick = n;
+            for (size_t i = 0; i < n; ++i) {
+                if (done[i] || pending[i]) continue;
+                if (pick == n) {
+                    pick = i;
+                    continue;
+                }
+                // prefer what can issue without a stall, then the longest path, then the original order
+                auto stall_i = ready[i] > cycle, stall_pick = ready[pick] > cycle;
+                if (stall_i != stall_pick) {
+                    if (!stall_i) pick = i;
+                } else if (stall_i && ready[i] != ready[pick]) {
+                    if (ready[i] < ready[pick]) pick = i;
+                } else if (priority[i] > priority[pick]) {
+                    pick = i;
+                }
+            }
+            cycle = std::max(cycle, ready[pick]);
+            done[pick] = true;
+            result.push_back(segment[pick]);
+            for (auto j : successors[pick]) {
+                pending[j]--;
+                ready[j] = std::max(ready[j], cycle + latency(*segment[pick]));
+            }
+            cycle++;
+        }
+        result.insert(result.end(), phis.begin(), phis.end());
+        segment.clear();
+        phis.clear();
+    };
+    for (auto &i : instructions) {
+        if (i->opcode == Opcode::phi) {
+            phis.push_back(i);
+        } else if (i->has_delay_slot() || i->opcode == Opcode::callfunc || i->opcode == Opcode::text) {
+            flush();
+            result.push_back(i);
+        } else {
+            segment.push_back(i);
+        }
+    }
+    flush();
+    instructions = result;
+}
+
+void Function::unite_phis() {
+    for (auto &i : blocks) {
+        for (auto &j : i->instructions) {
+            if (j->opcode == Opcode::phi) {
+                auto trial = static_cast<phi *>(j.get());
+                unite(trial->op0, trial->op1);
+            }
+        }
+    }
+}
+
+void Function::canonicalize() {
+    for (auto &i : blocks) {
+        for (auto &j : i->instructions) {
+            j->canonicalize();
+        }
+    }
+}
+
+void Function::schedule() {
+    if (!allocated) {
+        unite_phis();
+        canonicalize();
+    }
+    for (auto &i : blocks) {
+        i->schedule();
+    }
+}
+
+void Function::fill_delay_slots() {
+    noreorder = true;
+    for (auto &node : blocks) {
+        auto &instr = node->instructions;
+        for (size_t b = 0; b < instr.size(); ++b) {
+            if (!instr[b]->has_delay_slot() || instr[b]->delay_slot) continue;
+            for (size_t c = b; c-- > 0;) {
+                auto candidate = instr[c].get();
+                if (candidate->has_delay_slot() || candidate->opcode == Opcode::callfunc ||
+                    candidate->opcode == Opcode::text) {
+                    break;
+                }
+                if (!candidate->fits_delay_slot()) continue;
+                auto movable = true;
+                for (size_t k = c + 1; k <= b && movable; ++k) {
+                    movable = independent(*candidate, *instr[k]);
+                }
+                if (movable) {
+                    instr[b]->delay_slot = instr[c];
+                    instr.erase(instr.begin() + c);
+                    --b;
+                    break;
+                }
+            }
+        }
+    }
+    // an unconditional jump can execute the first instruction of its target and land after it
+    for (auto &node : blocks) {
+        for (auto &i : node->instructions) {
+            if (i->opcode != Opcode::b && i->opcode != Opcode::j) continue;
+            auto jump = static_cast<Unconditional *>(i.get());
+            if (jump->delay_slot) continue;
+            auto target = jump->block.lock();
+            for (auto &j : target->instructions) {
+                if (j->opcode == Opcode::phi) continue;
+                if (j->fits_delay_slot()) {
+                    jump->delay_slot = j;
+                    jump->skip_first = true;
+                    target->split_first = true;
+                }
+                break;
+            }
+        }
+    }
+}
+
+/*!
+ * Check whether an instruction is a conditional branch.
+ * @param instr the instruction.
+ * @return check result.
+ */
+static bool conditional(const Instruction &instr) {
+    switch (instr.opcode) {
+        case Opcode::beq:
+        case Opcode::bne:
+        case Opcode::beqz:
+        case Opcode::bnez:
+        case Opcode::blez:
+        case Opcode::bgtz:
+        case Opcode::bltz:
+        case Opcode::bgez:
+        case Opcode::ble:
+        case Opcode::bge:
+        case Opcode::blt:
+        case Opcode::bgt:
+            return true;
+        default:
+            return false;
+    }
+}
+
+template<class T>
+static std::shared_ptr<Instruction> zero_branch(const Instruction &instr, const std::shared_ptr<CFGNode> &target) {
+    return std::make_shared<T>(target, static_cast<const ZeroBranch &>(instr).target);
+}
+
+template<class T>
+static std::shared_ptr<Instruction> cmp_branch(const Instruction &instr, const std::shared_ptr<CFGNode> &target) {
+    auto &branch = static_cast<const CmpBranch &>(instr);
+    return std::make_shared<T>(target, branch.lhs, branch.rhs);
+}
+
+/*!
+ * Build the branch that is taken exactly when a conditional branch falls through.
+ * @param instr the conditional branch.
+ * @param target target of the new branch.
+ * @return the inverted branch.
+ */
+static std::shared_ptr<Instruction> inverted(const Instruction &instr, const std::shared_ptr<CFGNode> &target) {
+    switch (instr.opcode) {
+        case Opcode::beq:
+            return cmp_branch<bne>(instr, target);
+        case Opcode::bne:
+            return cmp_branch<beq>(instr, target);
+        case Opcode::ble:
+            return cmp_branch<bgt>(instr, target);
+        case Opcode::bgt:
+            return cmp_branch<ble>(instr, target);
+        case Opcode::bge:
+            return cmp_branch<blt>(instr, target);
+        case Opcode::blt:
+            return cmp_branch<bge>(instr, target);
+        case Opcode::beqz:
+            return zero_branch<bnez>(instr, target);
+        case Opcode::bnez:
+            return zero_branch<beqz>(instr, target);
+        case Opcode::blez:
+            return zero_branch<bgtz>(instr, target);
+        case Opcode::bgtz:
+            return zero_branch<blez>(instr, target);
+        case Opcode::bltz:
+            return zero_branch<bgez>(instr, target);
+        case Opcode::bgez:
+            return zero_branch<bltz>(instr, target);
+        default:
+            return nullptr;
+    }
+}
+
+void Function::layout() {
+    // rotate loops: a node that starts with its exit test and jumps back to itself keeps the test as a
+    // header and moves the rest into a body that repeats the inverted test at the bottom
+    for (size_t n = 0; n < blocks.size(); ++n) {
+        auto node = blocks[n];
+        auto &instr = node->instructions;
+        if (instr.empty() || (instr.back()->opcode != Opcode::j && instr.back()->opcode != Opcode::b) ||
+            instr.back()->branch() != node) {
+            continue;
+        }
+        size_t test = 0;
+        while (test < instr.size() && instr[test]->opcode == Opcode::phi) ++test;
+        if (test + 1 >= instr.size() || !conditional(*instr[test])) continue;
+        auto exit = instr[test]->branch();
+        size_t branches = 0;
+        for (auto &i : instr) {
+            if (i->branch()) branches++;
+        }
+        // edges that are not explained by the instructions (such as a stale fall-through) are kept as is
+        if (exit == node || branches != node->out_edges.size()) continue;
+        auto body = std::make_shared<CFGNode>(this, next_name());
+        body->frequency = node->frequency;
+        body->instructions.assign(instr.begin() + test + 1, instr.end() - 1);
+        body->instructions.push_back(inverted(*instr[test], body));
+        body->instructions.push_back(std::make_shared<vmips::j>(exit));
+        instr.resize(test + 1);
+        node->out_edges.clear();
+        node->edge_counts.clear();
+        node->add_edge(exit);
+        node->add_edge(body);
+        for (auto &i : body->instructions) {
+            auto target = i->branch();
+            if (target) body->add_edge(target);
+        }
+        blocks.insert(blocks.begin() + n + 1, body);
+        ++n;
+    }
+
+    estimate_frequency();
+    auto &info = cfg();
+    auto size = blocks.size();
+    auto falls_into = [&](size_t from, size_t to) {
+        auto &instr = blocks[from]->instructions;
+        if (!instr.empty()) {
+            auto &last = instr.back();
+            if (last->opcode == Opcode::j || last->opcode == Opcode::b) return last->branch() == blocks[to];
+            if (conditional(*last) && last->branch() == blocks[to]) return true;
+            if (last->terminates()) return false;
+        }
+        return to == from + 1;
+    };
+
+    // weighted edges that can become fall-throughs; ties keep the current fall-through
+    struct Edge {
+        size_t weight, from, to;
+    };
+    std::vector<Edge> edges;
+    for (size_t from = 0; from < size; ++from) {
+        auto &node = *blocks[from];
+        for (size_t k = 0; k < node.out_edges.size(); ++k) {
+            auto to = info.index.find(node.out_edges[k].lock().get())->second;
+            if (to == from || to == 0 || !falls_into(from, to)) continue;
+            auto weight = k < node.edge_counts.size() ? node.edge_counts[k]
+                                                      : std::min(node.frequency, blocks[to]->frequency);
+            edges.push_back({weight * 2 + (to == from + 1), from, to});
+        }
+    }
+    std::stable_sort(edges.begin(), edges.end(), [](const Edge &a, const Edge &b) {
+        return a.weight > b.weight;
+    });
+
+    // Pettis-Hansen: join the chain ending at the source with the chain starting at the target
+    std::vector<std::vector<size_t>> chains(size);
+    std::vector<size_t> chain(size);
+    std::vector<size_t> priority(size, 0);
+    for (size_t n = 0; n < size; ++n) {
+        chains[n].push_back(n);
+        chain[n] = n;
+    }
+    for (auto &e : edges) {
+        auto a = chain[e.from], b = chain[e.to];
+        if (a == b || chains[a].back() != e.from || chains[b].front() != e.to) continue;
+        for (auto n : chains[b]) {
+            chains[a].push_back(n);
+            chain[n] = a;
+        }
+        chains[b].clear();
+    }
+    for (auto &e : edges) {
+        if (chain[e.from] != chain[e.to]) priority[e.to] = std::max(priority[e.to], e.weight);
+    }
+    // the entry chain comes first, then the other chains by the heaviest edge entering them
+    std::vector<size_t> heads;
+    for (size_t n = 1; n < size; ++n) {
+        if (!chains[n].empty()) heads.push_back(n);
+    }
+    std::stable_sort(heads.begin(), heads.end(), [&](size_t a, size_t b) {
+        return priority[chains[a].front()] > priority[chains[b].front()];
+    });
+    heads.insert(heads.begin(), chain[0]);
+
+    std::vector<std::shared_ptr<CFGNode>> order;
+    std::vector<size_t> original;
+    for (auto h : heads) {
+        for (auto n : chains[h]) {
+            order.push_back(blocks[n]);
+            original.push_back(n);
+        }
+    }
+
+    // fix up the ends of the nodes for the new order
+    for (size_t n = 0; n < order.size(); ++n) {
+        auto &node = order[n];
+        auto &instr = node->instructions;
+        auto next = n + 1 < order.size() ? order[n + 1] : nullptr;
+        auto fall = original[n] + 1 < size ? blocks[original[n] + 1] : nullptr;
+        auto last = instr.empty() ? nullptr : instr.back();
+        if (last && (last->opcode == Opcode::j || last->opcode == Opcode::b)) {
+            if (last->branch() == next) instr.pop_back();
+            continue;
+        }
+        if (last && is_return_jump(*last)) {
+            if (!next) instr.pop_back();
+            continue;
+        }
+        if ((last && last->terminates()) || fall == next) continue;
+        if (last && fall && conditional(*last) && last->branch() == next) {
+            instr.back() = inverted(*last, fall);
+        } else if (fall) {
+            instr.push_back(std::make_shared<vmips::j>(fall));
+            auto linked = false;
+            for (auto &i : node->out_edges) {
+                linked |= i.lock() == fall;
+            }
+            if (!linked) node->add_edge(fall);
+        } else {
+            instr.push_back(return_jump());
+        }
+    }
+    blocks = order;
+    invalidate_cfg();
 }
 
 void Function::assign_special(SpecialReg special, std::shared_ptr<VirtReg> reg) {
@@ -840,7 +2054,7 @@ std::shared_ptr<CFGNode> Function::new_section() {
     if (cursor != blocks.back()) {
         cursor->branch_existing<j>(node);
     } else {
-        cursor->out_edges.push_back(node);
+        cursor->add_edge(node);
     }
     this->blocks.push_back(node);
     switch_to(node);
@@ -859,13 +2073,18 @@ std::shared_ptr<MemoryLocation> Function::argument(size_t offset) {
 
 
 phi::phi(std::shared_ptr<VirtReg> op0, std::shared_ptr<VirtReg> op1) : op0(std::move(op0)), op1(std::move(op1)) {
-
+    opcode = Opcode::phi;
 }
 
 void phi::output(std::ostream &out) const {
     out << "# phi node";
 }
 
+void phi::canonicalize() {
+    canonical(op0);
+    canonical(op1);
+}
+
 void phi::replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<VirtReg> &target) {
     if (*op0 == *reg) op0 = target;
     if (*op1 == *reg) op1 = target;
@@ -873,7 +2092,19 @@ void phi::replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<Vir
 
 void callfunc::output(std::ostream &out) const {
     auto f = function.lock();
-    if (scanned) {
+    if (scanned && tail) {
+        // the incoming argument slots are large enough, and nothing is left to save
+        out << "\t# tail calling " << f->name << std::endl;
+        for (size_t i = 0; i < call_with.size(); ++i) {
+            out << "\tsw " << *call_with[i] << ", " << i * 4 + current->stack_size << "("
+                << *current->frame_register() << ")" << std::endl;
+        }
+        for (size_t i = 0; i < std::min(call_with.size(), (size_t) 4); ++i) {
+            out << "\tlw $a" << i << ", " << i * 4 + current->stack_size << "(" << *current->frame_register() << ")"
+                << std::endl;
+        }
+        current->output_epilogue(out, "j " + f->name);
+    } else if (scanned) {
 
         // save all overlaps
         out << "\t# start calling " << f->name << std::endl;
@@ -887,16 +2118,24 @@ void callfunc::output(std::ostream &out) const {
 
         // save all arguments to stack
         for (size_t i = 0; i < call_with.size(); ++i) {
-            out << "\tsw " << *call_with[i] << ", " << i * 4 << "($s8)" << std::endl;
+            out << "\tsw " << *call_with[i] << ", " << i * 4 << "(" << *current->frame_register() << ")" << std::endl;
         }
 
         // load first several arguments into register
-        for (size_t i = 0; i < std::min(call_with.size(), (size_t) 4); ++i) {
-            out << "\tlw $a" << i << ", " << i * 4 << "($s8)" << std::endl;
+        auto loaded = std::min(call_with.size(), (size_t) 4);
+        auto slot = current->noreorder && loaded > 0; // the last load goes into the delay slot
+        for (size_t i = 0; i < loaded - slot; ++i) {
+            out << "\tlw $a" << i << ", " << i * 4 << "(" << *current->frame_register() << ")" << std::endl;
         }
 
         // call function
         out << "\tjal " << function.lock()->name << std::endl;
+        if (slot) {
+            out << "\tlw $a" << loaded - 1 << ", " << (loaded - 1) * 4 << "(" << *current->frame_register() << ")"
+                << std::endl;
+        } else if (current->noreorder) {
+            out << "\tnop" << std::endl;
+        }
 
         // recover overlaps
         for (auto &i : overlap_temp) {
@@ -913,7 +2152,7 @@ void callfunc::output(std::ostream &out) const {
         if (def()) {
             out << "\t" << *def() << " = call " << function.lock()->name << "(";
         } else {
-            out << "\tcall " << f->name << "(";
+            out << "\t" << (tail ? "tail " : "") << "call " << f->name << "(";
         }
         for (size_t i = 0; i < call_with.size(); ++i) {
             out << *call_with[i];
@@ -927,7 +2166,7 @@ void callfunc::output(std::ostream &out) const {
 }
 
 void callfunc::replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<VirtReg> &target) {
-    if (*ret == *reg) ret = target;
+    if (ret && *ret == *reg) ret = target;
     for (auto &i : call_with) {
         if (*i == *reg) {
             i = target;
@@ -937,7 +2176,16 @@ void callfunc::replace(const std::shared_ptr<VirtReg> &reg, const std::shared_pt
 
 callfunc::callfunc(std::shared_ptr<VirtReg> ret, Function *current, std::weak_ptr<Function> function,
                    std::vector<std::shared_ptr<VirtReg>> call_with)
-        : ret(std::move(ret)), function(std::move(function)), call_with(std::move(call_with)), current(current) {}
+        : ret(std::move(ret)), function(std::move(function)), call_with(std::move(call_with)), current(current) {
+    opcode = Opcode::callfunc;
+}
+
+void callfunc::canonicalize() {
+    canonical(ret);
+    for (auto &i : call_with) {
+        canonical(i);
+    }
+}
 
 void callfunc::collect_register(unordered_set<std::shared_ptr<VirtReg>> &set) const {
     if (ret && !ret->allocated) set.insert(ret);
@@ -962,9 +2210,21 @@ std::shared_ptr<VirtReg> jr::def() const {
     return nullptr;
 }
 
-jr::jr(std::shared_ptr<VirtReg> reg) : Unary(std::move(reg)) {}
+bool jr::has_delay_slot() const {
+    return true;
+}
+
+jr::jr(std::shared_ptr<VirtReg> reg) : Unary(std::move(reg)) {
+    opcode = Opcode::jr;
+}
+
+text::text(std::string context, bool jump) : Instruction(), context(std::move(context)), jump(jump) {
+    opcode = Opcode::text;
+}
 
-text::text(std::string context) : Instruction(), context(std::move(context)) {}
+bool text::has_delay_slot() const {
+    return jump;
+}
 
 const char *text::name() const {
     return context.data();
@@ -1000,6 +2260,7 @@ std::shared_ptr<Function> Module::create_function(std::string fname, size_t argc
 }
 
 void Module::output(std::ostream &out) const {
+    VMIPS_TRACE_SCOPE("output", name);
     out << "# Module : " << name << std::endl;
     for (auto &i : externs) {
         out << "\t.extern " << i->name << std::endl;
@@ -1012,13 +2273,51 @@ void Module::output(std::ostream &out) const {
     }
 }
 
+void Module::dump_statistics(std::ostream &out) const {
+    out << "[";
+    for (size_t i = 0; i < functions.size(); ++i) {
+        out << (i ? ",\n " : "");
+        functions[i]->dump_statistics(out);
+    }
+    out << "]" << std::endl;
+}
+
+std::vector<std::shared_ptr<Function>> Module::bottom_up_order() const {
+    std::vector<std::shared_ptr<Function>> order;
+    unordered_map<Function *, std::shared_ptr<Function>> defined;
+    unordered_set<Function *> visited;
+    for (auto &i : functions) {
+        defined[i.get()] = i;
+    }
+    // post-order DFS; a callee still on the stack (recursion) keeps the conservative clobber mask
+    std::function<void(const std::shared_ptr<Function> &)> visit = [&](const std::shared_ptr<Function> &f) {
+        if (visited.count(f.get())) return;
+        visited.insert(f.get());
+        for (auto &i : f->blocks) {
+            for (auto &j : i->instructions) {
+                if (j->opcode != Opcode::callfunc) continue;
+                auto call = static_cast<callfunc *>(j.get());
+                auto callee = call->function.lock();
+                if (defined.count(callee.get())) visit(defined[callee.get()]);
+            }
+        }
+        order.push_back(f);
+    };
+    for (auto &i : functions) {
+        visit(i);
+    }
+    return order;
+}
+
 std::shared_ptr<Function> Module::create_extern(std::string fname, size_t argc) {
     externs.push_back(std::make_shared<Function>(std::move(fname), argc));
     return externs.back();
 }
 
 
-la::la(std::shared_ptr<VirtReg> reg, std::shared_ptr<Data> data) : Unary(std::move(reg)), data(std::move(data)) {}
+la::la(std::shared_ptr<VirtReg> reg, std::shared_ptr<Data> data) : Unary(std::move(reg)), data(std::move(data)) {
+    opcode = Opcode::la;
+}
 
 const char *la::name() const {
     return "la";
@@ -1028,9 +2327,17 @@ void la::output(std::ostream &out) const {
     out << name() << " " << *this->target << ", " << data->name;
 }
 
+std::shared_ptr<Instruction> la::rematerialize(std::shared_ptr<VirtReg> target) const {
+    return std::make_shared<la>(std::move(target), data);
+}
+
 address::address(std::shared_ptr<VirtReg> reg, std::shared_ptr<MemoryLocation> data) : Unary(std::move(reg)),
                                                                                        data(std::move(data)) {
+    opcode = Opcode::address;
+}
 
+std::shared_ptr<Instruction> address::rematerialize(std::shared_ptr<VirtReg> target) const {
+    return std::make_shared<address>(std::move(target), data);
 }
 
 void address::output(std::ostream &out) const {
@@ -1055,11 +2362,20 @@ bool ArrayAccess::used_register(const std::shared_ptr<VirtReg> &reg) const {
     return Memory::used_register(reg) || *reg == *offset;
 }
 
+bool ArrayAccess::fits_delay_slot() const {
+    return false;
+}
+
 void ArrayAccess::replace(const std::shared_ptr<VirtReg> &reg, const std::shared_ptr<VirtReg> &target) {
     Memory::replace(reg, target);
     if (*reg == *offset) offset = target;
 }
 
+void ArrayAccess::canonicalize() {
+    Memory::canonicalize();
+    canonical(offset);
+}
+
 void ArrayAccess::output(std::ostream &out) const {
     if (location->status == MemoryLocation::Undetermined) {
         out << name() << " " << *target << ", " << *location << ", shifted by " << *offset;
@@ -1075,7 +2391,7 @@ void ArrayAccess::output(std::ostream &out) const {
 array_load::array_load(std::shared_ptr<VirtReg> target, std::shared_ptr<VirtReg> offset,
                        std::shared_ptr<MemoryLocation> location) : ArrayAccess(std::move(target), std::move(offset),
                                                                                std::move(location)) {
-
+    opcode = Opcode::array_load;
 }
 
 const char *array_load::name() const {
@@ -1085,7 +2401,7 @@ const char *array_load::name() const {
 array_store::array_store(std::shared_ptr<VirtReg> target, std::shared_ptr<VirtReg> offset,
                          std::shared_ptr<MemoryLocation> location) : ArrayAccess(std::move(target), std::move(offset),
                                                                                  std::move(location)) {
-
+    opcode = Opcode::array_store;
 }
 
 const char *array_store::name() const {
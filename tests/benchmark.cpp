@@ -0,0 +1,408 @@
+//
+// Code quality benchmark: runs kernels built with the Function API in the simulator and prints
+// one JSON object per kernel and code generation mode.
+//
+#include <vcfg/virtual_mips.h>
+#include <vsim/simulator.h>
+#include <iostream>
+#include <sstream>
+#include <cstring>
+using namespace vmips;
+
+/*!
+ * The Mode struct. Code generation settings applied to every function of a kernel.
+ */
+struct Mode {
+    const char *name;
+    bool noreorder;
+    bool omit_frame_pointer;
+    Scheduling scheduling;
+    bool reorder_blocks;
+    bool profile;
+    bool optimize;
+    size_t unroll;
+};
+
+/*!
+ * The Kernel struct. A benchmark program.
+ */
+struct Kernel {
+    const char *name;
+    std::function<void(Module &, const Mode &)> build;
+    const char *entry;
+    std::vector<int32_t> args;
+    int32_t expected;
+};
+
+/*!
+ * Create a function with the settings of a mode. The settings must be known before building the body,
+ * since memory regions pick their base register on creation.
+ */
+static std::shared_ptr<Function> create(Module &module, const Mode &mode, std::string name, size_t argc) {
+    auto f = module.create_function(std::move(name), argc);
+    f->noreorder = mode.noreorder;
+    f->omit_frame_pointer = mode.omit_frame_pointer;
+    f->scheduling = mode.scheduling;
+    f->reorder_blocks = mode.reorder_blocks;
+    f->optimize = mode.optimize;
+    f->unroll_factor = mode.unroll;
+    return f;
+}
+
+static void fibonacci(Module &module, const Mode &mode) {
+    auto f = create(module, mode, "fibonacci", 1);
+    auto one = f->append<addi>(get_special(SpecialReg::zero), 1);
+    auto br = f->branch<ble>(get_special(SpecialReg::a0), one);
+    auto m = f->append<addi>(get_special(SpecialReg::a0), -1);
+    auto n = f->append<addi>(get_special(SpecialReg::a0), -2);
+    auto res0 = f->call(f, m);
+    auto res1 = f->call(f, n);
+    f->assign_special(SpecialReg::v0, f->append<add>(res0, res1));
+    f->add_ret();
+    f->switch_to(br.second);
+    f->assign_special(SpecialReg::v0, 1);
+}
+
+static void prefix_sum(Module &module, const Mode &mode) {
+    auto f = create(module, mode, "sum", 1);
+    auto acc = f->append<li>(0);
+    auto current = f->append<move>(get_special(SpecialReg::a0));
+    auto body = f->new_section();
+    auto after = f->new_section_branch<beqz>(current);
+    f->switch_to(body);
+    auto added = f->append<add>(acc, current);
+    auto updated = f->append<addi>(current, -1);
+    f->add_phi(acc, added);
+    f->add_phi(updated, current);
+    f->branch_existing<j>(body);
+    f->switch_to(after);
+    f->assign_special(SpecialReg::v0, acc);
+}
+
+/*!
+ * Fill a stack array with squares, then sum it with indexed loads.
+ */
+static void array_reduce(Module &module, const Mode &mode) {
+    auto f = create(module, mode, "reduce", 1);
+    auto array = f->new_memory(4 * 64);
+    auto n = f->append<move>(get_special(SpecialReg::a0));
+    auto i = f->append<li>(0);
+    auto fill = f->new_section();
+    auto summing = f->new_section_branch<beq>(i, n);
+    f->switch_to(fill);
+    auto square = f->append<mul>(i, i);
+    f->append_void<array_store>(square, i, array);
+    auto next = f->append<addi>(i, 1);
+    f->add_phi(i, next);
+    f->branch_existing<j>(fill);
+
+    f->switch_to(summing);
+    auto acc = f->append<li>(0);
+    auto k = f->append<li>(0);
+    auto loop = f->new_section();
+    auto after = f->new_section_branch<beq>(k, n);
+    f->switch_to(loop);
+    auto value = f->append<array_load>(k, array);
+    auto added = f->append<add>(acc, value);
+    auto step = f->append<addi>(k, 1);
+    f->add_phi(acc, added);
+    f->add_phi(k, step);
+    f->branch_existing<j>(loop);
+    f->switch_to(after);
+    f->assign_special(SpecialReg::v0, acc);
+}
+
+/*!
+ * A loop calling a chain of eight functions, each adding its depth to the result of the next one.
+ */
+static void call_chain(Module &module, const Mode &mode) {
+    auto callee = create(module, mode, "link_0", 1);
+    callee->assign_special(SpecialReg::v0, callee->append<addi>(get_special(SpecialReg::a0), 1));
+    for (auto depth = 1; depth < 8; ++depth) {
+        auto f = create(module, mode, "link_" + std::to_string(depth), 1);
+        auto x = f->append<move>(get_special(SpecialReg::a0));
+        auto res = f->call(callee, f->append<addi>(x, depth));
+        f->assign_special(SpecialReg::v0, f->append<add>(res, x));
+        callee = f;
+    }
+    auto f = create(module, mode, "chain", 1);
+    auto acc = f->append<li>(0);
+    auto current = f->append<move>(get_special(SpecialReg::a0));
+    auto body = f->new_section();
+    auto after = f->new_section_branch<beqz>(current);
+    f->switch_to(body);
+    auto added = f->append<add>(acc, f->call(callee, current));
+    auto updated = f->append<addi>(current, -1);
+    f->add_phi(acc, added);
+    f->add_phi(updated, current);
+    f->branch_existing<j>(body);
+    f->switch_to(after);
+    f->assign_special(SpecialReg::v0, acc);
+}
+
+/*!
+ * NUM simultaneously living values (the MANY_REGS shape of the draft tests).
+ */
+static std::function<void(Module &, const Mode &)> many_regs(int num) {
+    return [num](Module &module, const Mode &mode) {
+        auto f = create(module, mode, "registers", 1);
+        std::vector<std::shared_ptr<VirtReg>> regs;
+        for (auto i = 0; i < num; ++i) {
+            regs.emplace_back(f->append<addi>(get_special(SpecialReg::a0), i));
+        }
+        auto res = f->append<li>(0);
+        for (auto &i : regs) {
+            auto k = f->append<add>(res, i);
+            f->add_phi(res, k);
+        }
+        f->assign_special(SpecialReg::v0, res);
+    };
+}
+
+/*!
+ * NUM simultaneously living constants, which can be recomputed instead of spilled.
+ */
+static std::function<void(Module &, const Mode &)> many_constants(int num) {
+    return [num](Module &module, const Mode &mode) {
+        auto f = create(module, mode, "constants", 1);
+        std::vector<std::shared_ptr<VirtReg>> regs;
+        for (auto i = 0; i < num; ++i) {
+            regs.emplace_back(f->append<li>(i * 7));
+        }
+        auto res = f->append<move>(get_special(SpecialReg::a0));
+        for (auto &i : regs) {
+            auto k = f->append<add>(res, i);
+            f->add_phi(res, k);
+        }
+        f->assign_special(SpecialReg::v0, res);
+    };
+}
+
+/*!
+ * A loop recomputing the same expressions and reloading the same argument, as naive builder code does.
+ */
+static void expressions(Module &module, const Mode &mode) {
+    auto f = create(module, mode, "expressions", 6);
+    auto p = f->append<move>(get_special(SpecialReg::a1));
+    auto q = f->append<move>(get_special(SpecialReg::a2));
+    auto acc = f->append<li>(0);
+    auto current = f->append<move>(get_special(SpecialReg::a0));
+    auto body = f->new_section();
+    auto after = f->new_section_branch<beqz>(current);
+    f->switch_to(body);
+    auto square = f->append<mul>(f->append<add>(p, q), f->append<add>(q, p));
+    auto loaded = f->append<add>(f->append<lw>(f->argument(4)), f->append<lw>(f->argument(4)));
+    auto added = f->append<add>(acc, f->append<add>(square, loaded));
+    auto updated = f->append<addi>(current, -1);
+    f->add_phi(acc, added);
+    f->add_phi(updated, current);
+    f->branch_existing<j>(body);
+    f->switch_to(after);
+    auto last = f->append<add>(f->append<add>(p, q), f->append<lw>(f->argument(5)));
+    f->assign_special(SpecialReg::v0, f->append<add>(acc, last));
+}
+
+/*!
+ * A hashing loop multiplying and dividing by constants: signed remainder, unsigned quotient and the signed
+ * quotient of a negative value by a power of two.
+ */
+static void hashing(Module &module, const Mode &mode) {
+    auto f = create(module, mode, "hash", 1);
+    auto h = f->append<li>(7);
+    auto acc = f->append<li>(0);
+    auto current = f->append<move>(get_special(SpecialReg::a0));
+    auto body = f->new_section();
+    auto after = f->new_section_branch<beqz>(current);
+    f->switch_to(body);
+    auto mixed = f->append<addu>(f->append<mul>(h, f->append<li>(33)), current);
+    f->append_void<vmips::div>(mixed, f->append<li>(1009));
+    auto next = f->append<mfhi>();
+    f->append_void<divu>(next, f->append<li>(10));
+    auto digits = f->append<mflo>();
+    f->append_void<vmips::div>(f->append<subu>(get_special(SpecialReg::zero), mixed), f->append<li>(8));
+    auto eighth = f->append<mflo>();
+    auto added = f->append<addu>(acc, f->append<addu>(digits, eighth));
+    auto updated = f->append<addi>(current, -1);
+    f->add_phi(h, next);
+    f->add_phi(acc, added);
+    f->add_phi(updated, current);
+    f->branch_existing<j>(body);
+    f->switch_to(after);
+    f->assign_special(SpecialReg::v0, acc);
+}
+
+/*!
+ * A loop of data-dependent conditionals: a diamond folding a value into 0..7 and a triangle keeping the maximum.
+ */
+static void comparisons(Module &module, const Mode &mode) {
+    auto f = create(module, mode, "compare", 1);
+    auto best = f->append<li>(0);
+    auto acc = f->append<li>(0);
+    auto current = f->append<move>(get_special(SpecialReg::a0));
+    auto body = f->new_section();
+    auto after = f->new_section_branch<beqz>(current);
+    f->switch_to(after);
+    f->assign_special(SpecialReg::v0, f->append<addu>(acc, best));
+    f->add_ret();
+    f->switch_to(body);
+    auto value = f->append<andi>(f->append<mul>(current, f->append<li>(7)), 15);
+    auto high = f->branch<bge>(value, f->append<li>(8));
+    auto folded = f->append<move>(value);
+    f->switch_to(high.second);
+    auto mirrored = f->append<subu>(f->append<li>(15), value);
+    f->join(high.first, high.second);
+    f->add_phi(folded, mirrored);
+    auto added = f->append<addu>(acc, folded);
+    auto lower = f->branch<ble>(folded, best);
+    auto raised = f->append<move>(folded);
+    f->join(lower.first, lower.second);
+    f->add_phi(best, raised);
+    auto updated = f->append<addi>(current, -1);
+    f->add_phi(acc, added);
+    f->add_phi(updated, current);
+    f->branch_existing<j>(body);
+}
+
+/*!
+ * A self-recursive sum of squares passing the accumulator along: squares(n, acc) = squares(n - 1, acc + n * n).
+ */
+static void tail_recursion(Module &module, const Mode &mode) {
+    auto f = create(module, mode, "squares", 2);
+    auto done = f->branch<beqz>(get_special(SpecialReg::a0));
+    auto square = f->append<mul>(get_special(SpecialReg::a0), get_special(SpecialReg::a0));
+    auto acc = f->append<addu>(get_special(SpecialReg::a1), square);
+    auto res = f->call(f, f->append<addi>(get_special(SpecialReg::a0), -1), acc);
+    f->assign_special(SpecialReg::v0, res);
+    f->add_ret();
+    f->switch_to(done.second);
+    f->assign_special(SpecialReg::v0, f->append<move>(get_special(SpecialReg::a1)));
+}
+
+/*!
+ * Run a kernel built with edge counters and read the counters back.
+ */
+static std::vector<int32_t> train(const Kernel &kernel, const Mode &mode) {
+    Module module(kernel.name);
+    module.instrument_edges = true;
+    kernel.build(module, mode);
+    module.finalize();
+    std::stringstream assembly;
+    module.output(assembly);
+    std::vector<int32_t> counters(std::static_pointer_cast<word>(module.edge_counters)->value.size());
+    vsim::Simulator sim;
+    if (!sim.load(assembly.str()) || sim.call(kernel.entry, kernel.args) != vsim::Status::Returned) return counters;
+    auto base = sim.symbol(module.edge_counters->name);
+    for (size_t i = 0; i < counters.size(); ++i) {
+        sim.read_word(base + i * 4, counters[i]);
+    }
+    return counters;
+}
+
+static int32_t chain_expected(int32_t n) {
+    int32_t total = 0;
+    for (int32_t x = n; x > 0; --x) {
+        // link_d(y) = link_{d-1}(y + d) + y
+        int32_t y = x, sum = 0;
+        for (int32_t depth = 7; depth > 0; --depth) {
+            sum += y;
+            y += depth;
+        }
+        total += sum + y + 1;
+    }
+    return total;
+}
+
+static int32_t hash_expected(int32_t n) {
+    int32_t h = 7, total = 0;
+    for (int32_t x = n; x != 0; --x) {
+        int32_t mixed = h * 33 + x;
+        h = mixed % 1009;
+        total += (int32_t) ((uint32_t) h / 10) + -mixed / 8;
+    }
+    return total;
+}
+
+static int32_t compare_expected(int32_t n) {
+    int32_t best = 0, total = 0;
+    for (int32_t x = n; x != 0; --x) {
+        int32_t value = (x * 7) & 15;
+        int32_t folded = value < 8 ? value : 15 - value;
+        best = std::max(best, folded);
+        total += folded;
+    }
+    return total + best;
+}
+
+int main(int argc, char **argv) {
+    const char *filter = argc > 1 ? argv[1] : "";
+    std::vector<Kernel> kernels = {
+            {"fibonacci", fibonacci, "fibonacci", {20}, 10946},
+            {"prefix_sum", prefix_sum, "sum", {1000}, 500500},
+            {"array_reduce", array_reduce, "reduce", {64}, 85344},
+            {"call_chain", call_chain, "chain", {100}, chain_expected(100)},
+            {"many_regs_13", many_regs(13), "registers", {1}, 13 + 78},
+            {"many_regs_20", many_regs(20), "registers", {1}, 20 + 190},
+            {"many_regs_32", many_regs(32), "registers", {1}, 32 + 496},
+            {"many_constants_32", many_constants(32), "constants", {1}, 1 + 7 * 496},
+            {"expressions", expressions, "expressions", {100, 3, 4, 0, 5, 6}, 100 * (49 + 10) + 7 + 6},
+            {"hashing", hashing, "hash", {500}, hash_expected(500)},
+            {"comparisons", comparisons, "compare", {500}, compare_expected(500)},
+            {"tail_recursion", tail_recursion, "squares", {1000, 0}, 1000 * 1001 * 2001 / 6},
+    };
+    std::vector<Mode> modes = {
+            {"default", false, false, Scheduling::None, false, false, false, 1},
+            {"noreorder", true, false, Scheduling::None, false, false, false, 1},
+            {"omit_frame_pointer", false, true, Scheduling::None, false, false, false, 1},
+            {"schedule_before_allocation", false, false, Scheduling::BeforeAllocation, false, false, false, 1},
+            {"schedule_after_allocation", true, false, Scheduling::AfterAllocation, false, false, false, 1},
+            {"reorder_blocks", false, false, Scheduling::None, true, false, false, 1},
+            {"profile_guided", false, false, Scheduling::None, true, true, false, 1},
+            {"optimize", false, false, Scheduling::None, false, false, true, 1},
+            {"unroll", false, false, Scheduling::BeforeAllocation, false, false, true, 4},
+            {"all", true, true, Scheduling::AfterAllocation, true, true, true, 4},
+    };
+    auto failed = false;
+    for (auto &kernel : kernels) {
+        if (!strstr(kernel.name, filter)) continue;
+        for (auto &mode : modes) {
+            Module module(kernel.name);
+            kernel.build(module, mode);
+            if (mode.profile) module.attach_profile(train(kernel, mode));
+            size_t static_instructions = 0, stack_bytes = 0, spill_loads = 0, spill_stores = 0, spilled = 0;
+            size_t rematerialized = 0;
+            module.finalize();
+            for (auto &f : module.functions) {
+                static_instructions += f->instruction_count();
+                stack_bytes += f->statistics.stack_size;
+                spill_loads += f->statistics.spill_loads;
+                spill_stores += f->statistics.spill_stores;
+                spilled += f->statistics.spilled_registers;
+                rematerialized += f->statistics.rematerialized_registers;
+            }
+            std::stringstream assembly;
+            module.output(assembly);
+
+            vsim::Simulator sim;
+            auto status = sim.load(assembly.str()) ? sim.call(kernel.entry, kernel.args) : vsim::Status::Fault;
+            auto ok = status == vsim::Status::Returned && sim.result() == kernel.expected;
+            failed |= !ok;
+            auto &c = sim.counters();
+            std::cout << "{\"kernel\": \"" << kernel.name << "\", \"mode\": \"" << mode.name
+                      << "\", \"ok\": " << (ok ? "true" : "false")
+                      << ", \"instructions\": " << c.instructions
+                      << ", \"cycles\": " << c.cycles
+                      << ", \"loads\": " << c.loads
+                      << ", \"stores\": " << c.stores
+                      << ", \"branches\": " << c.branches
+                      << ", \"calls\": " << c.calls
+                      << ", \"static_instructions\": " << static_instructions
+                      << ", \"stack_bytes\": " << stack_bytes
+                      << ", \"spilled_registers\": " << spilled
+                      << ", \"rematerialized_registers\": " << rematerialized
+                      << ", \"spill_loads\": " << spill_loads
+                      << ", \"spill_stores\": " << spill_stores << "}" << std::endl;
+            if (!ok) std::cerr << kernel.name << " (" << mode.name << "): " << sim.error() << std::endl;
+        }
+    }
+    return failed;
+}
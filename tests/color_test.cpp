@@ -19,4 +19,6 @@ int main() {
         std::cout << i << " : " << res.first[i] << std::endl;
     }
     if (res.first.empty()) abort();
+    auto biased = g.color(5, {0, 0, 3, 0, 0});
+    if (biased.first.empty() || biased.first[2] < 3) abort();
 }
\ No newline at end of file
@@ -0,0 +1,522 @@
+//
+// Execute generated code in the simulator.
+//
+#include <vcfg/virtual_mips.h>
+#include <vsim/simulator.h>
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <sstream>
+using namespace vmips;
+
+static void check(bool condition, const char *what) {
+    if (!condition) {
+        std::cerr << "failed: " << what << std::endl;
+        abort();
+    }
+}
+
+static void configure(const std::shared_ptr<Function> &f, int variant) {
+    f->noreorder = variant & 1;
+    f->omit_frame_pointer = variant & 2;
+    f->scheduling = variant & 4 ? Scheduling::BeforeAllocation
+                                : variant & 8 ? Scheduling::AfterAllocation : Scheduling::None;
+    f->reorder_blocks = variant & 16;
+}
+
+static std::string build(Module &module) {
+    module.finalize();
+    std::stringstream out;
+    module.output(out);
+    return out.str();
+}
+
+/*!
+ * Build a loop counting $a0 down to 1 and return the sum of the terms in $v0.
+ * @param f the function.
+ * @param term builds the term of an iteration from the current count.
+ */
+static void count_down(const std::shared_ptr<Function> &f,
+                       const std::function<std::shared_ptr<VirtReg>(const std::shared_ptr<VirtReg> &)> &term) {
+    auto acc = f->append<li>(0);
+    auto current = f->append<move>(get_special(SpecialReg::a0));
+    auto body = f->new_section();
+    auto after = f->new_section_branch<beqz>(current);
+    f->switch_to(body);
+    auto added = f->append<add>(acc, term(current));
+    auto updated = f->append<addi>(current, -1);
+    f->add_phi(acc, added);
+    f->add_phi(updated, current);
+    f->branch_existing<j>(body);
+    f->switch_to(after);
+    f->assign_special(SpecialReg::v0, acc);
+}
+
+static void test_handwritten() {
+    vsim::Simulator sim;
+    check(sim.load(R"(
+	.data
+table:
+	.word 3 4 5
+	.text
+f:
+	.set noreorder
+	la $t0, table
+	lw $t1, 4($t0)
+	li $t2, 0
+	beq $t1, $zero, f_end
+	addi $t2, $t2, 100 # delay slot
+	addi $t2, $t2, 1
+f_end:
+	jr $ra
+	add $v0, $t2, $t1
+	.set reorder
+)"), "load handwritten");
+    check(sim.call("f") == vsim::Status::Returned, "run handwritten");
+    check(sim.result() == 105, "delay slots");
+    check(sim.counters().loads == 1 && sim.counters().branches == 1, "counters");
+    check(!sim.load("\tadd $undef<1>, $t0, $t1\n"), "reject unallocated registers");
+}
+
+static void test_fibonacci() {
+    for (int variant = 0; variant < 32; ++variant) {
+        Module module("fibonacci");
+        auto f = module.create_function("fibonacci", 1);
+        configure(f, variant);
+        auto zero = get_special(SpecialReg::zero);
+        auto one = f->append<addi>(zero, 1);
+        auto br = f->branch<ble>(get_special(SpecialReg::a0), one);
+        auto m = f->append<addi>(get_special(SpecialReg::a0), -1);
+        auto n = f->append<addi>(get_special(SpecialReg::a0), -2);
+        auto res0 = f->call(f, m);
+        auto res1 = f->call(f, n);
+        auto sum = f->append<add>(res0, res1);
+        f->assign_special(SpecialReg::v0, sum);
+        f->add_ret();
+        f->switch_to(br.second);
+        f->assign_special(SpecialReg::v0, 1);
+
+        vsim::Simulator sim;
+        check(sim.load(build(module)), "load fibonacci");
+        check(sim.call("fibonacci", {10}) == vsim::Status::Returned, "run fibonacci");
+        check(sim.result() == 89, "fibonacci result");
+        check(sim.counters().calls == 176, "fibonacci calls");
+    }
+}
+
+static void test_prefix_sum() {
+    for (int variant = 0; variant < 32; ++variant) {
+        Module module("sum");
+        auto f = module.create_function("sum", 1);
+        configure(f, variant);
+        count_down(f, [](const std::shared_ptr<VirtReg> &current) { return current; });
+
+        vsim::Simulator sim;
+        check(sim.load(build(module)), "load sum");
+        check(sim.call("sum", {100}) == vsim::Status::Returned, "run sum");
+        check(sim.result() == 5050, "sum result");
+    }
+}
+
+static void test_arguments() {
+    Module module("arguments");
+    auto f = module.create_function("add", 6);
+    auto t0 = f->append<add>(get_special(SpecialReg::a0), get_special(SpecialReg::a1));
+    auto t1 = f->append<add>(t0, get_special(SpecialReg::a2));
+    auto t2 = f->append<add>(t1, get_special(SpecialReg::a3));
+    auto t3 = f->append<add>(t2, f->append<lw>(f->argument(4)));
+    auto t4 = f->append<add>(t3, f->append<lw>(f->argument(5)));
+    f->assign_special(SpecialReg::v0, t4);
+    auto g = module.create_function("main", 0);
+    std::vector<std::shared_ptr<VirtReg>> args;
+    for (auto i = 1; i <= 6; ++i) args.push_back(g->append<li>(i * i));
+    auto res = g->call(f, args[0], args[1], args[2], args[3], args[4], args[5]);
+    g->assign_special(SpecialReg::v0, res);
+
+    vsim::Simulator sim;
+    check(sim.load(build(module)), "load arguments");
+    check(sim.call("main") == vsim::Status::Returned, "run arguments");
+    check(sim.result() == 91, "arguments result");
+}
+
+static void test_externs() {
+    char data[] = "hello, world!\n";
+    Module module("test");
+    auto write = module.create_extern("write", 3);
+    auto malloc = module.create_extern("malloc", 1);
+    auto memcpy = module.create_extern("memcpy", 3);
+    auto free = module.create_extern("free", 1);
+    auto f = module.create_function("main", 3);
+    auto greetings = f->create_data<asciiz>(true, data);
+    auto size = f->append<li>(sizeof(data) - 1);
+    auto fd = f->append<li>(1);
+    auto waddr = f->append<la>(greetings);
+    auto addr = f->call(malloc, size);
+    f->call_void(memcpy, addr, waddr, size);
+    f->call_void(write, fd, addr, size);
+    f->call_void(free, addr);
+    f->assign_special(SpecialReg::v0, 0);
+
+    vsim::Simulator sim;
+    check(sim.load(build(module)), "load externs");
+    check(sim.call("main") == vsim::Status::Returned, "run externs");
+    check(sim.output() == data, "extern output");
+    check(sim.counters().external_calls == 4, "extern calls");
+}
+
+static void build_profiled(Module &module) {
+    auto f = module.create_function("sum", 1);
+    count_down(f, [](const std::shared_ptr<VirtReg> &current) { return current; });
+
+    auto g = module.create_function("fibonacci", 1);
+    auto one = g->append<addi>(get_special(SpecialReg::zero), 1);
+    auto br = g->branch<ble>(get_special(SpecialReg::a0), one);
+    auto m = g->append<addi>(get_special(SpecialReg::a0), -1);
+    auto n = g->append<addi>(get_special(SpecialReg::a0), -2);
+    auto res0 = g->call(g, m);
+    auto res1 = g->call(g, n);
+    g->assign_special(SpecialReg::v0, g->append<add>(res0, res1));
+    g->add_ret();
+    g->switch_to(br.second);
+    g->assign_special(SpecialReg::v0, 1);
+}
+
+static void test_profile() {
+    Module trained("profile");
+    trained.instrument_edges = true;
+    build_profiled(trained);
+    vsim::Simulator sim;
+    check(sim.load(build(trained)), "load instrumented");
+    check(sim.call("sum", {100}) == vsim::Status::Returned && sim.result() == 5050, "instrumented sum");
+    check(sim.call("fibonacci", {10}) == vsim::Status::Returned && sim.result() == 89, "instrumented fibonacci");
+    std::vector<int32_t> counters(std::static_pointer_cast<word>(trained.edge_counters)->value.size());
+    for (size_t i = 0; i < counters.size(); ++i) {
+        check(sim.read_word(sim.symbol(trained.edge_counters->name) + i * 4, counters[i]), "read counters");
+    }
+
+    Module module("profile");
+    build_profiled(module);
+    check(module.attach_profile(counters), "attach profile");
+    auto &loop = *module.functions[0]->blocks[1];
+    check(loop.edge_counts == std::vector<size_t>({1, 100}) && loop.frequency == 101, "loop counts");
+    auto &entry = *module.functions[1]->blocks[0];
+    check(entry.edge_counts == std::vector<size_t>({88, 89}) && entry.frequency == 1, "branch counts");
+    for (auto &f : module.functions) {
+        f->reorder_blocks = true;
+    }
+    check(sim.load(build(module)), "load profiled");
+    check(sim.call("sum", {100}) == vsim::Status::Returned && sim.result() == 5050, "profiled sum");
+    check(sim.call("fibonacci", {10}) == vsim::Status::Returned && sim.result() == 89, "profiled fibonacci");
+}
+
+static uint64_t run_dead_code(bool optimize) {
+    Module module("dead");
+    auto f = module.create_function("sum", 1);
+    f->optimize = optimize;
+    auto junk = f->append<li>(1);
+    // a loop-carried value nothing reads
+    count_down(f, [&](const std::shared_ptr<VirtReg> &current) {
+        f->add_phi(junk, f->append<add>(junk, f->append<mul>(current, current)));
+        return current;
+    });
+    f->add_ret();
+    // a node without in edges
+    auto orphan = std::make_shared<CFGNode>(f.get(), f->next_name());
+    f->blocks.push_back(orphan);
+    f->switch_to(orphan);
+    f->assign_special(SpecialReg::v0, junk);
+
+    vsim::Simulator sim;
+    check(sim.load(build(module)), "load dead code");
+    check(sim.call("sum", {100}) == vsim::Status::Returned && sim.result() == 5050, "dead code result");
+    check(!optimize || f->blocks.size() == 3, "unreachable node removed");
+    return sim.counters().instructions;
+}
+
+static void test_dead_code() {
+    check(run_dead_code(true) + 200 <= run_dead_code(false), "dead instructions removed");
+}
+
+static void test_constants() {
+    Module module("constants");
+    auto f = module.create_function("constants", 1);
+    f->optimize = true;
+    auto three = f->append<li>(3);
+    auto seven = f->append<add>(three, f->append<li>(4));
+    auto br = f->branch<ble>(seven, three);
+    auto sum = f->append<add>(get_special(SpecialReg::a0), seven);
+    f->assign_special(SpecialReg::v0, f->append<slt>(sum, f->append<addi>(get_special(SpecialReg::zero), 20)));
+    f->add_ret();
+    f->switch_to(br.second);
+    f->assign_special(SpecialReg::v0, 999);
+
+    vsim::Simulator sim;
+    check(sim.load(build(module)), "load constants");
+    check(sim.call("constants", {5}) == vsim::Status::Returned && sim.result() == 1, "constants result");
+    check(sim.call("constants", {15}) == vsim::Status::Returned && sim.result() == 0, "constants compare");
+    check(f->blocks.size() == 2, "constant branch pruned");
+    for (auto &node : f->blocks) {
+        for (auto &i : node->instructions) {
+            check(i->opcode != Opcode::add && i->opcode != Opcode::slt, "immediate forms");
+        }
+    }
+}
+
+static void build_division(Module &module, const char *name, bool is_signed, int32_t d) {
+    auto f = module.create_function(name, 1);
+    f->optimize = true;
+    auto x = f->append<move>(get_special(SpecialReg::a0));
+    auto k = f->append<li>(d);
+    if (is_signed) {
+        f->append_void<vmips::div>(x, k);
+    } else {
+        f->append_void<divu>(x, k);
+    }
+    auto q = f->append<mflo>();
+    auto r = f->append<mfhi>();
+    auto scaled = f->append<mul>(r, f->append<li>(129));
+    f->assign_special(SpecialReg::v0, f->append<bxor>(q, scaled));
+}
+
+static void test_strength_reduction() {
+    int32_t divisors[] = {1, -1, 2, 3, -7, 8, -16, 10, 1009, INT32_MAX, -65536};
+    int32_t dividends[] = {0, 1, -1, 7, -7, 100, -100, 123456789, INT32_MIN, INT32_MAX};
+    for (auto d : divisors) {
+        Module module("division");
+        build_division(module, "sdiv", true, d);
+        build_division(module, "udiv", false, d);
+        vsim::Simulator sim;
+        check(sim.load(build(module)), "load division");
+        for (auto &f : module.functions) {
+            for (auto &node : f->blocks) {
+                for (auto &i : node->instructions) {
+                    check(i->opcode != Opcode::div && i->opcode != Opcode::divu, "division reduced");
+                }
+            }
+        }
+        for (auto x : dividends) {
+            uint32_t q, r;
+            if (x == INT32_MIN && d == -1) {
+                q = INT32_MIN, r = 0;
+            } else {
+                q = x / d, r = x % d;
+            }
+            check(sim.call("sdiv", {x}) == vsim::Status::Returned && (uint32_t) sim.result() == (q ^ r * 129),
+                  "signed division");
+            q = (uint32_t) x / (uint32_t) d, r = (uint32_t) x % (uint32_t) d;
+            check(sim.call("udiv", {x}) == vsim::Status::Returned && (uint32_t) sim.result() == (q ^ r * 129),
+                  "unsigned division");
+        }
+    }
+}
+
+static void test_induction_variables() {
+    Module module("induction");
+    auto table = module.create_data<word>(false, 16, 0);
+    auto f = module.create_function("walk", 1);
+    f->optimize = true;
+    auto stack = f->new_memory(4 * 16);
+    auto words = f->new_static_mem(4 * 15, f->append<la>(table), 4);
+    count_down(f, [&](const std::shared_ptr<VirtReg> &current) {
+        f->append_void<array_store>(current, current, words);
+        f->append_void<array_store>(f->append<array_load>(current, words), current, stack);
+        return f->append<array_load>(current, stack);
+    });
+
+    vsim::Simulator sim;
+    check(sim.load(build(module)), "load induction");
+    check(sim.call("walk", {14}) == vsim::Status::Returned && sim.result() == 105, "induction result");
+    int32_t last;
+    check(sim.read_word(sim.symbol(table->name) + 14 * 4 + 4, last) && last == 14, "induction store");
+    for (auto &node : f->blocks) {
+        for (auto &i : node->instructions) {
+            check(i->opcode != Opcode::array_load && i->opcode != Opcode::array_store, "pointer accesses");
+        }
+    }
+}
+
+static void test_invariants() {
+    Module module("invariants");
+    auto f = module.create_function("sum", 2);
+    f->optimize = true;
+    auto factor = f->append<move>(get_special(SpecialReg::a1));
+    count_down(f, [&](const std::shared_ptr<VirtReg> &current) {
+        return f->append<addu>(current, f->append<mul>(factor, f->append<li>(3)));
+    });
+
+    vsim::Simulator sim;
+    check(sim.load(build(module)), "load invariants");
+    check(sim.call("sum", {5, 2}) == vsim::Status::Returned && sim.result() == 45, "invariants result");
+    check(sim.call("sum", {0, 2}) == vsim::Status::Returned && sim.result() == 0, "invariants skipped loop");
+    // the multiplication by 3 is reduced to sll and addu, both computed before the loop
+    size_t loops = 0;
+    for (auto &node : f->blocks) {
+        auto &instr = node->instructions;
+        if (instr.empty() || instr.back()->branch() != node) continue;
+        loops++;
+        for (auto &i : instr) {
+            check(i->opcode != Opcode::mul && i->opcode != Opcode::sll, "invariants hoisted");
+        }
+    }
+    check(loops == 1, "invariants loop");
+}
+
+static void test_if_conversion() {
+    Module module("select");
+    auto f = module.create_function("sign", 1);
+    f->optimize = true;
+    auto x = get_special(SpecialReg::a0);
+    auto negative = f->branch<bltz>(x);
+    auto positive = f->branch<bgtz>(x);
+    auto sign = f->append<li>(0);
+    f->switch_to(positive.second);
+    auto one = f->append<li>(1);
+    auto inner = f->join(positive.first, positive.second);
+    f->add_phi(sign, one);
+    f->switch_to(negative.second);
+    auto minus = f->append<li>(-1);
+    f->join(inner, negative.second);
+    f->add_phi(sign, minus);
+    f->assign_special(SpecialReg::v0, sign);
+
+    vsim::Simulator sim;
+    check(sim.load(build(module)), "load if conversion");
+    for (int32_t value : {-7, 0, 5}) {
+        check(sim.call("sign", {value}) == vsim::Status::Returned && sim.result() == (value > 0) - (value < 0),
+              "if conversion result");
+    }
+    check(sim.counters().branches == 0, "if conversion branches");
+    check(f->blocks.size() == 1, "if conversion nodes");
+}
+
+static void test_unrolling() {
+    Module module("unrolling");
+    auto f = module.create_function("squares", 1);
+    f->optimize = true;
+    f->unroll_factor = 4;
+    auto acc = f->append<li>(0);
+    auto index = f->append<li>(0);
+    auto body = f->new_section();
+    auto after = f->new_section_branch<beq>(index, get_special(SpecialReg::a0));
+    f->switch_to(body);
+    auto added = f->append<addu>(acc, f->append<mul>(index, index));
+    auto updated = f->append<addiu>(index, 1);
+    f->add_phi(acc, added);
+    f->add_phi(index, updated);
+    f->branch_existing<j>(body);
+    f->switch_to(after);
+    f->assign_special(SpecialReg::v0, acc);
+
+    vsim::Simulator sim;
+    check(sim.load(build(module)), "load unrolling");
+    for (int32_t n : {0, 1, 3, 4, 5, 11, 100}) {
+        check(sim.call("squares", {n}) == vsim::Status::Returned && sim.result() == (n - 1) * n * (2 * n - 1) / 6,
+              "unrolling result");
+    }
+    // one exit test per four iterations, plus the remaining ones
+    sim.reset_counters();
+    check(sim.call("squares", {100}) == vsim::Status::Returned && sim.counters().branches <= 100 / 4 + 5,
+          "unrolling branches");
+}
+
+static void test_tail_calls() {
+    for (int variant = 0; variant < 32; ++variant) {
+        Module module("tail");
+        auto a0 = get_special(SpecialReg::a0), a1 = get_special(SpecialReg::a1);
+        // subtraction gcd: both recursive calls are tail calls, one of them swaps the arguments
+        auto gcd = module.create_function("gcd", 2);
+        configure(gcd, variant);
+        gcd->optimize = true;
+        auto done = gcd->branch<beqz>(a1);
+        auto swap = gcd->branch<blt>(a0, a1);
+        gcd->assign_special(SpecialReg::v0, gcd->call(gcd, gcd->append<subu>(a0, a1), a1));
+        gcd->add_ret();
+        gcd->switch_to(swap.second);
+        gcd->assign_special(SpecialReg::v0, gcd->call(gcd, a1, a0));
+        gcd->add_ret();
+        gcd->switch_to(done.second);
+        gcd->assign_special(SpecialReg::v0, a0);
+        gcd->add_ret();
+        // a tail call of another function
+        auto f = module.create_function("reversed", 2);
+        configure(f, variant);
+        f->optimize = true;
+        f->assign_special(SpecialReg::v0, f->call(gcd, a1, a0));
+        // rotate(n, a, b, c, d) = n ? rotate(n - 1, b, c, d, a + n) : a - d, passing d on the stack
+        auto rotate = module.create_function("rotate", 5);
+        configure(rotate, variant);
+        rotate->optimize = true;
+        auto last = rotate->append<lw>(rotate->argument(4));
+        auto end = rotate->branch<beqz>(a0);
+        auto moved = rotate->append<addu>(get_special(SpecialReg::a1), a0);
+        auto count = rotate->append<addiu>(a0, -1);
+        rotate->assign_special(SpecialReg::v0, rotate->call(rotate, count, get_special(SpecialReg::a2),
+                                                            get_special(SpecialReg::a3), last, moved));
+        rotate->add_ret();
+        rotate->switch_to(end.second);
+        rotate->assign_special(SpecialReg::v0, rotate->append<subu>(get_special(SpecialReg::a1), last));
+        auto g = module.create_function("main", 0);
+        std::vector<std::shared_ptr<VirtReg>> args;
+        for (auto i = 0; i < 5; ++i) args.push_back(g->append<li>(i == 0 ? 10 : i));
+        g->assign_special(SpecialReg::v0, g->call(rotate, args[0], args[1], args[2], args[3], args[4]));
+
+        vsim::Simulator sim;
+        check(sim.load(build(module)), "load tail calls");
+        check(sim.call("gcd", {1071, 462}) == vsim::Status::Returned && sim.result() == 21, "tail gcd result");
+        check(sim.counters().calls == 0, "tail gcd calls");
+        sim.reset_counters();
+        check(sim.call("reversed", {462, 1071}) == vsim::Status::Returned && sim.result() == 21,
+              "tail reversed result");
+        check(sim.counters().calls == 0, "tail reversed calls");
+        int32_t v[] = {1, 2, 3, 4};
+        for (int32_t n = 10; n > 0; --n) {
+            v[0] += n;
+            std::rotate(v, v + 1, v + 4);
+        }
+        sim.reset_counters();
+        check(sim.call("main") == vsim::Status::Returned && sim.result() == v[0] - v[3], "tail rotate result");
+        check(sim.counters().calls == 1, "tail rotate calls");
+    }
+}
+
+static void test_tail_call_pressure() {
+    Module module("pressure");
+    auto a0 = get_special(SpecialReg::a0), a1 = get_special(SpecialReg::a1);
+    auto difference = module.create_function("difference", 2);
+    difference->assign_special(SpecialReg::v0, difference->append<subu>(a0, a1));
+    // the loaded argument lives across 24 products, so the tail call reads a spilled register
+    auto f = module.create_function("pressure", 2);
+    f->optimize = true;
+    auto loaded = f->append<lw>(f->argument(1));
+    std::vector<std::shared_ptr<VirtReg>> products;
+    for (auto i = 1; i <= 24; ++i) products.push_back(f->append<mul>(a0, f->append<li>(i)));
+    auto sum = products[0];
+    for (size_t i = 1; i < products.size(); ++i) sum = f->append<addu>(sum, products[i]);
+    f->assign_special(SpecialReg::v0, f->call(difference, loaded, sum));
+
+    vsim::Simulator sim;
+    check(sim.load(build(module)), "load tail call pressure");
+    check(f->statistics.spilled_registers + f->statistics.rematerialized_registers > 0, "tail call pressure spills");
+    check(sim.call("pressure", {2, 256}) == vsim::Status::Returned && sim.result() == 256 - 2 * 300,
+          "tail call pressure result");
+    check(sim.counters().calls == 0, "tail call pressure calls");
+}
+
+int main() {
+    test_handwritten();
+    test_fibonacci();
+    test_prefix_sum();
+    test_arguments();
+    test_externs();
+    test_profile();
+    test_dead_code();
+    test_constants();
+    test_strength_reduction();
+    test_induction_variables();
+    test_invariants();
+    test_if_conversion();
+    test_unrolling();
+    test_tail_calls();
+    test_tail_call_pressure();
+    std::cout << "all passed" << std::endl;
+}